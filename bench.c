@@ -0,0 +1,539 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "server.h"
+#include "room.h"
+#include "board.h"
+#include "shard.h"
+#include "netio.h"
+#include "log.h"
+#include "timer.h"
+#include "metrics.h"
+#include "message.h"
+#include "solver.h"
+#include "limiter.h"
+#include "cookie.h"
+
+#define DEFAULT_ITERATIONS 1000000
+#define BENCH_ROUNDS 5
+#define BENCH_CLIENTS 4096
+#define BENCH_WATCHERS 1024
+
+extern server_options options;
+extern shard *shards;
+extern __thread shard *current_shard;
+
+/* heap allocations made by the code under test, counted through --wrap */
+static unsigned long n_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size){
+  n_allocs += 1;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size){
+  n_allocs += 1;
+  return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size){
+  n_allocs += 1;
+  return __real_realloc(ptr, size);
+}
+
+/* the socket layer is stubbed: replies are only counted */
+static unsigned long sent_packets;
+
+void netio_init(int batch){
+}
+
+int netio_recv(int fd, udp_info **infos, int n){
+  return 0;
+}
+
+void netio_send(int fd, const udp_info *info){
+  sent_packets += 1;
+}
+
+void netio_flush(void){
+}
+
+void netio_send_many(int fd, const char *data, int n_bytes, const struct sockaddr_in *addrs, int n){
+  sent_packets += n;
+}
+
+/* results are folded here so that the compiler keeps the calls */
+static volatile unsigned long sink;
+
+typedef struct benchmark{
+
+  const char *name;
+  void (*setup)(void);
+  void (*run)(long n);
+  int cost;               /* iterations are divided by it */
+
+} benchmark;
+
+static struct sockaddr_in client_addrs[BENCH_CLIENTS];
+static room *bench_room;
+
+/**
+ *
+ * reset_shard -
+ * Gives the benchmarks a single empty shard, as the event loop
+ * engines use it: no locks and no threads.
+ *
+ */
+static void reset_shard(void){
+
+  room_table_destroy(&current_shard->rooms);
+  ring_destroy(&current_shard->ready_rooms);
+
+  if(room_table_init(&current_shard->rooms, MAX_ROOMS, BENCH_WATCHERS) ||
+     ring_init(&current_shard->ready_rooms, MAX_ROOMS)){
+    fprintf(stderr, "Could not allocate %d rooms.\n", MAX_ROOMS);
+    exit(1);
+  }
+  timer_wheel_init(&current_shard->timers);
+  timer_wheel_init(&current_shard->retransmits);
+}
+
+static void no_setup(void){
+}
+
+static void bench_decode_mov(long n){
+
+  char buffer[PACKET_SIZE] = {MOV, 1, 2, 0};
+  message_view msg;
+  mov_view mov;
+
+  long i;
+  for(i=0; i<n; ++i){
+    buffer[1] = (char)(i % 3);
+    if(decode_message(buffer, 3, &msg) == 0 && decode_mov(&msg, &mov) == 0){
+      sink += mov.col;
+    }
+  }
+}
+
+static void bench_decode_hello(long n){
+
+  static const char buffer[] = {TXT, 'H', 'e', 'l', 'l', 'o', ' ', 'd', 'e', 'l', 't', 'a', 0};
+  message_view msg;
+  txt_view txt;
+  hello_view hello;
+
+  long i;
+  for(i=0; i<n; ++i){
+    if(decode_message(buffer, sizeof(buffer), &msg) == 0 && decode_txt(&msg, &txt) == 0 &&
+       decode_hello(&txt, &hello) == 0){
+      sink += hello.fyi_mode;
+    }
+  }
+}
+
+/* addresses spread over 10.0.0.0/8 */
+static void init_client_addrs(void){
+
+  int i;
+  for(i=0; i<BENCH_CLIENTS; ++i){
+    memset(&client_addrs[i], 0, sizeof(client_addrs[i]));
+    client_addrs[i].sin_family = AF_INET;
+    client_addrs[i].sin_addr.s_addr = htonl(0x0a000000u | (unsigned)(i * 7919) % 0xffffff);
+    client_addrs[i].sin_port = htons((unsigned short)(1024 + i));
+  }
+}
+
+/* seats BENCH_CLIENTS clients, two per room */
+static void seat_clients(void){
+
+  reset_shard();
+
+  int i, player_id;
+  for(i=0; i<BENCH_CLIENTS; ++i){
+    room_join(&current_shard->rooms, &client_addrs[i], BOARD_CLASSIC, &player_id);
+  }
+}
+
+static void bench_identify_client(long n){
+
+  int player_id;
+
+  long i;
+  for(i=0; i<n; ++i){
+    sink += identify_client(&client_addrs[(i * 2654435761u) % BENCH_CLIENTS], &player_id);
+  }
+}
+
+static void bench_identify_unknown(long n){
+
+  struct sockaddr_in addr = client_addrs[0];
+  int player_id;
+
+  long i;
+  for(i=0; i<n; ++i){
+    addr.sin_port = htons((unsigned short)(40000 + i % 20000));
+    sink += identify_client(&addr, &player_id);
+  }
+}
+
+/* buckets with the defaults of the server */
+static void reset_limiter(void){
+
+  free(current_shard->limiter.sets);
+  if(limiter_init(&current_shard->limiter, options.source_rate, options.source_burst, options.shed_rate)){
+    fprintf(stderr, "Could not allocate the rate limiter.\n");
+    exit(1);
+  }
+}
+
+static void bench_limiter_admit(long n){
+
+  unsigned now_ms = limiter_now();
+
+  long i;
+  for(i=0; i<n; ++i){
+    sink += limiter_admit(&current_shard->limiter, &client_addrs[(i * 2654435761u) % BENCH_CLIENTS], now_ms + i / 1000);
+  }
+}
+
+/* a new spoofed source for every packet, all in the same millisecond */
+static void bench_limiter_admit_flood(long n){
+
+  struct sockaddr_in addr = client_addrs[0];
+  unsigned now_ms = limiter_now();
+
+  long i;
+  for(i=0; i<n; ++i){
+    addr.sin_addr.s_addr = (unsigned)(i * 2654435761u);
+    sink += limiter_admit(&current_shard->limiter, &addr, now_ms);
+  }
+}
+
+static void bench_cookie_check(long n){
+
+  unsigned char cookies[16][COOKIE_SIZE];
+  int i;
+  for(i=0; i<16; ++i){
+    cookie_make(&client_addrs[i], cookies[i]);
+  }
+
+  long j;
+  for(j=0; j<n; ++j){
+    sink += cookie_check(&client_addrs[j & 15], cookies[j & 15]);
+  }
+}
+
+static void bench_update_game_status(long n){
+
+  /* a few positions of a game, none of them over */
+  static const unsigned short positions[8][2] = {
+    {0x001, 0x000}, {0x001, 0x010}, {0x005, 0x010}, {0x005, 0x012},
+    {0x045, 0x012}, {0x045, 0x01a}, {0x0c5, 0x01a}, {0x0c5, 0x03a}
+  };
+  game_state game;
+  memset(&game, 0, sizeof(game));
+
+  long i;
+  for(i=0; i<n; ++i){
+    game.cells[0][0] = positions[i & 7][0];
+    game.cells[1][0] = positions[i & 7][1];
+    game.n_occupied = (unsigned char)((i & 7) + 1);
+    update_game_status(&game, 0, __builtin_ctz(positions[i & 7][0]));
+    sink += game.is_game_over;
+  }
+}
+
+/* moves in the middle of a 15x15 board with runs of 3 and 4 stones, none of them 5 */
+static void bench_update_game_status_gomoku(long n){
+
+  static const unsigned char played[8][2] = {
+    {7, 7}, {8, 7}, {9, 7}, {10, 7}, {7, 8}, {8, 9}, {9, 10}, {6, 6}
+  };
+  game_state game;
+  memset(&game, 0, sizeof(game));
+  game.variant = BOARD_GOMOKU;
+  game.n_occupied = 8;
+
+  int m;
+  for(m=0; m<8; ++m){
+    BOARD_SET(game.cells[0], played[m][1] * 15 + played[m][0]);
+  }
+
+  long i;
+  for(i=0; i<n; ++i){
+    update_game_status(&game, 0, played[i & 7][1] * 15 + played[i & 7][0]);
+    sink += game.is_game_over;
+  }
+}
+
+static void bench_solver_best_move(long n){
+
+  /* the same positions, seen by the player to move */
+  static const unsigned short positions[8][2] = {
+    {0x000, 0x001}, {0x001, 0x010}, {0x010, 0x005}, {0x005, 0x012},
+    {0x012, 0x045}, {0x045, 0x01a}, {0x01a, 0x0c5}, {0x0c5, 0x03a}
+  };
+  int outcome;
+
+  long i;
+  for(i=0; i<n; ++i){
+    sink += solver_best_move(positions[i & 7][0], positions[i & 7][1], &outcome);
+  }
+}
+
+/* a room in the middle of a game: X at 0,0 1,1, O at 1,0 */
+static void seat_game(void){
+
+  seat_clients();
+
+  int player_id;
+  int room_id = identify_client(&client_addrs[0], &player_id);
+  bench_room = &current_shard->rooms.rooms[room_id];
+  initialize_game(bench_room);
+
+  bench_room->game.cells[0][0] = CELL_BIT(0, 0) | CELL_BIT(1, 1);
+  bench_room->game.cells[1][0] = CELL_BIT(1, 0);
+  bench_room->game.n_occupied = 3;
+  bench_room->last_move.player_id = 0;
+  bench_room->last_move.col = 1;
+  bench_room->last_move.row = 1;
+  bench_room->fyi_mode[0] = FYI_LEGACY;
+  bench_room->fyi_mode[1] = FYI_COMPACT;
+}
+
+static void bench_encode(long n, int mode){
+
+  char buffer[PACKET_SIZE];
+
+  long i;
+  for(i=0; i<n; ++i){
+    sink += encode_board(bench_room, mode, buffer);
+  }
+}
+
+static void bench_encode_legacy(long n){
+  bench_encode(n, FYI_LEGACY);
+}
+
+static void bench_encode_compact(long n){
+  bench_encode(n, FYI_COMPACT);
+}
+
+static void bench_encode_delta(long n){
+  bench_encode(n, FYI_DELTA);
+}
+
+static void bench_send_information_messages(long n){
+
+  long i;
+  for(i=0; i<n; ++i){
+    send_information_messages(bench_room);
+  }
+}
+
+/* the same game, followed by BENCH_WATCHERS spectators */
+static void seat_watched_game(void){
+
+  seat_game();
+
+  int i;
+  for(i=0; i<BENCH_WATCHERS; ++i){
+    struct sockaddr_in addr = client_addrs[i];
+    addr.sin_port = htons((unsigned short)(40000 + i));
+    room_watch(&current_shard->rooms, (int)(bench_room - current_shard->rooms.rooms), &addr);
+  }
+}
+
+static void set_packet(udp_info *info, const struct sockaddr_in *addr, const char *data, int n_bytes){
+  memcpy(info->buffer, data, n_bytes);
+  info->n_bytes = n_bytes;
+  info->client_addr = *addr;
+  info->len = sizeof(*addr);
+}
+
+/**
+ *
+ * bench_game -
+ * Plays whole games through the same path as a packet of the
+ * event loop engines: handle_packet, then the game logic of
+ * the rooms that became ready. Each game is two joins, a Hello
+ * and the echo of its cookie, and the nine moves of a draw.
+ *
+ */
+static void bench_game(long n){
+
+  static const char draw[9][2] = {
+    {0, 0}, {1, 0}, {2, 0}, {1, 1}, {0, 1}, {2, 1}, {1, 2}, {0, 2}, {2, 2}
+  };
+  static const char hello[] = {TXT, 'H', 'e', 'l', 'l', 'o', 0};
+
+  /* what each client sends back, built once */
+  char echoes[2][1 + COOKIE_SIZE + sizeof(hello)];
+  int c;
+  for(c=0; c<2; ++c){
+    echoes[c][0] = CKE;
+    cookie_make(&client_addrs[c], (unsigned char *)echoes[c] + 1);
+    memcpy(echoes[c] + 1 + COOKIE_SIZE, hello, sizeof(hello));
+  }
+
+  udp_info info;
+
+  long i;
+  int m;
+  for(i=0; i<n; ++i){
+    for(c=0; c<2; ++c){
+      set_packet(&info, &client_addrs[c], hello, sizeof(hello));
+      handle_packet(&info);
+      set_packet(&info, &client_addrs[c], echoes[c], sizeof(echoes[c]));
+      handle_packet(&info);
+    }
+    process_ready_rooms();
+
+    for(m=0; m<9; ++m){
+      char mov[3] = {MOV, draw[m][0], draw[m][1]};
+      set_packet(&info, &client_addrs[m & 1], mov, 3);
+      handle_packet(&info);
+      process_ready_rooms();
+    }
+  }
+}
+
+static const benchmark benchmarks[] = {
+  {"decode_mov", no_setup, bench_decode_mov, 1},
+  {"decode_hello", no_setup, bench_decode_hello, 1},
+  {"identify_client", seat_clients, bench_identify_client, 1},
+  {"identify_client_unknown", seat_clients, bench_identify_unknown, 1},
+  {"limiter_admit", reset_limiter, bench_limiter_admit, 1},
+  {"limiter_admit_flood", reset_limiter, bench_limiter_admit_flood, 1},
+  {"cookie_check", no_setup, bench_cookie_check, 1},
+  {"update_game_status", no_setup, bench_update_game_status, 1},
+  {"update_game_status_gomoku", no_setup, bench_update_game_status_gomoku, 1},
+  {"solver_best_move", no_setup, bench_solver_best_move, 1},
+  {"encode_board_legacy", seat_game, bench_encode_legacy, 1},
+  {"encode_board_compact", seat_game, bench_encode_compact, 1},
+  {"encode_board_delta", seat_game, bench_encode_delta, 1},
+  {"send_information_messages", seat_game, bench_send_information_messages, 1},
+  {"fanout_1024_watchers", seat_watched_game, bench_send_information_messages, 1},
+  {"game_2_joins_9_moves", reset_shard, bench_game, 20},
+};
+
+static unsigned long now_ns(void){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long)now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b){
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ *
+ * run_benchmark -
+ * Times a benchmark over several rounds, after a warm up, and
+ * prints the fastest and the median round in ns per operation,
+ * with the heap allocations and the packets sent per operation.
+ *
+ */
+static void run_benchmark(const benchmark *bench, long iterations){
+
+  long n = iterations / bench->cost;
+  if(n < 1){
+    n = 1;
+  }
+
+  bench->setup();
+  bench->run(n / 10 + 1);
+
+  double rounds[BENCH_ROUNDS];
+  unsigned long allocs = 0;
+  unsigned long sent = 0;
+
+  int r;
+  for(r=0; r<BENCH_ROUNDS; ++r){
+    unsigned long allocs_before = n_allocs;
+    unsigned long sent_before = sent_packets;
+    unsigned long start = now_ns();
+    bench->run(n);
+    rounds[r] = (double)(now_ns() - start) / n;
+    allocs += n_allocs - allocs_before;
+    sent += sent_packets - sent_before;
+  }
+
+  qsort(rounds, BENCH_ROUNDS, sizeof(double), compare_doubles);
+  printf("%-28s %12ld %12.1f %12.1f %12.3f %12.1f\n", bench->name, n, rounds[0],
+         rounds[BENCH_ROUNDS / 2], (double)allocs / ((double)n * BENCH_ROUNDS),
+         (double)sent / ((double)n * BENCH_ROUNDS));
+  fflush(stdout);
+}
+
+/**
+ *
+ * main -
+ * ./bench [ITERATIONS] [NAME...]
+ * Runs the benchmarks whose name starts with one of the given
+ * names, or all of them.
+ *
+ */
+int main(int argc, char **argv){
+
+  long iterations = DEFAULT_ITERATIONS;
+  int first_name = 1;
+  if(argc > 1 && sscanf(argv[1], "%ld", &iterations) == 1){
+    first_name = 2;
+  }
+  if(iterations < 1){
+    printf("Usage: %s [ITERATIONS] [NAME...]\n", argv[0]);
+    return 1;
+  }
+
+  /* the defaults of the server, without its threads */
+  char *server_argv[] = {argv[0], "--engine", "epoll", "0", NULL};
+  if(parse_options(4, server_argv, &options)){
+    return 1;
+  }
+  atomic_store(&log_level, LOG_OFF);
+  board_init();
+  solver_init();
+  cookie_init();
+  metrics_register(0);
+
+  shards = (shard *)calloc(1, sizeof(shard));
+  if(shards == NULL){
+    fprintf(stderr, "Malloc Error\n");
+    return 1;
+  }
+  current_shard = &shards[0];
+  current_shard->fanout = (struct sockaddr_in *)calloc(BENCH_WATCHERS, sizeof(struct sockaddr_in));
+  if(current_shard->fanout == NULL){
+    fprintf(stderr, "Malloc Error\n");
+    return 1;
+  }
+  init_client_addrs();
+
+  printf("%-28s %12s %12s %12s %12s %12s\n", "benchmark", "iterations", "best ns/op", "median ns/op",
+         "allocs/op", "packets/op");
+
+  int i, j;
+  for(i=0; i<(int)(sizeof(benchmarks) / sizeof(benchmarks[0])); ++i){
+    int selected = first_name == argc;
+    for(j=first_name; j<argc; ++j){
+      selected |= !strncmp(benchmarks[i].name, argv[j], strlen(argv[j]));
+    }
+    if(selected){
+      run_benchmark(&benchmarks[i], iterations);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,105 @@
+#include "board.h"
+
+/* rows, columns and diagonals of the 3x3 grid */
+const unsigned short board_lines[N_LINES] = {
+  0x007, 0x038, 0x1c0,
+  0x049, 0x092, 0x124,
+  0x111, 0x054
+};
+
+unsigned char board_wins[FULL_BOARD + 1];
+
+#define BOARD_ENTRY(NAME, name, size, k) {#name, size, k},
+const board_variant board_variants[N_BOARDS] = {
+  BOARD_VARIANTS(BOARD_ENTRY)
+};
+#undef BOARD_ENTRY
+
+/**
+ *
+ * board_init -
+ * Fills the table that tells, for each of the 512 sets of
+ * cells a player can own, if the set contains a line. Must be
+ * called once before any game starts.
+ *
+ */
+void board_init(void){
+
+  unsigned mask;
+  int i;
+
+  for(mask=0; mask<=FULL_BOARD; ++mask){
+    board_wins[mask] = 0;
+    for(i=0; i<N_LINES; ++i){
+      if((mask & board_lines[i]) == board_lines[i]){
+        board_wins[mask] = 1;
+        break;
+      }
+    }
+  }
+}
+
+/* counts the cells of a player from (col, row) in one direction, up to k - 1 */
+static inline __attribute__((always_inline))
+int run_length(const board_cells cells, int col, int row, int dcol, int drow, int size, int k){
+
+  int n = 0;
+  col += dcol;
+  row += drow;
+  while(n < k - 1 && col >= 0 && col < size && row >= 0 && row < size && BOARD_TEST(cells, row * size + col)){
+    n += 1;
+    col += dcol;
+    row += drow;
+  }
+  return n;
+}
+
+/**
+ *
+ * wins_through -
+ * Checks the four lines through the cell just played, so the
+ * cost depends on k and not on the size of the board. The 3x3
+ * board is a single lookup in board_wins instead. Inlined into
+ * each variant with size and k known to the compiler.
+ *
+ */
+static inline __attribute__((always_inline))
+int wins_through(const board_cells cells, int cell, int size, int k){
+
+  if(size == 3 && k == 3){
+    return board_is_win(cells[0]);
+  }
+
+  int col = cell % size;
+  int row = cell / size;
+
+  return run_length(cells, col, row, 1, 0, size, k) + run_length(cells, col, row, -1, 0, size, k) >= k - 1 ||
+         run_length(cells, col, row, 0, 1, size, k) + run_length(cells, col, row, 0, -1, size, k) >= k - 1 ||
+         run_length(cells, col, row, 1, 1, size, k) + run_length(cells, col, row, -1, -1, size, k) >= k - 1 ||
+         run_length(cells, col, row, 1, -1, size, k) + run_length(cells, col, row, -1, 1, size, k) >= k - 1;
+}
+
+#define BOARD_WINS_AFTER(NAME, name, size, k) \
+  static int wins_after_##name(const board_cells cells, int cell){ \
+    return wins_through(cells, cell, size, k); \
+  }
+BOARD_VARIANTS(BOARD_WINS_AFTER)
+#undef BOARD_WINS_AFTER
+
+/**
+ *
+ * board_wins_after -
+ * Tells if the player owning cells won by playing cell, on a
+ * board of the given variant.
+ *
+ */
+int board_wins_after(int variant, const board_cells cells, int cell){
+
+#define BOARD_CASE(NAME, name, size, k) case BOARD_##NAME: return wins_after_##name(cells, cell);
+  switch(variant){
+    BOARD_VARIANTS(BOARD_CASE)
+  }
+#undef BOARD_CASE
+
+  return 0;
+}
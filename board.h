@@ -0,0 +1,51 @@
+#ifndef BOARD_H
+#define BOARD_H
+
+/* cells are bits of a 9-bit mask, bit row*3 + col */
+#define CELL_BIT(col, row) (1u << ((row) * 3 + (col)))
+#define FULL_BOARD 0x1ffu
+#define N_LINES 8
+
+/*
+ * Board variants: name, cells per side, and cells in a row that
+ * win. Each variant gets its own copy of the win check, built
+ * with the size and the length of a line as constants.
+ */
+#define BOARD_VARIANTS(X) \
+  X(CLASSIC, classic, 3, 3) \
+  X(FOUR, four, 7, 4) \
+  X(GOMOKU, gomoku, 15, 5)
+
+#define BOARD_ENUM(NAME, name, size, k) BOARD_##NAME,
+enum { BOARD_VARIANTS(BOARD_ENUM) N_BOARDS };
+#undef BOARD_ENUM
+
+#define BOARD_MAX_SIZE 15
+#define BOARD_MAX_CELLS (BOARD_MAX_SIZE * BOARD_MAX_SIZE)
+#define BOARD_WORDS ((BOARD_MAX_CELLS + 63) / 64)
+
+/* cells of a player on any board: bit row*size + col */
+typedef unsigned long long board_cells[BOARD_WORDS];
+
+#define BOARD_TEST(cells, cell) ((int)((cells)[(cell) >> 6] >> ((cell) & 63) & 1))
+#define BOARD_SET(cells, cell) ((cells)[(cell) >> 6] |= 1ULL << ((cell) & 63))
+
+typedef struct board_variant{
+
+  const char *name;
+  int size;
+  int k;
+
+} board_variant;
+
+extern const board_variant board_variants[N_BOARDS];
+extern const unsigned short board_lines[N_LINES];
+extern unsigned char board_wins[FULL_BOARD + 1];
+
+void board_init(void);
+int board_wins_after(int variant, const board_cells cells, int cell);
+
+/* 1 if the cells of a player contain a full line of the 3x3 board */
+#define board_is_win(mask) (board_wins[(mask) & FULL_BOARD])
+
+#endif
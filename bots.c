@@ -0,0 +1,408 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+
+#include "client.h"
+#include "bots.h"
+#include "metrics.h"
+
+/* counters of the whole run, only touched by the bot loop */
+typedef struct bot_stats{
+
+  unsigned long games;
+  unsigned long moves;
+  unsigned long rejected;     /* Hellos answered with END 0xff */
+  unsigned long timeouts;     /* games lost because the server removed a bot */
+  unsigned long stalled;      /* bots that heard nothing and started over */
+  histogram rtt;              /* from a move to the board that shows it */
+
+} bot_stats;
+
+static bot *bots;
+static int *idle_bots;
+static int n_idle;
+
+static int epfd;
+static struct sockaddr_in server;
+static const bot_options *options;
+static bot_stats stats;
+
+/* xorshift32, picks the cells of the bots */
+static unsigned random_state = 2463534242u;
+
+static unsigned next_random(void){
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return random_state;
+}
+
+/**
+ *
+ * open_bot_socket -
+ * Gives a bot a new socket, connected to the server so that
+ * the kernel only delivers the packets of the server, and
+ * watches it.
+ *
+ * Returns 0 on success and 1 on error.
+ *
+ */
+static int open_bot_socket(int id){
+
+  int sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if(sockfd < 0){
+    perror("socket creation failed");
+    return 1;
+  }
+
+  if(connect(sockfd, (const struct sockaddr *)&server, sizeof(server)) < 0){
+    perror("connect");
+    close(sockfd);
+    return 1;
+  }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u32 = (unsigned)id;
+  if(epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev) < 0){
+    perror("epoll_ctl");
+    close(sockfd);
+    return 1;
+  }
+
+  bots[id].sockfd = sockfd;
+  bots[id].state = BOT_IDLE;
+  return 0;
+}
+
+static void bot_send(bot *b, const char *msg, int n_bytes){
+  /* a lost packet shows up as a stalled bot */
+  send(b->sockfd, msg, n_bytes, 0);
+}
+
+/* writes the Hello of the bots, with its NUL, and returns its length */
+static int build_hello(char *hello, int size){
+
+  hello[0] = TXT;
+  return 2 + snprintf(hello + 1, size - 1, "Hello%s%s",
+                      options->fyi_mode ? " " : "", options->fyi_mode ? options->fyi_mode : "");
+}
+
+static void bot_join(bot *b, unsigned long now){
+
+  char hello[32];
+  int n_bytes = build_hello(hello, sizeof(hello));
+
+  b->state = BOT_JOINING;
+  b->seat = 0;
+  b->occupied = 0;
+  b->board_seq = 0;
+  b->move_ns = 0;
+  b->heard_ns = now;
+  bot_send(b, hello, n_bytes);
+}
+
+/* plays a random free cell */
+static void bot_move(bot *b, unsigned long now){
+
+  int n_free = 9 - __builtin_popcount(b->occupied & 0x1ff);
+  if(n_free <= 0){
+    return;
+  }
+
+  int skip = (int)(next_random() % n_free);
+  int cell;
+  for(cell=0; cell<9; ++cell){
+    if(!(b->occupied >> cell & 1) && skip-- == 0){
+      break;
+    }
+  }
+
+  char mov[3];
+  mov[0] = MOV;
+  mov[1] = (char)(cell % 3);
+  mov[2] = (char)(cell / 3);
+
+  b->state = BOT_PLAYING;
+  b->move_ns = now;
+  bot_send(b, mov, 3);
+}
+
+static void bot_leave_game(int id){
+  bots[id].state = BOT_IDLE;
+  idle_bots[n_idle++] = id;
+}
+
+/* a new board arrived: it answers the last move of the bot, if any */
+static void bot_board(bot *b, unsigned long now){
+
+  b->state = BOT_PLAYING;
+  if(b->move_ns != 0){
+    histogram_record(&stats.rtt, now - b->move_ns);
+    stats.moves += 1;
+    b->move_ns = 0;
+  }
+}
+
+/**
+ *
+ * bot_handle -
+ * Plays the part of a client for one message of the server:
+ * mirrors the board, answers MYM with a free cell, and goes
+ * back to the idle bots at the end of the game.
+ *
+ */
+static void bot_handle(int id, const char *buffer, int n_bytes, unsigned long now){
+
+  bot *b = &bots[id];
+  b->heard_ns = now;
+
+  int i;
+  switch(buffer[0]){
+    case TXT:
+      if(b->seat == 0){
+        const char *seat = strstr(buffer + 1, "player ");
+        if(seat != NULL){
+          b->seat = atoi(seat + 7);
+        }
+      }
+      break;
+
+    case MYM:
+      if(b->state != BOT_IDLE){
+        bot_move(b, now);
+      }
+      break;
+
+    case CKE:
+      /* the Hello again, behind the cookie the server gave for it */
+      if(b->state == BOT_JOINING && n_bytes >= 1 + COOKIE_SIZE){
+        char echo[1 + COOKIE_SIZE + 32];
+        memcpy(echo, buffer, 1 + COOKIE_SIZE);
+        bot_send(b, echo, 1 + COOKIE_SIZE + build_hello(echo + 1 + COOKIE_SIZE, 32));
+      }
+      break;
+
+    case FYI:
+      b->occupied = 0;
+      for(i=0; i<buffer[1] && 4+3*i < n_bytes; ++i){
+        unsigned col = (unsigned char)buffer[3+3*i], row = (unsigned char)buffer[4+3*i];
+        if(col < 3 && row < 3){
+          b->occupied |= 1u << (row * 3 + col);
+        }
+      }
+      bot_board(b, now);
+      break;
+
+    case FYC:
+      if(n_bytes >= 5){
+        b->occupied = (unsigned char)buffer[2] | (unsigned char)buffer[3] | ((buffer[4] & 3) ? 1u << 8 : 0);
+        b->board_seq = (unsigned char)buffer[1];
+        bot_board(b, now);
+      }
+      break;
+
+    case FYD:
+      if(n_bytes >= 3){
+        int seq = (unsigned char)buffer[1];
+        int cell = buffer[2] & 0x0f;
+        if(seq != b->board_seq + 1 || cell > 8){
+          char snapshot_request = SNP;
+          bot_send(b, &snapshot_request, 1);
+          break;
+        }
+        b->occupied |= 1u << cell;
+        b->board_seq = seq;
+        bot_board(b, now);
+      }
+      break;
+
+    case END:
+      if(buffer[1] == (char) 0xff){
+        stats.rejected += 1;
+      } else if(b->seat == 1){
+        /* both players get the END: counts the game once */
+        stats.games += 1;
+      }
+      if(b->state != BOT_IDLE){
+        bot_leave_game(id);
+      }
+      break;
+
+    case LFT:
+      if(b->state == BOT_PLAYING){
+        stats.timeouts += 1;
+      }
+      if(b->state != BOT_IDLE){
+        bot_leave_game(id);
+      }
+      break;
+  }
+}
+
+static void bot_receive(int id, unsigned long now){
+
+  char buffer[MAX_SIZE];
+  while(1){
+    int n_bytes = recv(bots[id].sockfd, buffer, MAX_SIZE - 1, 0);
+    if(n_bytes <= 0){
+      return;
+    }
+    buffer[n_bytes] = '\0';
+    bot_handle(id, buffer, n_bytes, now);
+  }
+}
+
+/**
+ *
+ * bot_restart -
+ * Gives up on a bot that heard nothing for too long: leaves
+ * its room and starts over from a new socket, hence a new
+ * address for the server.
+ *
+ */
+static void bot_restart(int id){
+
+  char leave = LFT;
+  bot_send(&bots[id], &leave, 1);
+  close(bots[id].sockfd);
+  stats.stalled += 1;
+
+  if(open_bot_socket(id) == 0){
+    idle_bots[n_idle++] = id;
+  }
+}
+
+static void print_stats(const char *label, double seconds, double interval,
+                        unsigned long games, unsigned long moves){
+
+  int n_playing = options->n_bots - n_idle;
+  printf("[bots] %s %.1fs: %.0f games/s, %.0f moves/s, rtt p50 %lu us, p99 %lu us, max %lu us, "
+         "%d in game, %lu rejected, %lu timeouts, %lu stalled\n",
+         label, seconds, games / interval, moves / interval,
+         histogram_percentile(&stats.rtt, 0.5) / 1000, histogram_percentile(&stats.rtt, 0.99) / 1000,
+         atomic_load(&stats.rtt.max) / 1000, n_playing, stats.rejected, stats.timeouts, stats.stalled);
+  fflush(stdout);
+}
+
+/**
+ *
+ * run_bots -
+ * Load generator: drives n_bots simulated players from a single
+ * thread, one UDP socket each, multiplexed with epoll. Idle bots
+ * say Hello at up to rate joins per second, play random legal
+ * moves when asked, and join again when their game ends. Prints
+ * the throughput and the round trip of the moves every second,
+ * then a summary after duration seconds.
+ *
+ * Returns 0 on success and 1 on error.
+ *
+ */
+int run_bots(const struct sockaddr_in *servaddr, const bot_options *opts){
+
+  options = opts;
+  server = *servaddr;
+  random_state ^= (unsigned)getpid();
+
+  /* one descriptor per bot */
+  struct rlimit limit;
+  if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max){
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  bots = (bot *)calloc(opts->n_bots, sizeof(bot));
+  idle_bots = (int *)malloc(opts->n_bots * sizeof(int));
+  struct epoll_event *events = (struct epoll_event *)malloc(opts->n_bots * sizeof(struct epoll_event));
+  if(bots == NULL || idle_bots == NULL || events == NULL){
+    fprintf(stderr, "Malloc Error\n");
+    return 1;
+  }
+
+  epfd = epoll_create1(0);
+  if(epfd < 0){
+    perror("epoll_create1");
+    return 1;
+  }
+
+  int i;
+  for(i=opts->n_bots-1; i>=0; --i){
+    if(open_bot_socket(i)){
+      fprintf(stderr, "Could not open %d sockets.\n", opts->n_bots);
+      return 1;
+    }
+    idle_bots[n_idle++] = i;
+  }
+
+  unsigned long start = metrics_now();
+  unsigned long end = start + (unsigned long)opts->duration * 1000000000UL;
+  unsigned long next_report = start + 1000000000UL;
+  unsigned long joins = 0;
+  unsigned long last_games = 0, last_moves = 0;
+
+  unsigned long now = start;
+  while(now < end){
+    /* idle bots join at the given rate, bursting for one second at most */
+    unsigned long allowed = opts->rate ? (now - start) / 1000 * opts->rate / 1000000 + 1 : joins + n_idle;
+    if(opts->rate && joins + opts->rate < allowed){
+      joins = allowed - opts->rate;
+    }
+    while(n_idle > 0 && joins < allowed){
+      bot_join(&bots[idle_bots[--n_idle]], now);
+      joins += 1;
+    }
+
+    int n_events = epoll_wait(epfd, events, opts->n_bots, 100);
+    if(n_events < 0 && errno != EINTR){
+      perror("epoll_wait");
+      return 1;
+    }
+
+    now = metrics_now();
+    for(i=0; i<n_events; ++i){
+      bot_receive((int)events[i].data.u32, now);
+    }
+
+    if(now >= next_report){
+      /* a bot that waits for an opponent may stay silent, not one in a game */
+      for(i=0; i<opts->n_bots; ++i){
+        const bot *b = &bots[i];
+        if(b->state != BOT_IDLE && (b->state == BOT_PLAYING || b->seat == 0) &&
+           now - b->heard_ns > BOT_STALL_SECONDS * 1000000000UL){
+          bot_restart(i);
+        }
+      }
+
+      print_stats("at", (now - start) / 1e9, 1.0, stats.games - last_games, stats.moves - last_moves);
+      last_games = stats.games;
+      last_moves = stats.moves;
+      next_report += 1000000000UL;
+    }
+  }
+
+  /* frees the rooms of the bots still seated */
+  char leave = LFT;
+  for(i=0; i<opts->n_bots; ++i){
+    if(bots[i].state != BOT_IDLE){
+      bot_send(&bots[i], &leave, 1);
+    }
+    close(bots[i].sockfd);
+  }
+
+  double seconds = (now - start) / 1e9;
+  print_stats("total", seconds, seconds, stats.games, stats.moves);
+  printf("[bots] %lu games, %lu moves, rtt p50 %lu us, p90 %lu us, p99 %lu us, p99.9 %lu us\n",
+         stats.games, stats.moves,
+         histogram_percentile(&stats.rtt, 0.5) / 1000, histogram_percentile(&stats.rtt, 0.9) / 1000,
+         histogram_percentile(&stats.rtt, 0.99) / 1000, histogram_percentile(&stats.rtt, 0.999) / 1000);
+
+  close(epfd);
+  return 0;
+}
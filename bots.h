@@ -0,0 +1,39 @@
+#ifndef BOTS_H
+#define BOTS_H
+
+#include <netinet/in.h>
+
+#define DEFAULT_BOT_DURATION 10
+
+/* a bot that hears nothing from the server for this long starts over */
+#define BOT_STALL_SECONDS 5
+
+#define BOT_IDLE 0          /* not in a game, waits for its turn to join */
+#define BOT_JOINING 1       /* sent Hello, waits for an opponent or a move request */
+#define BOT_PLAYING 2
+
+typedef struct bot_options{
+
+  int n_bots;
+  int rate;               /* joins per second, 0 for no limit */
+  int duration;           /* seconds */
+  const char *fyi_mode;   /* board encoding asked for in the Hello */
+
+} bot_options;
+
+/* one simulated player, with its own socket */
+typedef struct bot{
+
+  int sockfd;
+  int state;
+  int seat;               /* 1 or 2, from the welcome message */
+  unsigned occupied;      /* cells taken, bit row*3 + col */
+  int board_seq;          /* moves played, for the delta encoding */
+  unsigned long move_ns;  /* when the last move was sent, 0 once answered */
+  unsigned long heard_ns; /* when the server last sent something */
+
+} bot;
+
+int run_bots(const struct sockaddr_in *servaddr, const bot_options *opts);
+
+#endif
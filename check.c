@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "server.h"
+#include "room.h"
+#include "board.h"
+#include "shard.h"
+#include "netio.h"
+#include "log.h"
+#include "metrics.h"
+#include "solver.h"
+#include "cookie.h"
+#include "limiter.h"
+
+#define CHECK_ROOMS 16
+#define CHECK_WATCHERS 16
+
+extern server_options options;
+extern shard *shards;
+extern __thread shard *current_shard;
+
+/* the socket layer is stubbed: the replies are kept for the checks */
+static udp_info last_sent;
+static int n_sent;
+
+void netio_init(int batch){
+}
+
+int netio_recv(int fd, udp_info **infos, int n){
+  return 0;
+}
+
+void netio_send(int fd, const udp_info *info){
+  last_sent = *info;
+  n_sent += 1;
+}
+
+void netio_flush(void){
+}
+
+void netio_send_many(int fd, const char *data, int n_bytes, const struct sockaddr_in *addrs, int n){
+  n_sent += n;
+}
+
+static int n_failed;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      n_failed += 1; \
+    } \
+  } while (0)
+
+static struct sockaddr_in make_addr(unsigned ip, unsigned short port){
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(ip);
+  addr.sin_port = htons(port);
+  return addr;
+}
+
+/* hands a packet to the server as if addr had sent it, and lets the games run */
+static void receive(const struct sockaddr_in *addr, const char *data, int n_bytes){
+
+  udp_info info;
+  memcpy(info.buffer, data, n_bytes);
+  info.n_bytes = n_bytes;
+  info.client_addr = *addr;
+  info.len = sizeof(*addr);
+
+  n_sent = 0;
+  handle_packet(&info);
+  process_ready_rooms();
+}
+
+/* a TXT message with its NUL, behind a cookie if one is given */
+static int build_txt(char *packet, const unsigned char *cookie, const char *text){
+
+  int n = 0;
+  if (cookie != NULL) {
+    packet[0] = CKE;
+    memcpy(packet + 1, cookie, COOKIE_SIZE);
+    n = 1 + COOKIE_SIZE;
+  }
+  packet[n] = TXT;
+  strcpy(packet + n + 1, text);
+  return n + 2 + (int)strlen(text);
+}
+
+/* sends text, then its echo with the cookie of the reply */
+static void join(const struct sockaddr_in *addr, const char *text){
+
+  char packet[PACKET_SIZE];
+  receive(addr, packet, build_txt(packet, NULL, text));
+
+  unsigned char cookie[COOKIE_SIZE];
+  memcpy(cookie, last_sent.buffer + 1, COOKIE_SIZE);
+  receive(addr, packet, build_txt(packet, cookie, text));
+}
+
+static void check_hello(void){
+
+  struct sockaddr_in x = make_addr(0x0a000001, 5001);
+  struct sockaddr_in o = make_addr(0x0a000002, 5002);
+  int player_id;
+  char packet[PACKET_SIZE];
+
+  /* a Hello alone only gets a cookie */
+  receive(&x, packet, build_txt(packet, NULL, "Hello"));
+  CHECK(n_sent == 1 && last_sent.buffer[0] == CKE && last_sent.n_bytes == 1 + COOKIE_SIZE);
+  CHECK(room_lookup(&current_shard->rooms, &x, &player_id) == NO_ROOM);
+
+  /* a forged cookie gets a new one, and no seat */
+  unsigned char forged[COOKIE_SIZE] = {0};
+  receive(&x, packet, build_txt(packet, forged, "Hello"));
+  CHECK(n_sent == 1 && last_sent.buffer[0] == CKE);
+  CHECK(room_lookup(&current_shard->rooms, &x, &player_id) == NO_ROOM);
+
+  /* the cookie of another address gets no seat either */
+  unsigned char stolen[COOKIE_SIZE];
+  cookie_make(&o, stolen);
+  receive(&x, packet, build_txt(packet, stolen, "Hello"));
+  CHECK(room_lookup(&current_shard->rooms, &x, &player_id) == NO_ROOM);
+
+  join(&x, "Hello");
+  CHECK(room_lookup(&current_shard->rooms, &x, &player_id) == 0 && player_id == 0);
+  join(&o, "Hello");
+  CHECK(room_lookup(&current_shard->rooms, &o, &player_id) == 0 && player_id == 1);
+  CHECK(current_shard->rooms.rooms[0].state == ROOM_PLAYING);
+}
+
+static void check_watch(void){
+
+  struct sockaddr_in victim = make_addr(0x0b000001, 6001);
+  int player_id;
+  char packet[PACKET_SIZE];
+
+  /* an unechoed Watch leaves no entry and is only answered with a cookie */
+  receive(&victim, packet, build_txt(packet, NULL, "Watch 0"));
+  CHECK(n_sent == 1 && last_sent.buffer[0] == CKE && last_sent.n_bytes == 1 + COOKIE_SIZE);
+  CHECK(room_lookup(&current_shard->rooms, &victim, &player_id) == NO_ROOM);
+  CHECK(current_shard->rooms.rooms[0].n_watchers == 0);
+
+  receive(&victim, packet, build_txt(packet, NULL, "Watch"));
+  CHECK(room_lookup(&current_shard->rooms, &victim, &player_id) == NO_ROOM);
+  CHECK(current_shard->rooms.rooms[0].n_watchers == 0);
+
+  unsigned char forged[COOKIE_SIZE] = {0};
+  receive(&victim, packet, build_txt(packet, forged, "Watch 0"));
+  CHECK(n_sent == 1 && last_sent.buffer[0] == CKE);
+  CHECK(room_lookup(&current_shard->rooms, &victim, &player_id) == NO_ROOM);
+  CHECK(current_shard->rooms.rooms[0].n_watchers == 0);
+
+  /* the echo takes a spectator slot */
+  struct sockaddr_in spectator = make_addr(0x0b000002, 6002);
+  join(&spectator, "Watch 0");
+  CHECK(room_lookup(&current_shard->rooms, &spectator, &player_id) == 0 && player_id >= WATCHER);
+  CHECK(current_shard->rooms.rooms[0].n_watchers == 1);
+}
+
+static void check_limiter(void){
+
+  limiter lim;
+  if(limiter_init(&lim, 1, 2, 0)){
+    CHECK(0);
+    return;
+  }
+
+  /* port 0 is a source like any other: its bucket runs dry */
+  struct sockaddr_in zero = make_addr(0x0c000001, 0);
+  unsigned now_ms = 1000;
+  CHECK(limiter_admit(&lim, &zero, now_ms) == 1);
+  CHECK(limiter_admit(&lim, &zero, now_ms) == 1);
+  CHECK(limiter_admit(&lim, &zero, now_ms) == 0);
+  CHECK(limiter_admit(&lim, &zero, now_ms + 1000) == 1);
+
+  free(lim.sets);
+}
+
+/**
+ *
+ * main -
+ * ./check
+ * Runs the server core on stubbed sockets and checks that a
+ * client takes a seat or a spectator slot only by echoing the
+ * cookie of its address, and that every source has a bucket.
+ *
+ */
+int main(int argc, char **argv){
+
+  char *server_argv[] = {argv[0], "--engine", "epoll", "0", NULL};
+  if(parse_options(4, server_argv, &options)){
+    return 1;
+  }
+  atomic_store(&log_level, LOG_OFF);
+  board_init();
+  solver_init();
+  if(cookie_init()){
+    fprintf(stderr, "Could not draw the cookie secret.\n");
+    return 1;
+  }
+  metrics_register(0);
+
+  shards = (shard *)calloc(1, sizeof(shard));
+  if(shards == NULL){
+    fprintf(stderr, "Malloc Error\n");
+    return 1;
+  }
+  current_shard = &shards[0];
+  current_shard->fanout = (struct sockaddr_in *)calloc(CHECK_WATCHERS + 1, sizeof(struct sockaddr_in));
+  if(current_shard->fanout == NULL ||
+     room_table_init(&current_shard->rooms, CHECK_ROOMS, CHECK_WATCHERS) ||
+     ring_init(&current_shard->ready_rooms, CHECK_ROOMS)){
+    fprintf(stderr, "Could not allocate %d rooms.\n", CHECK_ROOMS);
+    return 1;
+  }
+  atomic_init(&current_shard->featured_room, NO_ROOM);
+  timer_wheel_init(&current_shard->timers);
+  timer_wheel_init(&current_shard->retransmits);
+
+  check_hello();
+  check_watch();
+  check_limiter();
+
+  if(n_failed){
+    printf("%d checks failed\n", n_failed);
+    return 1;
+  }
+  printf("All checks passed\n");
+  return 0;
+}
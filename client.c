@@ -6,28 +6,150 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
-#include <assert.h>
-#include <pthread.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
 
 #include "client.h"
+#include "bots.h"
 
-#define DEBUG_MODE 1
+/* checks every message from the server, set with --debug */
+int debug_mode = 0;
+
+/* board encoding asked for in the Hello, set with --fyi */
+const char *fyi_mode = NULL;
+
+/* board variant asked for in the Hello, set with --board */
+const char *board_name = NULL;
+
+/* acks the messages of the server, set with --reliable */
+int reliable_mode = 0;
+
+/* commands come from a file or a pipe, set with --script */
+int script_mode = 0;
+
+/* one line per message instead of the drawings, set with --machine */
+int machine_output = 0;
+
+/* next sequence number expected from the server, and the messages
+   that arrived after a missing one */
+int expected_seq = 0;
+char held[RELIABLE_WINDOW][MAX_SIZE];
+int held_bytes[RELIABLE_WINDOW];
+
+/* the last move sent, resent if the server asks for a move again */
+char last_move[4];
+int last_move_valid = 0;
+
+/* the last Hello or Watch sent, sent again after the cookie of the server */
+char join_msg[MAX_SIZE];
+int join_bytes = 0;
+
+/* the server asked for a move that was not sent yet */
+int my_turn = 0;
+
+/* commands read but not run yet: in a script, a MOV waits for a MYM */
+char input[MAX_SIZE];
+int input_bytes = 0;
+
+/* the last message delivered is a MYM, acked only by the MOV */
+int mym_unacked = 0;
+
+/* board mirrored from the FYI and BRD messages */
+char board[MAX_BOARD_SIZE][MAX_BOARD_SIZE];
+int board_size = 3;
+int board_seq = 0;
 
 
 int main(int argc, char *argv[]){
 
   /* checking the arguments from the command line */
-  if (argc != 3) {
+  static const struct option long_options[] = {
+    {"debug", no_argument, NULL, 'd'},
+    {"fyi", required_argument, NULL, 'f'},
+    {"board", required_argument, NULL, 'g'},
+    {"reliable", no_argument, NULL, 'r'},
+    {"bots", required_argument, NULL, 'b'},
+    {"rate", required_argument, NULL, 'R'},
+    {"duration", required_argument, NULL, 't'},
+    {"script", required_argument, NULL, 's'},
+    {"machine", no_argument, NULL, 'm'},
+    {NULL, 0, NULL, 0}
+  };
+
+  bot_options bot_opts;
+  bot_opts.n_bots = 0;
+  bot_opts.rate = 0;
+  bot_opts.duration = DEFAULT_BOT_DURATION;
+
+  int input_fd = STDIN_FILENO;
+
+  int c;
+  while ((c = getopt_long(argc, argv, "df:g:rb:R:t:s:m", long_options, NULL)) != -1) {
+    if (c == 'd') {
+      debug_mode = 1;
+    } else if (c == 'm') {
+      machine_output = 1;
+    } else if (c == 's') {
+      script_mode = 1;
+      if (strcmp(optarg, "-") && (input_fd = open(optarg, O_RDONLY)) < 0) {
+        perror(optarg);
+        exit(-1);
+      }
+    } else if (c == 'r') {
+      reliable_mode = 1;
+    } else if (c == 'b' && sscanf(optarg, "%d", &bot_opts.n_bots) == 1 && bot_opts.n_bots > 0) {
+      continue;
+    } else if (c == 'R' && sscanf(optarg, "%d", &bot_opts.rate) == 1 && bot_opts.rate >= 0) {
+      continue;
+    } else if (c == 't' && sscanf(optarg, "%d", &bot_opts.duration) == 1 && bot_opts.duration > 0) {
+      continue;
+    } else if (c == 'f' && (!strcmp(optarg, "compact") || !strcmp(optarg, "delta"))) {
+      fyi_mode = optarg;
+    } else if (c == 'f' && !strcmp(optarg, "legacy")) {
+      fyi_mode = NULL;
+    } else if (c == 'g' && (!strcmp(optarg, "four") || !strcmp(optarg, "gomoku"))) {
+      board_name = optarg;
+      board_size = !strcmp(optarg, "four") ? 7 : 15;
+    } else if (c == 'g' && !strcmp(optarg, "classic")) {
+      board_name = NULL;
+    } else {
+      printf("Usage: %s [--debug] [--fyi legacy|compact|delta] [--board classic|four|gomoku] [--reliable] "
+             "[--script FILE|-] [--machine] "
+             "[--bots N [--rate JOINS_PER_SECOND] [--duration SECONDS]] IP_ADDRESS PORT_NUMBER\n", argv[0]);
+      exit(-1);
+    }
+  }
+
+  if (argc - optind != 2) {
     printf("You need to pass arguments IP_ADDRESS and PORT_NUMBER\n");
     exit(-1);
   }
 
   int port;
-  if (sscanf(argv[2], "%d", &port) != 1) {
+  if (sscanf(argv[optind + 1], "%d", &port) != 1) {
     printf("Could not parse the arguments");
     exit(-1);
   }
-  char *ip_addr = argv[1];
+  char *ip_addr = argv[optind];
+
+  if (bot_opts.n_bots > 0) {
+    /* load generator: no terminal, no reliable delivery */
+    if (reliable_mode) {
+      printf("--bots does not support --reliable\n");
+      exit(-1);
+    }
+
+    struct sockaddr_in servaddr;
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port = htons(port);
+    inet_pton(AF_INET, ip_addr, &servaddr.sin_addr.s_addr);
+
+    bot_opts.fyi_mode = fyi_mode;
+    return run_bots(&servaddr, &bot_opts);
+  }
 
   /* creating socket */
   int sockfd;
@@ -35,10 +157,15 @@ int main(int argc, char *argv[]){
   if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
     perror("socket creation failed");
     exit(EXIT_FAILURE);
-  } else {
+  } else if (!machine_output) {
     printf("Socket open.\n");
   }
 
+  if (machine_output) {
+    /* the lines reach a pipe as soon as they are printed */
+    setvbuf(stdout, NULL, _IOLBF, 0);
+  }
+
   /* server information */
   struct sockaddr_in servaddr;
   memset(&servaddr, 0, sizeof(servaddr));
@@ -46,102 +173,202 @@ int main(int argc, char *argv[]){
   servaddr.sin_port = htons(port);
   inet_pton(AF_INET, ip_addr, &servaddr.sin_addr.s_addr);
 
-  /* data structure for using udp */
-  udp_info info;
-  info.sockfd = sockfd;
-  info.servaddr_ptr = (struct sockaddr *)&servaddr;
-
-  /* creating thread that receives user input */
-  pthread_t thread_user_input;
-  pthread_create(&thread_user_input, NULL, user_input_manager, (void *) &info);
-
-  while (read_message_from_server(sockfd, (struct sockaddr *)&servaddr) == 0) {
-    continue;
-  }
-
+  int ret = run_client(sockfd, (struct sockaddr *)&servaddr, input_fd);
   close(sockfd);
 
-  return 0;
+  return ret;
 }
 
-/* read_line - 
+/*
+ *
+ * run_client -
+ *
+ * Waits on the socket and on the commands with poll, on a single
+ * thread, and handles whichever is ready. The commands of a script
+ * run as fast as the server answers; once the script ends, the
+ * client keeps playing the messages of the server until the game
+ * is over.
+ *
+ * RETURN:
+ *  Returns 0 once the game is over, or 1 on an error.
  *
- * Reads a line from the command line.
  */
-int read_line(char *buffer, int buffsize)
-{
-  
-  if (fgets(buffer, buffsize, stdin) == NULL) {
-    printf("Input Error\n");
-    exit(-1);
-  }
-  else {
-    return strlen(buffer);
-  }
+int run_client(int sockfd, struct sockaddr *servaddr_ptr, int input_fd) {
 
-  return 0;
+  struct pollfd fds[2];
+  fds[0].fd = sockfd;
+  fds[0].events = POLLIN;
+  fds[1].fd = input_fd;
+  fds[1].events = POLLIN;
+  int input_open = 1;
+
+  while (1) {
+    int n = poll(fds, input_open ? 2 : 1, -1);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      return 1;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      if (read_message_from_server(sockfd, servaddr_ptr)) {
+        return 0;
+      }
+      /* a MYM may let a scripted MOV go */
+      run_commands(sockfd, servaddr_ptr, !input_open);
+    }
+
+    if (input_open && (fds[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+      int n_read = read(input_fd, input + input_bytes, MAX_SIZE - 1 - input_bytes);
+      if (n_read < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n_read <= 0) {
+        if (!script_mode) {
+          printf("Input Error\n");
+          return 1;
+        }
+        /* the script is over: the last line may have no newline */
+        input_open = 0;
+      } else {
+        input_bytes += n_read;
+      }
+      run_commands(sockfd, servaddr_ptr, !input_open);
+    }
+  }
 }
 
 /*
  *
- * user_input_manager - 
- * Keeps looping in order to check for user input. This function
- * should be ran on a second thread, so that the application can
- * run while the user writes his/her commands.
+ * run_commands -
+ *
+ * Runs the complete lines read so far. In a script, a MOV stops
+ * the lines until the server asks for a move, so that a file of
+ * moves plays a whole game. at_end also runs a last line that has
+ * no newline, and a line longer than the buffer is run as it is.
  *
  */
-void *user_input_manager(void *params)
-{
+void run_commands(int sockfd, const struct sockaddr *servaddr_ptr, int at_end) {
 
-  udp_info *info = (udp_info *)params;
-  int sockfd = info->sockfd;
-  const struct sockaddr *servaddr_ptr = info->servaddr_ptr;
+  while (input_bytes > 0) {
+    char *newline = memchr(input, '\n', input_bytes);
+    int consumed = newline ? (int)(newline - input) + 1 : input_bytes;
 
-  while (1) {
-    send_message_to_server(sockfd, servaddr_ptr);
+    if (newline == NULL && !at_end && input_bytes < MAX_SIZE - 1) {
+      /* the rest of the line has not arrived yet */
+      return;
+    }
+    if (consumed == 1 && script_mode) {
+      /* blank lines of a script */
+      input_bytes -= 1;
+      memmove(input, input + 1, input_bytes);
+      continue;
+    }
+    if (script_mode && !my_turn && consumed >= 3 && !memcmp(input, "MOV", 3)) {
+      return;
+    }
+
+    char line[MAX_SIZE + 1];
+    int len = consumed;
+    memcpy(line, input, len);
+    if (newline == NULL) {
+      line[len++] = '\n';
+    }
+    line[len] = '\0';
+
+    input_bytes -= consumed;
+    memmove(input, input + consumed, input_bytes);
+
+    send_command(sockfd, servaddr_ptr, line, len);
+  }
+}
+
+/* reads two numbers, the column and the row, from the text of a MOV */
+static int parse_move(const char *text, int *col, int *row) {
+
+  char *end;
+  long value = strtol(text, &end, 10);
+  if (end == text) {
+    return 1;
+  }
+  *col = (int) value;
+
+  text = end;
+  value = strtol(text, &end, 10);
+  if (end == text) {
+    return 1;
   }
+  *row = (int) value;
+  return 0;
+}
+
+/* returns why the board mirror rules out a move, or NULL if it may be legal */
+static const char *check_move(int col, int row) {
+
+  if (!my_turn) {
+    return "Not your turn - Wait for the other player.";
+  }
+  if (col < 0 || col >= board_size || row < 0 || row >= board_size) {
+    return "Outside of the board - Try again.";
+  }
+  if (board[row][col]) {
+    return "Cell already taken - Try again.";
+  }
+  return NULL;
 }
 
 /*
  *
- * send_message_to_server - 
+ * send_command - 
  * 
- * Waits for user to write a command in the terminal and press Enter.
- * 
- * Once the command is received, it parses the input and checks if it corresponds
- * to one of the valid commands: MOV, TXT.
+ * Parses a command of msglen bytes, ending with a newline, and
+ * checks if it corresponds to one of the valid commands: MOV,
+ * TXT, HNT.
  * 
  * If command is parsed successfully, sends the message to the server. Otherwise,
- * it prints in the terminal that parsing was not successful. 
+ * it prints in the terminal that parsing was not successful. A MOV is
+ * also checked against the board mirror and the turn first: a move the
+ * server would refuse costs it a round trip, an error and a new MYM.
  * 
  */
-void *send_message_to_server(int sockfd, const struct sockaddr *servaddr_ptr) {
-  char msg[MAX_SIZE];
-
-  int msglen = read_line(msg, MAX_SIZE);
+void send_command(int sockfd, const struct sockaddr *servaddr_ptr, char *msg, int msglen) {
 
   if (msglen <= 3) {
     /* not a valid message code */
-    printf("Could not parse instruction.\n");
-    return NULL;
+    print_error("Could not parse instruction.");
+    return;
   }
 
   /* checking the type of message */
   if (msg[0] == 'M' && msg[1] == 'O' && msg[2] == 'V') {
     /* MOV message */
     int col, row;
-    if (sscanf(msg+3, "%d%d", &col, &row) != 2) {
+    const char *error;
+    if (parse_move(msg + 3, &col, &row)) {
       /* is not a valid move */
-      printf("Could not parse MOV - Try again.\n");
+      print_error("Could not parse MOV - Try again.");
+    } else if ((error = check_move(col, row)) != NULL) {
+      print_error(error);
     } else {
       
-      char msg_to_send[3];
+      char msg_to_send[4];
       int len_msg_to_send = 3;
 
       msg_to_send[0] = MOV;
       msg_to_send[1] = (char) col;
       msg_to_send[2] = (char) row;
 
+      if (reliable_mode) {
+        /* the move also acks the messages received so far */
+        msg_to_send[3] = (char) expected_seq;
+        len_msg_to_send = 4;
+        memcpy(last_move, msg_to_send, 4);
+        last_move_valid = 1;
+      }
+      my_turn = 0;
+
       sendto(sockfd, (const void *) msg_to_send, len_msg_to_send, 
               MSG_CONFIRM, servaddr_ptr, sizeof(*servaddr_ptr));
 
@@ -156,15 +383,97 @@ void *send_message_to_server(int sockfd, const struct sockaddr *servaddr_ptr) {
     msg_to_send[0] = TXT;
     msg_to_send[len_msg_to_send - 1] = (char) 0;
 
+    if (!strcmp(msg_to_send + 1, "Hello")) {
+      /* asks for the options chosen on the command line */
+      if (fyi_mode != NULL) {
+        len_msg_to_send += snprintf(msg_to_send + len_msg_to_send - 1,
+                                    MAX_SIZE - 3 - len_msg_to_send, " %s", fyi_mode);
+      }
+      if (reliable_mode) {
+        len_msg_to_send += snprintf(msg_to_send + len_msg_to_send - 1,
+                                    MAX_SIZE - 3 - len_msg_to_send, " reliable");
+      }
+      if (board_name != NULL) {
+        len_msg_to_send += snprintf(msg_to_send + len_msg_to_send - 1,
+                                    MAX_SIZE - 3 - len_msg_to_send, " %s", board_name);
+      }
+    }
+
+    if ((!strncmp(msg_to_send + 1, "Hello", 5) || !strncmp(msg_to_send + 1, "Watch", 5)) &&
+        len_msg_to_send < MAX_SIZE - 1 - COOKIE_SIZE) {
+      memcpy(join_msg, msg_to_send, len_msg_to_send);
+      join_bytes = len_msg_to_send;
+    }
+
     sendto(sockfd, (const void *) msg_to_send, len_msg_to_send,
             MSG_CONFIRM, servaddr_ptr, sizeof(*servaddr_ptr));
   }
 
+  else if (msg[0] == 'H' && msg[1] == 'N' && msg[2] == 'T') {
+    /* HNT - asks the server for the best move */
+    char hint_request = HNT;
+    sendto(sockfd, &hint_request, 1, MSG_CONFIRM, servaddr_ptr, sizeof(*servaddr_ptr));
+  }
+
   else {
-    printf("Message code not found.\n");
+    print_error("Message code not found.");
   }
+}
 
-  return NULL;
+/*
+ * print_board -
+ *
+ * Prints the board mirrored by the client in the terminal.
+ *
+ */
+void print_board(int n_occupied){
+
+  int row, col;
+  if (machine_output) {
+    /* BOARD size seq cells, with one of . X O per cell in row order */
+    char cells[MAX_BOARD_SIZE * MAX_BOARD_SIZE + 1];
+    for (row=0; row<board_size; ++row) {
+      for (col=0; col<board_size; ++col) {
+        cells[row * board_size + col] = board[row][col] ? board[row][col] : '.';
+      }
+    }
+    cells[board_size * board_size] = '\0';
+    printf("BOARD %d %d %s\n", board_size, n_occupied, cells);
+    return;
+  }
+
+  printf("%d filled positions.\n", n_occupied);
+
+  char separator[2 * MAX_BOARD_SIZE + 2];
+  for(col=0; col<board_size; ++col){
+    separator[2 * col] = '+';
+    separator[2 * col + 1] = '-';
+  }
+  separator[2 * board_size] = '+';
+  separator[2 * board_size + 1] = '\0';
+
+  printf("\n");
+  printf("%s\n", separator);
+  for(row=0; row<board_size; ++row){
+    printf("|");
+    for(col=0; col<board_size; ++col){
+      printf("%c|", board[row][col] ? board[row][col] : ' ');
+    }
+    printf("\n");
+    printf("%s\n", separator);
+  }
+}
+
+/* prints the code of a message of the server, only on a terminal */
+static void print_code(const char *code){
+  if (!machine_output) {
+    printf("[%s]\n", code);
+  }
+}
+
+/* prints a mistake of the user, as ERR text with --machine */
+void print_error(const char *text){
+  printf(machine_output ? "ERR %s\n" : "%s\n", text);
 }
 
 /*
@@ -175,7 +484,8 @@ void *send_message_to_server(int sockfd, const struct sockaddr *servaddr_ptr) {
  * 
  * Accepted types of message:
  * 
- * TXT 0x04, MYM 0x02, END 0x03, FYI 0x01
+ * TXT 0x04, MYM 0x02, END 0x03, FYI 0x01, FYC 0x07, FYD 0x08, LFT 0x06,
+ * HNT 0x0c, BRD 0x0d, CKE 0x0e, and REL 0x0a wrapping any of them.
  * 
  * RETURN: 
  *  Returns 1 if and only if the game has ended. Else returns 0.
@@ -185,7 +495,7 @@ int read_message_from_server(int sockfd, struct sockaddr *servaddr_ptr) {
   char buffer[MAX_SIZE];
 
   socklen_t len = sizeof(struct sockaddr);
-  int n_bytes = recvfrom(sockfd, (char *)buffer, MAX_SIZE, MSG_WAITALL,
+  int n_bytes = recvfrom(sockfd, (char *)buffer, MAX_SIZE - 1, MSG_WAITALL,
                                  servaddr_ptr, &len);
 
   if (n_bytes < 0) {
@@ -195,24 +505,126 @@ int read_message_from_server(int sockfd, struct sockaddr *servaddr_ptr) {
 
   buffer[n_bytes] = '\0';
 
+  if (buffer[0] == REL) {
+    return handle_reliable(sockfd, servaddr_ptr, buffer, n_bytes);
+  }
+
+  return handle_message(sockfd, servaddr_ptr, buffer, n_bytes);
+}
+
+/*
+ * handle_reliable -
+ *
+ * Delivers the messages of the server in order: a REL message
+ * carries a sequence number, then the message itself. Messages
+ * that arrive after a missing one are held until it comes.
+ *
+ * Every REL message is answered with an ACK of the next sequence
+ * number expected, except a MYM: its ack travels in the MOV, so
+ * that the server asks again if the MOV is lost. Until the next
+ * message comes, the ACKs stop right before the MYM, and a MYM
+ * asked again is answered with the last move.
+ *
+ * RETURN:
+ *  Returns 1 if and only if the game has ended. Else returns 0.
+ *
+ */
+int handle_reliable(int sockfd, struct sockaddr *servaddr_ptr, char *buffer, int n_bytes) {
+
+  if (n_bytes < 3) {
+    return 0;
+  }
+
+  int expected = expected_seq;
+  int ahead = (unsigned char) (buffer[1] - expected);
+  int is_over = 0;
+  int last_code = 0;
+
+  if (ahead == 0) {
+    last_code = buffer[2];
+    is_over = handle_message(sockfd, servaddr_ptr, buffer + 2, n_bytes - 2);
+    expected = (expected + 1) & 0xff;
+
+    /* delivers the messages that were waiting for this one */
+    while (!is_over && held_bytes[expected % RELIABLE_WINDOW] > 0) {
+      int slot = expected % RELIABLE_WINDOW;
+      last_code = held[slot][0];
+      is_over = handle_message(sockfd, servaddr_ptr, held[slot], held_bytes[slot]);
+      held_bytes[slot] = 0;
+      expected = (expected + 1) & 0xff;
+    }
+
+    mym_unacked = last_code == MYM;
+    if (mym_unacked) {
+      last_move_valid = 0;
+    }
+    expected_seq = expected;
+
+  } else if (ahead < RELIABLE_WINDOW) {
+    int slot = (unsigned char) buffer[1] % RELIABLE_WINDOW;
+    memcpy(held[slot], buffer + 2, n_bytes - 2);
+    held[slot][n_bytes - 2] = '\0';
+    held_bytes[slot] = n_bytes - 2;
+
+  } else if (buffer[2] == MYM && ((buffer[1] + 1) & 0xff) == expected) {
+    /* the server did not get the answer to its last MYM */
+    if (last_move_valid) {
+      last_move[3] = (char) expected;
+      sendto(sockfd, last_move, 4, MSG_CONFIRM, servaddr_ptr, sizeof(*servaddr_ptr));
+    }
+    return 0;
+  }
+
+  if (last_code == MYM && !is_over) {
+    /* the move will carry the ack */
+    return 0;
+  }
+
+  /* acks duplicates too: the previous ack may have been lost */
+  char ack[2];
+  ack[0] = ACK;
+  ack[1] = (char) (expected - mym_unacked);
+  sendto(sockfd, ack, 2, MSG_CONFIRM, servaddr_ptr, sizeof(*servaddr_ptr));
+
+  return is_over;
+}
+
+/*
+ * handle_message -
+ *
+ * Deals with a message of the server and prints the relevant
+ * information in the terminal.
+ *
+ * RETURN:
+ *  Returns 1 if and only if the game has ended. Else returns 0.
+ *
+ */
+int handle_message(int sockfd, struct sockaddr *servaddr_ptr, char *buffer, int n_bytes) {
+
   int i;
   switch(buffer[0]){
     case TXT:
       /* TXT - prints message in the terminal */
-      printf("[TXT]\n");
-      printf("%s\n", buffer+1);
+      print_code("TXT");
+      printf(machine_output ? "TXT %s\n" : "%s\n", buffer+1);
       break;
 
     case MYM:
       /* MYM - asks the user to make a move */
-      printf("[MYM]\n");
+      print_code("MYM");
+      if (machine_output) {
+        printf("MYM\n");
+      }
+      my_turn = 1;
       break;
 
     case END:
       /* END - prints the outcome of the game and returns 1 */
-      printf("[END]\n");
+      print_code("END");
 
-      if (buffer[1] == (char) 0xff) {
+      if (machine_output) {
+        printf("END %d\n", (unsigned char) buffer[1]);
+      } else if (buffer[1] == (char) 0xff) {
         printf("There is no room for new participants.\n");
       } else if (buffer[1] == (char) 0){
         printf("Draw\n");
@@ -223,46 +635,136 @@ int read_message_from_server(int sockfd, struct sockaddr *servaddr_ptr) {
       return 1;
       break;
 
+    case LFT:
+      /* LFT - the server removed the player for being idle */
+      print_code("LFT");
+      printf(machine_output ? "LFT\n" : "You took too long and were removed from the game.\n");
+      return 1;
+      break;
+
     case FYI:
       /* FYI - prints the current state of the game in the terminal */
-      printf("[FYI]\n");
-      int n_occupied = (int) buffer[1];
+      print_code("FYI");
+      if (n_bytes < 2) {
+        break;
+      }
 
-      char cells[3][3];
-      memset(cells, 0, 9*sizeof(char));
+      /* a move is 3 bytes: the count cannot claim more than the datagram holds */
+      int n_occupied = (unsigned char) buffer[1];
+      if (n_occupied > (n_bytes - 2) / 3) {
+        n_occupied = (n_bytes - 2) / 3;
+      }
 
       for (i=0; i<n_occupied; ++i){
-        int player, col, row;
-        player = (int) buffer[2+3*i];
-        col = (int) buffer[3+3*i];
-        row = (int) buffer[4+3*i];
-
-#if DEBUG_MODE
-        assert(player==1 || player == 2);
-        assert(0 <= col && col <= 2);
-        assert(0 <= row && row <= 2);
-#endif
-        cells[row][col] = (player == 1) ? 'X' : 'O';
+        int player = buffer[2+3*i], col = buffer[3+3*i], row = buffer[4+3*i];
+        if ((player != 1 && player != 2) || col < 0 || col > 2 || row < 0 || row > 2) {
+          break;
+        }
+      }
+      if (i < n_occupied) {
+        print_error("Invalid board received.");
+        break;
       }
 
-      printf("%d filled positions.\n", n_occupied);
+      memset(board, 0, sizeof(board));
+      board_size = 3;
 
-      printf("\n");
-      printf("+-+-+-+\n");
-      int row, col;
-      for(row=0; row<3; ++row){
-        printf("|");
-        for(col=0; col<3; ++col){
-          printf("%c|", cells[row][col] ? cells[row][col] : ' ');
-        }
-        printf("\n");
-        printf("+-+-+-+\n");
+      for (i=0; i<n_occupied; ++i){
+        int player = buffer[2+3*i], col = buffer[3+3*i], row = buffer[4+3*i];
+        board[row][col] = (player == 1) ? 'X' : 'O';
+      }
+
+      board_seq = n_occupied;
+      print_board(n_occupied);
+      break;
+
+    case FYC:
+      /* FYC - the whole board as two masks */
+      print_code("FYI");
+      if (n_bytes < 5) {
+        break;
+      }
+      unsigned masks[2];
+      masks[0] = (unsigned char) buffer[2] | ((unsigned char) buffer[4] & 1) << 8;
+      masks[1] = (unsigned char) buffer[3] | ((unsigned char) buffer[4] >> 1 & 1) << 8;
+
+      board_size = 3;
+      for (i=0; i<9; ++i){
+        board[i / 3][i % 3] = (masks[0] >> i) & 1 ? 'X' : ((masks[1] >> i) & 1 ? 'O' : 0);
       }
+
+      board_seq = (unsigned char) buffer[1];
+      print_board(board_seq);
+      break;
+
+    case FYD:
+      /* FYD - only the last move: asks for a snapshot if a move was missed */
+      print_code("FYI");
+      if (n_bytes < 3) {
+        break;
+      }
+      int seq = (unsigned char) buffer[1];
+      int cell = buffer[2] & 0x0f;
+
+      if (seq != board_seq + 1 || cell > 8) {
+        char snapshot_request = SNP;
+        sendto(sockfd, &snapshot_request, 1, MSG_CONFIRM, servaddr_ptr, sizeof(*servaddr_ptr));
+        break;
+      }
+
+      board[cell / 3][cell % 3] = ((buffer[2] >> 4) == 1) ? 'X' : 'O';
+      board_seq = seq;
+      print_board(board_seq);
+      break;
+
+    case BRD:
+      /* BRD - a board larger than 3x3, 2 bits per cell */
+      print_code("FYI");
+      int size = (unsigned char) buffer[1];
+      if (size > MAX_BOARD_SIZE || n_bytes < 3 + (size * size + 3) / 4) {
+        print_error("Board too large.");
+        break;
+      }
+
+      board_size = size;
+      for (i=0; i<size*size; ++i){
+        int owner = (unsigned char) buffer[3 + i / 4] >> (i % 4 * 2) & 3;
+        board[i / size][i % size] = owner == 1 ? 'X' : (owner == 2 ? 'O' : 0);
+      }
+
+      board_seq = (unsigned char) buffer[2];
+      print_board(board_seq);
+      break;
+
+    case CKE:
+      /* CKE - the server seats the player once the Hello or Watch comes back with its cookie */
+      if (n_bytes < 1 + COOKIE_SIZE || join_bytes == 0) {
+        break;
+      }
+      char echo[MAX_SIZE];
+      memcpy(echo, buffer, 1 + COOKIE_SIZE);
+      memcpy(echo + 1 + COOKIE_SIZE, join_msg, join_bytes);
+      sendto(sockfd, echo, 1 + COOKIE_SIZE + join_bytes, MSG_CONFIRM, servaddr_ptr, sizeof(*servaddr_ptr));
       break;
-  
+
+    case HNT:
+      /* HNT - the best move and the outcome of the game under perfect play */
+      print_code("HNT");
+      if (n_bytes < 4) {
+        print_error("Invalid hint received.");
+        break;
+      }
+      if (machine_output) {
+        printf("HNT %d %d %d\n", (int) buffer[1], (int) buffer[2], (int) (signed char) buffer[3]);
+      } else {
+        printf("Best move: %d %d (%s)\n", (int) buffer[1], (int) buffer[2],
+               buffer[3] > 0 ? "you win" : (buffer[3] < 0 ? "you lose" : "draw"));
+      }
+      break;
+
     default:
       /* If the message cannot be identified */
-      printf("Message code not found.\n");
+      print_error("Message code not found.");
       break;
   }
 
@@ -11,14 +11,31 @@
 #define TXT 4
 #define MOV 5
 #define LFT 6
+#define FYC 7
+#define FYD 8
+#define SNP 9
+#define REL 10
+#define ACK 11
+#define HNT 12
+#define BRD 13
+#define CKE 14
 
-typedef struct udp_info {
-  int sockfd;
-  struct sockaddr *servaddr_ptr;
-} udp_info;
+/* bytes of the join cookie sent back with the Hello */
+#define COOKIE_SIZE 8
 
-void *send_message_to_server(int sockfd, const struct sockaddr *servaddr_ptr);
+/* largest board the server offers, 15x15 */
+#define MAX_BOARD_SIZE 15
+
+/* messages the client keeps when they arrive before a missing one */
+#define RELIABLE_WINDOW 8
+
+int run_client(int sockfd, struct sockaddr *servaddr_ptr, int input_fd);
+void run_commands(int sockfd, const struct sockaddr *servaddr_ptr, int at_end);
+void send_command(int sockfd, const struct sockaddr *servaddr_ptr, char *msg, int msglen);
 int read_message_from_server(int sockfd, struct sockaddr *servaddr_ptr);
-void *user_input_manager(void *params);
+int handle_message(int sockfd, struct sockaddr *servaddr_ptr, char *buffer, int n_bytes);
+int handle_reliable(int sockfd, struct sockaddr *servaddr_ptr, char *buffer, int n_bytes);
+void print_board(int n_occupied);
+void print_error(const char *text);
 
 #endif
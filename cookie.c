@@ -0,0 +1,125 @@
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/random.h>
+
+#include "cookie.h"
+
+/* secret of the process, never used directly as a key */
+static uint64_t master_key[2];
+
+/* keys of the last two periods, derived once per thread and period */
+typedef struct period_key{
+
+  unsigned period;
+  int valid;
+  uint64_t key[2];
+
+} period_key;
+
+static __thread period_key period_keys[2];
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND do { \
+    v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+    v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+  } while (0)
+
+/**
+ *
+ * siphash -
+ * SipHash-2-4 of one 64 bit word under a 128 bit key: a keyed
+ * hash that cannot be forged or inverted without the key, and
+ * costs a few dozen instructions.
+ *
+ */
+static uint64_t siphash(const uint64_t key[2], uint64_t word){
+
+  uint64_t v0 = key[0] ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = key[1] ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = key[0] ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = key[1] ^ 0x7465646279746573ULL;
+
+  /* the word, then the final block holding the length */
+  uint64_t blocks[2] = {word, (uint64_t)8 << 56};
+  int i;
+  for(i=0; i<2; ++i){
+    v3 ^= blocks[i];
+    SIPROUND;
+    SIPROUND;
+    v0 ^= blocks[i];
+  }
+
+  v2 ^= 0xff;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static unsigned current_period(void){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return (unsigned)(now.tv_sec / COOKIE_PERIOD_S);
+}
+
+/* the key of a period: knowing it tells nothing of the others */
+static const uint64_t *key_of(unsigned period){
+
+  period_key *pk = &period_keys[period & 1];
+  if(!pk->valid || pk->period != period){
+    pk->key[0] = siphash(master_key, (uint64_t)period << 1);
+    pk->key[1] = siphash(master_key, (uint64_t)period << 1 | 1);
+    pk->period = period;
+    pk->valid = 1;
+  }
+  return pk->key;
+}
+
+static uint64_t addr_word(const struct sockaddr_in *addr){
+  return (uint64_t)addr->sin_addr.s_addr << 16 | addr->sin_port;
+}
+
+/**
+ *
+ * cookie_init -
+ * Draws the secret of the process. A server started by a
+ * handoff draws a new one: the cookies in flight are refused
+ * and their clients get new ones.
+ *
+ * Returns 0 on success and 1 if no random bytes were available.
+ *
+ */
+int cookie_init(void){
+  return getrandom(master_key, sizeof(master_key), 0) != (ssize_t)sizeof(master_key);
+}
+
+/* writes the cookie of addr for the current period */
+void cookie_make(const struct sockaddr_in *addr, unsigned char *cookie){
+
+  uint64_t mac = siphash(key_of(current_period()), addr_word(addr));
+  memcpy(cookie, &mac, COOKIE_SIZE);
+}
+
+/**
+ *
+ * cookie_check -
+ * Checks a cookie echoed by addr against the keys of the
+ * current and of the previous period.
+ *
+ * Returns 0 if the cookie is valid and 1 otherwise.
+ *
+ */
+int cookie_check(const struct sockaddr_in *addr, const unsigned char *cookie){
+
+  uint64_t mac;
+  memcpy(&mac, cookie, COOKIE_SIZE);
+
+  unsigned period = current_period();
+  uint64_t word = addr_word(addr);
+  return siphash(key_of(period), word) != mac && siphash(key_of(period - 1), word) != mac;
+}
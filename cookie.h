@@ -0,0 +1,22 @@
+#ifndef COOKIE_H
+#define COOKIE_H
+
+#include <netinet/in.h>
+
+/*
+ * Stateless join. A Hello or a Watch from an unknown address is
+ * answered with [CKE][8 byte cookie], a MAC of the address under
+ * the key of the current period; the client joins by sending
+ * back [CKE][cookie][its Hello or Watch]. Nothing is kept for a
+ * join that is never echoed, and a spoofed source never sees
+ * its cookie.
+ */
+
+#define COOKIE_SIZE 8
+#define COOKIE_PERIOD_S 30        /* a cookie is accepted for one to two periods */
+
+int cookie_init(void);
+void cookie_make(const struct sockaddr_in *addr, unsigned char *cookie);
+int cookie_check(const struct sockaddr_in *addr, const unsigned char *cookie);
+
+#endif
@@ -0,0 +1,352 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "server.h"
+#include "netio.h"
+#include "engine.h"
+#include "log.h"
+#include "timer.h"
+#include "metrics.h"
+#include "handoff.h"
+#include "shard.h"
+#include "limiter.h"
+
+extern server_options options;
+
+/**
+ *
+ * run_epoll_engine -
+ * Single threaded engine. One loop owns the socket and every
+ * room: it waits for the socket to be readable, drains it,
+ * handles each packet, advances the rooms that became ready
+ * and flushes the replies, all without locks. While rooms have
+ * deadlines, it also wakes up on every tick of the timers.
+ *
+ * Returns 1 on a fatal error, otherwise never returns.
+ *
+ */
+int run_epoll_engine(int fd){
+
+  int flags = fcntl(fd, F_GETFL, 0);
+  if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0){
+    perror("fcntl");
+    return 1;
+  }
+
+  int epfd = epoll_create1(0);
+  if(epfd < 0){
+    perror("epoll_create1");
+    return 1;
+  }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0){
+    perror("epoll_ctl");
+    return 1;
+  }
+
+  /* receive buffers are reused for every packet */
+  int batch = options.batch;
+  udp_info *buffers = (udp_info *)malloc(batch * sizeof(udp_info));
+  udp_info *infos[MAX_BATCH];
+  if(buffers == NULL){
+    fprintf(stderr, "Malloc Error\n");
+    return 1;
+  }
+
+  int i;
+  for(i=0; i<batch; ++i){
+    infos[i] = &buffers[i];
+  }
+
+  printf("Waiting for connections (epoll engine)...\n");
+
+  while(1){
+    if(handoff_requested()){
+      /* every packet received so far is handled and answered */
+      handoff_park(HANDOFF_RECEIVER);
+    }
+
+    struct epoll_event events[1];
+    int n = epoll_wait(epfd, events, 1, timers_pending() ? TIMER_TICK_MS : -1);
+    if(n < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      perror("epoll_wait");
+      return 1;
+    }
+
+    /* the socket is level triggered, but draining it saves wakeups;
+      under steady traffic it never empties, so a handoff stops it
+      and the timers are run after every batch, not only once it is
+      empty: a timer wheel that did not reach a new tick costs a
+      clock read */
+    int received;
+    while((received = netio_recv(fd, infos, batch)) > 0){
+      unsigned now_ms = limiter_now();
+      for(i=0; i<received; ++i){
+        if(limiter_admit(&current_shard->limiter, &infos[i]->client_addr, now_ms)){
+          handle_packet(infos[i]);
+        }
+      }
+      process_ready_rooms();
+      expire_timers();
+      netio_flush();
+      if(handoff_requested()){
+        break;
+      }
+    }
+
+    if(received < 0){
+      perror("recv error");
+      return 1;
+    }
+
+    expire_timers();
+    netio_flush();
+  }
+}
+
+/* io_uring rings mapped in user space */
+typedef struct uring{
+
+  int fd;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  unsigned to_submit;
+
+  /* wakes the loop up on the next tick of the timers */
+  struct __kernel_timespec tick;
+  int tick_posted;
+
+} uring;
+
+/* a receive posted to the ring */
+typedef struct uring_recv{
+
+  udp_info info;
+  struct msghdr msg;
+  struct iovec iov;
+
+} uring_recv;
+
+static int uring_setup(uring *ring, unsigned entries){
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  memset(ring, 0, sizeof(*ring));
+
+  ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+  if(ring->fd < 0){
+    perror("io_uring_setup");
+    return 1;
+  }
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  int single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+
+  if(single_mmap && cq_size > sq_size){
+    sq_size = cq_size;
+  }
+
+  char *sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQ_RING);
+  char *cq_ptr = sq_ptr;
+  if(!single_mmap && sq_ptr != MAP_FAILED){
+    cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring->fd, IORING_OFF_CQ_RING);
+  }
+  ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+  if(sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED){
+    perror("mmap");
+    return 1;
+  }
+
+  ring->sq_head = (unsigned *)(sq_ptr + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq_ptr + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq_ptr + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq_ptr + params.sq_off.array);
+
+  ring->cq_head = (unsigned *)(cq_ptr + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq_ptr + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq_ptr + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq_ptr + params.cq_off.cqes);
+
+  return 0;
+}
+
+/**
+ *
+ * uring_post_recv -
+ * Queues a recvmsg into the buffer of a receive slot. The
+ * index of the slot travels in the user data of the request.
+ *
+ */
+static void uring_post_recv(uring *ring, int fd, uring_recv *slot, unsigned index){
+
+  slot->iov.iov_base = slot->info.buffer;
+  slot->iov.iov_len = PACKET_SIZE;
+
+  memset(&slot->msg, 0, sizeof(slot->msg));
+  slot->msg.msg_name = &slot->info.client_addr;
+  slot->msg.msg_namelen = sizeof(struct sockaddr_in);
+  slot->msg.msg_iov = &slot->iov;
+  slot->msg.msg_iovlen = 1;
+
+  unsigned tail = *ring->sq_tail;
+  unsigned i = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[i];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)&slot->msg;
+  sqe->len = 1;
+  sqe->user_data = index;
+
+  ring->sq_array[i] = i;
+  atomic_store_explicit((_Atomic unsigned *)ring->sq_tail, tail + 1, memory_order_release);
+  ring->to_submit += 1;
+}
+
+/**
+ *
+ * uring_post_tick -
+ * Queues a timeout that completes after one tick of the timers.
+ * Its user data is URING_ENTRIES, past the receive slots.
+ *
+ */
+static void uring_post_tick(uring *ring){
+
+  ring->tick.tv_sec = 0;
+  ring->tick.tv_nsec = TIMER_TICK_MS * 1000000L;
+
+  unsigned tail = *ring->sq_tail;
+  unsigned i = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[i];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->fd = -1;
+  sqe->addr = (unsigned long)&ring->tick;
+  sqe->len = 1;
+  sqe->user_data = URING_ENTRIES;
+
+  ring->sq_array[i] = i;
+  atomic_store_explicit((_Atomic unsigned *)ring->sq_tail, tail + 1, memory_order_release);
+  ring->to_submit += 1;
+  ring->tick_posted = 1;
+}
+
+/**
+ *
+ * run_uring_engine -
+ * Single threaded engine built on io_uring. Keeps a receive
+ * posted for every slot, submits the new receives and waits
+ * for completions with a single system call, and handles the
+ * completed packets the same way as the epoll engine. Replies
+ * go through the outbox, flushed with sendmmsg.
+ *
+ * Returns 1 on a fatal error, otherwise never returns.
+ *
+ */
+int run_uring_engine(int fd){
+
+  uring ring;
+  if(uring_setup(&ring, URING_ENTRIES)){
+    return 1;
+  }
+
+  uring_recv *slots = (uring_recv *)calloc(URING_ENTRIES, sizeof(uring_recv));
+  if(slots == NULL){
+    fprintf(stderr, "Malloc Error\n");
+    return 1;
+  }
+
+  unsigned i;
+  for(i=0; i<URING_ENTRIES; ++i){
+    uring_post_recv(&ring, fd, &slots[i], i);
+  }
+
+  printf("Waiting for connections (io_uring engine)...\n");
+
+  while(1){
+    /* the receives leave no room in the submission queue only when all of them completed at once */
+    if(!ring.tick_posted && ring.to_submit < URING_ENTRIES && timers_pending()){
+      uring_post_tick(&ring);
+    }
+
+    int ret = (int)syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, 1,
+                           IORING_ENTER_GETEVENTS, NULL, 0);
+    metrics_count(COUNT_RECV_CALLS);
+    if(ret < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      perror("io_uring_enter");
+      return 1;
+    }
+    ring.to_submit -= ret;
+
+    unsigned head = *ring.cq_head;
+    unsigned tail = atomic_load_explicit((_Atomic unsigned *)ring.cq_tail, memory_order_acquire);
+    unsigned now_ms = limiter_now();
+
+    for(; head != tail; ++head){
+      struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+      if(cqe->user_data == URING_ENTRIES){
+        ring.tick_posted = 0;
+        continue;
+      }
+
+      uring_recv *slot = &slots[cqe->user_data];
+
+      if(cqe->res < 0){
+        log_msg(LOG_ERROR, "recvmsg failed: errno %ld", (long)-cqe->res);
+      } else {
+        metrics_count(COUNT_RECV_PACKETS);
+        slot->info.n_bytes = cqe->res;
+        slot->info.len = slot->msg.msg_namelen;
+        if(limiter_admit(&current_shard->limiter, &slot->info.client_addr, now_ms)){
+          handle_packet(&slot->info);
+        }
+      }
+
+      uring_post_recv(&ring, fd, slot, (unsigned)cqe->user_data);
+    }
+
+    atomic_store_explicit((_Atomic unsigned *)ring.cq_head, head, memory_order_release);
+
+    process_ready_rooms();
+    expire_timers();
+    netio_flush();
+  }
+}
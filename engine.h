@@ -0,0 +1,9 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#define URING_ENTRIES 64
+
+int run_epoll_engine(int fd);
+int run_uring_engine(int fd);
+
+#endif
@@ -0,0 +1,607 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "server.h"
+#include "handoff.h"
+#include "room.h"
+#include "reliable.h"
+#include "timer.h"
+#include "journal.h"
+#include "log.h"
+
+/* interrupts the blocking calls of a thread so that it sees the request */
+#define HANDOFF_SIGNAL SIGRTMIN
+
+extern server_options options;
+
+/* a room that is not free, followed by the windows of its seats with --reliable */
+typedef struct handoff_room{
+
+  int room_id;
+  room rm;
+
+} handoff_room;
+
+atomic_int handoff_pending;
+
+/* the threads that handle packets or rooms, and whether each is parked */
+static pthread_mutex_t park_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t park_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t threads[HANDOFF_MAX_THREADS];
+static unsigned char thread_parked[HANDOFF_MAX_THREADS];
+static int n_threads;
+static int registered[HANDOFF_STAGES];
+static int parked[HANDOFF_STAGES];
+static __thread int thread_index = -1;
+
+typedef struct serve_params{
+
+  int fd;
+  shard *shards;
+  int n_threads;
+
+} serve_params;
+
+static void interrupt(int sig){
+}
+
+/* a thread that must stop before a handoff */
+void handoff_register(int stage){
+
+  pthread_mutex_lock(&park_mutex);
+  if(n_threads < HANDOFF_MAX_THREADS){
+    thread_index = n_threads;
+    threads[n_threads] = pthread_self();
+    n_threads += 1;
+    registered[stage] += 1;
+  }
+  pthread_mutex_unlock(&park_mutex);
+}
+
+/**
+ *
+ * handoff_may_park -
+ * Tells a thread of the given stage whether it should finish
+ * its work and park: a handoff is requested and every thread of
+ * the earlier stages is parked, so no more work can reach it.
+ *
+ */
+int handoff_may_park(int stage){
+
+  if(!handoff_requested()){
+    return 0;
+  }
+
+  int ready = 1;
+  int s;
+  pthread_mutex_lock(&park_mutex);
+  for(s=0; s<stage; ++s){
+    ready &= parked[s] == registered[s];
+  }
+  pthread_mutex_unlock(&park_mutex);
+  return ready;
+}
+
+/* blocks the calling thread until the handoff failed and the server resumes */
+void handoff_park(int stage){
+
+  pthread_mutex_lock(&park_mutex);
+  parked[stage] += 1;
+  if(thread_index >= 0){
+    thread_parked[thread_index] = 1;
+  }
+  pthread_cond_broadcast(&park_cond);
+
+  while(atomic_load(&handoff_pending)){
+    pthread_cond_wait(&park_cond, &park_mutex);
+  }
+
+  parked[stage] -= 1;
+  if(thread_index >= 0){
+    thread_parked[thread_index] = 0;
+  }
+  pthread_mutex_unlock(&park_mutex);
+}
+
+/**
+ *
+ * stop_threads -
+ * Requests a handoff and waits until every registered thread is
+ * parked. The threads blocked in a system call are interrupted,
+ * again every millisecond, since a signal may arrive just before
+ * a thread blocks.
+ *
+ */
+static void stop_threads(void){
+
+  atomic_store(&handoff_pending, 1);
+
+  pthread_mutex_lock(&park_mutex);
+  while(1){
+    int running = 0;
+    int i;
+    for(i=0; i<n_threads; ++i){
+      if(!thread_parked[i]){
+        pthread_kill(threads[i], HANDOFF_SIGNAL);
+        running += 1;
+      }
+    }
+    if(running == 0){
+      break;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 1000000L;
+    if(deadline.tv_nsec >= 1000000000L){
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&park_cond, &park_mutex, &deadline);
+  }
+  pthread_mutex_unlock(&park_mutex);
+}
+
+static void resume_threads(void){
+  pthread_mutex_lock(&park_mutex);
+  atomic_store(&handoff_pending, 0);
+  pthread_cond_broadcast(&park_cond);
+  pthread_mutex_unlock(&park_mutex);
+}
+
+static unsigned long monotonic_us(void){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int window_size(void){
+  return options.reliable ? (int)sizeof(peer_window) : 0;
+}
+
+static size_t entry_size(int windows){
+  return sizeof(handoff_room) + (size_t)windows * MAX_CLIENTS;
+}
+
+/**
+ *
+ * save_rooms -
+ * Copies the rooms that are not free, with the windows of their
+ * seats, to the memfd, shard after shard. Only the rooms in use
+ * are copied, so the handoff takes time in proportion to them.
+ *
+ * Returns the number of rooms, or -1 on error.
+ *
+ */
+static int save_rooms(int fd, const shard *shards, handoff_header *header){
+
+  int windows = window_size();
+  size_t size = 0;
+  int n_rooms = 0;
+  int i, r;
+
+  for(i=0; i<options.n_shards; ++i){
+    size += sizeof(handoff_shard) + (size_t)shards[i].rooms.n_active * entry_size(windows);
+  }
+
+  header->magic = HANDOFF_MAGIC;
+  header->version = HANDOFF_VERSION;
+  header->n_shards = options.n_shards;
+  header->rooms_per_shard = shards[0].rooms.n_rooms;
+  header->room_size = sizeof(room);
+  header->window_size = windows;
+  header->size = size;
+
+  if(ftruncate(fd, size)){
+    return -1;
+  }
+  char *data = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(data == MAP_FAILED){
+    return -1;
+  }
+
+  char *cursor = data;
+  for(i=0; i<options.n_shards; ++i){
+    const room_table *table = &shards[i].rooms;
+    handoff_shard *saved = (handoff_shard *)cursor;
+    memcpy(saved->waiting_head, table->waiting_head, sizeof(saved->waiting_head));
+    memcpy(saved->waiting_tail, table->waiting_tail, sizeof(saved->waiting_tail));
+    saved->n_rooms = 0;
+    cursor += sizeof(handoff_shard);
+
+    for(r=0; r<table->n_rooms && saved->n_rooms < table->n_active; ++r){
+      if(table->rooms[r].state == ROOM_FREE){
+        continue;
+      }
+
+      handoff_room *entry = (handoff_room *)cursor;
+      entry->room_id = r;
+      memcpy(&entry->rm, &table->rooms[r], sizeof(room));
+      if(windows){
+        memcpy(entry + 1, &shards[i].windows[r * MAX_CLIENTS], (size_t)windows * MAX_CLIENTS);
+      }
+      saved->n_rooms += 1;
+      cursor += entry_size(windows);
+    }
+    n_rooms += saved->n_rooms;
+  }
+
+  munmap(data, size);
+  return n_rooms;
+}
+
+/**
+ *
+ * restore_rooms -
+ * Puts the saved rooms back in the tables of the shards and arms
+ * their deadlines and retransmissions again. The timers count
+ * ticks of the monotonic clock, which both processes share, so a
+ * deadline keeps its absolute time.
+ *
+ * Returns the number of rooms, or -1 if the data is corrupt.
+ *
+ */
+static int restore_rooms(const char *data, const handoff_header *header, shard *shards){
+
+  const char *end = data + header->size;
+  int windows = header->window_size;
+  int n_rooms = 0;
+  int i, k, seat;
+
+  for(i=0; i<header->n_shards; ++i){
+    const handoff_shard *saved = (const handoff_shard *)data;
+    data += sizeof(handoff_shard);
+    if(data > end || saved->n_rooms < 0 || (size_t)saved->n_rooms * entry_size(windows) > (size_t)(end - data)){
+      return -1;
+    }
+
+    shard *sh = &shards[i];
+    for(k=0; k<saved->n_rooms; ++k, data+=entry_size(windows)){
+      const handoff_room *entry = (const handoff_room *)data;
+      int room_id = entry->room_id;
+      if(room_id < 0 || room_id >= sh->rooms.n_rooms){
+        return -1;
+      }
+
+      room_restore(&sh->rooms, room_id, &entry->rm);
+      if(timer_is_armed(&entry->rm.timer)){
+        timer_arm(&sh->timers, &sh->rooms.rooms[room_id].timer, entry->rm.timer.expires);
+      }
+
+      const peer_window *saved_windows = (const peer_window *)(entry + 1);
+      for(seat=0; windows && seat<MAX_CLIENTS; ++seat){
+        peer_window *window = &sh->windows[room_id * MAX_CLIENTS + seat];
+        memcpy(window, &saved_windows[seat], sizeof(peer_window));
+        timer_node_init(&window->timer, room_id * MAX_CLIENTS + seat);
+        if(timer_is_armed(&saved_windows[seat].timer)){
+          timer_arm(&sh->retransmits, &window->timer, saved_windows[seat].timer.expires);
+        }
+      }
+    }
+
+    room_restore_lists(&sh->rooms, saved->waiting_head, saved->waiting_tail);
+    n_rooms += saved->n_rooms;
+  }
+
+  return n_rooms;
+}
+
+/* sends the header with the sockets and the memfd attached; a
+   new server that already hung up is an error, not a SIGPIPE */
+static int send_descriptors(int conn, const handoff_header *header, const int *fds, int n_fds){
+
+  char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+  memset(control, 0, sizeof(control));
+
+  struct iovec iov;
+  iov.iov_base = (void *)header;
+  iov.iov_len = sizeof(*header);
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n_fds);
+
+  return sendmsg(conn, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(*header);
+}
+
+/**
+ *
+ * receive_descriptors -
+ * Reads the header and the descriptors sent by the old server.
+ *
+ * Returns the number of descriptors, or -1 on error.
+ *
+ */
+static int receive_descriptors(int conn, handoff_header *header, int *fds){
+
+  char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+
+  struct iovec iov;
+  iov.iov_base = header;
+  iov.iov_len = sizeof(*header);
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  if(recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) != (ssize_t)sizeof(*header)){
+    return -1;
+  }
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if(cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS){
+    return -1;
+  }
+
+  int n_fds = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * n_fds);
+  return n_fds;
+}
+
+/**
+ *
+ * hand_over -
+ * Stops the threads, sends the rooms and the sockets to the new
+ * server on conn, and exits once it acknowledges them and was
+ * told to go. If the new server refuses them, dies or does not
+ * answer in time, the threads resume as if nothing happened:
+ * the new server only serves after the go, so the rooms never
+ * have two owners.
+ *
+ */
+static void hand_over(int conn, shard *shards){
+
+  unsigned long start = monotonic_us();
+  stop_threads();
+
+  int fds[HANDOFF_MAX_FDS];
+  int i;
+  for(i=0; i<options.n_shards; ++i){
+    fds[i] = shards[i].sockfd;
+  }
+
+  handoff_header header;
+  memset(&header, 0, sizeof(header));
+
+  int n_rooms = -1;
+  int memfd = memfd_create("ttt-handoff", MFD_CLOEXEC);
+  fds[options.n_shards] = memfd;
+  if(memfd < 0 || (n_rooms = save_rooms(memfd, shards, &header)) < 0 ||
+     send_descriptors(conn, &header, fds, options.n_shards + 1)){
+    if(errno == EPIPE || errno == ECONNRESET){
+      log_msg(LOG_ERROR, "The new server hung up before the handoff, the server goes on.");
+    } else {
+      log_msg(LOG_ERROR, "Handoff failed (errno %ld), the server goes on.", (long)errno);
+    }
+    if(memfd >= 0){
+      close(memfd);
+    }
+    resume_threads();
+    return;
+  }
+  close(memfd);
+
+  struct timeval timeout = {HANDOFF_ACK_TIMEOUT_S, 0};
+  setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  char ack = 0;
+  if(read(conn, &ack, 1) != 1 || ack != 'K'){
+    log_msg(LOG_ERROR, "The new server refused the handoff, the server goes on.");
+    resume_threads();
+    return;
+  }
+
+  /* past this byte the rooms belong to the new server */
+  char go = 'G';
+  if(send(conn, &go, 1, MSG_NOSIGNAL) != 1){
+    log_msg(LOG_ERROR, "The new server hung up before the handoff, the server goes on.");
+    resume_threads();
+    return;
+  }
+
+  printf("Handed %d rooms over to the new server in %.1f ms.\n", n_rooms, (monotonic_us() - start) / 1000.0);
+  fflush(stdout);
+  journal_drain();
+  exit(0);
+}
+
+/**
+ *
+ * handoff_loop -
+ * Body of the handoff thread. Waits until every thread that
+ * handles packets is registered, then hands the server over to
+ * each new server that connects, one at a time.
+ *
+ */
+static void *handoff_loop(void *params){
+
+  serve_params *serve = (serve_params *)params;
+
+  while(1){
+    pthread_mutex_lock(&park_mutex);
+    int started = n_threads >= serve->n_threads;
+    pthread_mutex_unlock(&park_mutex);
+    if(started){
+      break;
+    }
+    usleep(1000);
+  }
+
+  while(1){
+    int conn = accept(serve->fd, NULL, NULL);
+    if(conn < 0){
+      continue;
+    }
+
+    char request = 0;
+    if(read(conn, &request, 1) == 1 && request == 'H'){
+      hand_over(conn, serve->shards);
+    }
+    close(conn);
+  }
+
+  return NULL;
+}
+
+/**
+ *
+ * handoff_serve -
+ * Listens at path for the next server, once n_threads threads
+ * have registered.
+ *
+ * Returns 0 on success and 1 on error.
+ *
+ */
+int handoff_serve(const char *path, shard *shards, int n_threads){
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(addr.sun_path) || options.n_shards + 1 > HANDOFF_MAX_FDS){
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+
+  /* interrupts blocking calls instead of restarting them */
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = interrupt;
+  sigaction(HANDOFF_SIGNAL, &sa, NULL);
+
+  serve_params *serve = (serve_params *)malloc(sizeof(serve_params));
+  if(serve == NULL){
+    return 1;
+  }
+  serve->shards = shards;
+  serve->n_threads = n_threads;
+
+  serve->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  unlink(path);
+  if(serve->fd < 0 || bind(serve->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+     listen(serve->fd, 1) < 0){
+    perror("handoff socket");
+    free(serve);
+    return 1;
+  }
+
+  pthread_t handoff_thread;
+  if(pthread_create(&handoff_thread, NULL, handoff_loop, serve)){
+    free(serve);
+    return 1;
+  }
+  pthread_detach(handoff_thread);
+  return 0;
+}
+
+/**
+ *
+ * handoff_takeover -
+ * Asks the server listening at path for its sockets and rooms.
+ * The shards must have their tables, timers and windows, but no
+ * socket yet. The rooms are only taken once the running server
+ * answers the acknowledgement with a go; a server that gave up
+ * waiting closes the connection instead, and keeps them.
+ *
+ * Returns 1 if the shards took over the rooms and the sockets,
+ * 0 if no server is listening at path and -1 on error.
+ *
+ */
+int handoff_takeover(const char *path, shard *shards, int n_shards){
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(addr.sun_path)){
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(conn < 0){
+    return -1;
+  }
+  if(connect(conn, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+    close(conn);
+    return errno == ENOENT || errno == ECONNREFUSED ? 0 : -1;
+  }
+
+  unsigned long start = monotonic_us();
+  char request = 'H';
+  handoff_header header;
+  int fds[HANDOFF_MAX_FDS];
+  int n_fds = -1;
+  if(write(conn, &request, 1) == 1){
+    n_fds = receive_descriptors(conn, &header, fds);
+  }
+  if(n_fds < 0){
+    close(conn);
+    return -1;
+  }
+
+  int n_rooms = -1;
+  if(n_fds == n_shards + 1 && header.magic == HANDOFF_MAGIC && header.version == HANDOFF_VERSION &&
+     header.n_shards == n_shards && header.rooms_per_shard == shards[0].rooms.n_rooms &&
+     header.room_size == (int)sizeof(room) && header.window_size == window_size()){
+    const char *data = (const char *)mmap(NULL, header.size ? header.size : 1, PROT_READ, MAP_PRIVATE, fds[n_shards], 0);
+    if(data != MAP_FAILED){
+      n_rooms = restore_rooms(data, &header, shards);
+      munmap((void *)data, header.size ? header.size : 1);
+    }
+  } else {
+    fprintf(stderr, "The running server has other options or another version.\n");
+  }
+
+  /* only the sockets are left once the memfd is read */
+  if(n_fds == n_shards + 1){
+    close(fds[n_shards]);
+    n_fds -= 1;
+  }
+
+  char ack = n_rooms < 0 ? 'N' : 'K';
+  char go = 0;
+  if(n_rooms < 0 || send(conn, &ack, 1, MSG_NOSIGNAL) != 1 || read(conn, &go, 1) != 1 || go != 'G'){
+    if(n_rooms >= 0){
+      fprintf(stderr, "The running server did not wait for the handoff.\n");
+    }
+    int i;
+    for(i=0; i<n_fds; ++i){
+      close(fds[i]);
+    }
+    close(conn);
+    return -1;
+  }
+  close(conn);
+
+  int i;
+  for(i=0; i<n_shards; ++i){
+    /* the epoll engine of the old server made it non blocking */
+    shards[i].sockfd = fds[i];
+    fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL, 0) & ~O_NONBLOCK);
+  }
+
+  printf("Took over %d rooms from the running server in %.1f ms.\n", n_rooms, (monotonic_us() - start) / 1000.0);
+  return 1;
+}
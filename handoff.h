@@ -0,0 +1,64 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdatomic.h>
+
+#include "shard.h"
+
+/*
+ * Warm restart. A new server started with the same --handoff PATH
+ * connects to the running one, which stops its threads at a point
+ * where no packet is half handled, copies its rooms to a memfd and
+ * passes the memfd and its sockets over PATH. Packets that arrive
+ * meanwhile wait in the socket, which never closes. The new server
+ * acknowledges the rooms and serves only after the old one answers
+ * with a go, sent just before it exits.
+ */
+
+#define HANDOFF_MAGIC 0x48545454u        /* "TTTH" */
+#define HANDOFF_VERSION 3
+#define HANDOFF_MAX_FDS 64
+#define HANDOFF_ACK_TIMEOUT_S 5        /* the old server resumes past it, and the new one gives up */
+#define HANDOFF_MAX_THREADS 256
+
+/* threads stop in this order: receivers first, the game logic last */
+#define HANDOFF_RECEIVER 0
+#define HANDOFF_WORKER 1
+#define HANDOFF_GAME 2
+#define HANDOFF_STAGES 3
+
+/* sent with the descriptors: the new server checks it is compatible */
+typedef struct handoff_header{
+
+  unsigned magic;
+  unsigned version;
+  int n_shards;
+  int rooms_per_shard;
+  int room_size;
+  int window_size;            /* 0 without --reliable */
+  unsigned long size;         /* bytes of the memfd */
+
+} handoff_header;
+
+/* what the memfd holds for each shard, followed by its rooms */
+typedef struct handoff_shard{
+
+  int waiting_head[N_BOARDS];
+  int waiting_tail[N_BOARDS];
+  int n_rooms;                /* rooms that are not free */
+  int reserved;
+
+} handoff_shard;
+
+extern atomic_int handoff_pending;
+
+#define handoff_requested() atomic_load_explicit(&handoff_pending, memory_order_relaxed)
+
+void handoff_register(int stage);
+int handoff_may_park(int stage);
+void handoff_park(int stage);
+
+int handoff_takeover(const char *path, shard *shards, int n_shards);
+int handoff_serve(const char *path, shard *shards, int n_threads);
+
+#endif
@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "journal.h"
+#include "log.h"
+
+/* records pushed by one thread and read by the writer */
+typedef struct journal_ring{
+
+  journal_record records[JOURNAL_RING_SIZE];
+  _Alignas(64) atomic_uint head;    /* next record to push */
+  _Alignas(64) atomic_uint tail;    /* next record to write */
+  struct journal_ring *next;
+
+} journal_ring;
+
+static __thread journal_ring *local_ring;
+static journal_ring *_Atomic all_rings;
+static pthread_mutex_t register_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *journal_dir;
+static int journal_fsync_ms;
+static int journal_fd = -1;
+static unsigned segment_number;
+static unsigned segment_records;
+static atomic_int writing;          /* a batch is between the rings and the file */
+
+uint64_t journal_now_ms(void){
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint64_t monotonic_ms(void){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int write_all(int fd, const void *data, size_t len){
+
+  const char *bytes = (const char *)data;
+  while(len > 0){
+    ssize_t n = write(fd, bytes, len);
+    if(n < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      return 1;
+    }
+    bytes += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/**
+ *
+ * open_segment -
+ * Closes the current segment and creates the next one that does
+ * not exist yet, so that a restarted server never appends to the
+ * segments of an earlier run.
+ *
+ * Returns 0 on success and 1 on error.
+ *
+ */
+static int open_segment(void){
+
+  if(journal_fd >= 0){
+    fdatasync(journal_fd);
+    close(journal_fd);
+    journal_fd = -1;
+    segment_number += 1;
+  }
+
+  char path[4096];
+  while(1){
+    snprintf(path, sizeof(path), "%s/journal-%06u.ttj", journal_dir, segment_number);
+    journal_fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+    if(journal_fd >= 0){
+      break;
+    }
+    if(errno != EEXIST){
+      return 1;
+    }
+    segment_number += 1;
+  }
+
+  journal_header header;
+  memset(&header, 0, sizeof(header));
+  header.magic = JOURNAL_MAGIC;
+  header.version = JOURNAL_VERSION;
+  header.record_size = sizeof(journal_record);
+  header.created_ms = journal_now_ms();
+  header.segment = segment_number;
+
+  segment_records = 0;
+  return write_all(journal_fd, &header, sizeof(header));
+}
+
+/**
+ *
+ * register_ring -
+ * Gives the calling thread its own ring. Only happens on the
+ * first game finished by each thread.
+ *
+ */
+static journal_ring *register_ring(void){
+
+  journal_ring *ring = (journal_ring *)calloc(1, sizeof(journal_ring));
+  if(ring == NULL){
+    return NULL;
+  }
+
+  pthread_mutex_lock(&register_mutex);
+  ring->next = atomic_load(&all_rings);
+  atomic_store(&all_rings, ring);
+  pthread_mutex_unlock(&register_mutex);
+
+  local_ring = ring;
+  return ring;
+}
+
+/**
+ *
+ * journal_push -
+ * Copies a finished game into the ring of the calling thread.
+ * Never blocks and never touches the file.
+ *
+ * Returns 0 on success and 1 if the writer is behind and the
+ * game was dropped, or if the journal is not open.
+ *
+ */
+int journal_push(const journal_record *rec){
+
+  if(journal_dir == NULL){
+    return 1;
+  }
+
+  journal_ring *ring = local_ring;
+  if(ring == NULL && (ring = register_ring()) == NULL){
+    return 1;
+  }
+
+  unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if(head - tail == JOURNAL_RING_SIZE){
+    return 1;
+  }
+
+  ring->records[head % JOURNAL_RING_SIZE] = *rec;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  return 0;
+}
+
+/**
+ *
+ * journal_drain -
+ * Waits until the writer took every record pushed so far, then
+ * syncs the segment. Used before the process exits.
+ *
+ */
+void journal_drain(void){
+
+  if(journal_dir == NULL){
+    return;
+  }
+
+  journal_ring *ring;
+  for(ring=atomic_load(&all_rings); ring!=NULL; ring=ring->next){
+    while(atomic_load_explicit(&ring->tail, memory_order_acquire) !=
+          atomic_load_explicit(&ring->head, memory_order_acquire)){
+      usleep(1000);
+    }
+  }
+
+  while(atomic_load(&writing)){
+    usleep(1000);
+  }
+  fdatasync(journal_fd);
+}
+
+/**
+ *
+ * journal_write_loop -
+ * Body of the writer thread. Gathers the records of every ring
+ * into one batch, appends it with a single write, and syncs the
+ * segment at most every fsync_ms milliseconds (after every batch
+ * if 0).
+ *
+ */
+static void *journal_write_loop(void *params){
+
+  static journal_record batch[JOURNAL_BATCH];
+  uint64_t last_sync = monotonic_ms();
+  int dirty = 0;
+
+  while(1){
+    unsigned room_left = JOURNAL_SEGMENT_RECORDS - segment_records;
+    unsigned n = 0;
+    journal_ring *ring;
+
+    atomic_store(&writing, 1);
+    for(ring=atomic_load(&all_rings); ring!=NULL; ring=ring->next){
+      unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+      unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+      for(; tail != head && n < JOURNAL_BATCH && n < room_left; ++tail){
+        batch[n++] = ring->records[tail % JOURNAL_RING_SIZE];
+      }
+      atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+
+    if(n > 0){
+      if(write_all(journal_fd, batch, n * sizeof(journal_record))){
+        log_msg(LOG_ERROR, "Journal write failed (errno %ld), %ld games lost.", (long)errno, (long)n);
+      }
+      segment_records += n;
+      dirty = 1;
+
+      if(segment_records == JOURNAL_SEGMENT_RECORDS){
+        if(open_segment()){
+          log_msg(LOG_ERROR, "Could not open journal segment %ld (errno %ld).", (long)segment_number, (long)errno);
+        }
+        last_sync = monotonic_ms();
+        dirty = 0;
+      }
+    }
+    atomic_store(&writing, 0);
+
+    uint64_t now = monotonic_ms();
+    if(dirty && now - last_sync >= (uint64_t)journal_fsync_ms){
+      fdatasync(journal_fd);
+      last_sync = now;
+      dirty = 0;
+    }
+
+    if(n == 0){
+      usleep(JOURNAL_FLUSH_US);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ *
+ * journal_open -
+ * Opens a new segment in dir and starts the writer thread.
+ * Games finished before are not journaled.
+ *
+ * Returns 0 on success and 1 on error.
+ *
+ */
+int journal_open(const char *dir, int fsync_ms){
+
+  journal_dir = dir;
+  journal_fsync_ms = fsync_ms;
+
+  if(open_segment()){
+    journal_dir = NULL;
+    return 1;
+  }
+
+  pthread_t write_thread;
+  if(pthread_create(&write_thread, NULL, journal_write_loop, NULL)){
+    journal_dir = NULL;
+    return 1;
+  }
+  pthread_detach(write_thread);
+  return 0;
+}
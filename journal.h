@@ -0,0 +1,62 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+/*
+ * The journal keeps every finished game in append-only segment files,
+ * DIR/journal-NNNNNN.ttj. A segment is a header followed by fixed size
+ * records, so a reader can map it and index it directly.
+ */
+
+#define JOURNAL_MAGIC 0x4a545454u           /* "TTTJ" */
+#define JOURNAL_VERSION 1
+#define JOURNAL_SEGMENT_RECORDS (1 << 20)   /* 32 MB per segment */
+
+#define JOURNAL_RING_SIZE 1024
+#define JOURNAL_BATCH 4096
+#define JOURNAL_FLUSH_US 10000
+#define DEFAULT_JOURNAL_FSYNC_MS 1000
+
+/* how a game ended */
+#define JOURNAL_FINISHED 0          /* a win or a draw on the board */
+#define JOURNAL_LEFT 1              /* the loser sent LFT */
+#define JOURNAL_TIMEOUT 2           /* the loser ran out of time */
+
+/* journal_record.flags */
+#define JOURNAL_BOT_O 1             /* O was played by the server */
+
+typedef struct journal_header{
+
+  uint32_t magic;
+  uint16_t version;
+  uint16_t record_size;
+  uint64_t created_ms;
+  uint32_t segment;
+  uint8_t reserved[12];
+
+} journal_header;
+
+/* a finished game; move i is a cell, row*3 + col, played by X if i is even */
+typedef struct journal_record{
+
+  uint64_t end_ms;            /* wall clock, in ms since the epoch */
+  uint32_t duration_ms;
+  uint8_t result;             /* 0 for a draw, else the winning player, 1 or 2 */
+  uint8_t reason;
+  uint8_t flags;
+  uint8_t n_moves;
+  uint8_t moves[9];
+  uint8_t reserved[7];
+
+} journal_record;
+
+_Static_assert(sizeof(journal_header) == 32, "journal header layout");
+_Static_assert(sizeof(journal_record) == 32, "journal record layout");
+
+int journal_open(const char *dir, int fsync_ms);
+int journal_push(const journal_record *rec);
+void journal_drain(void);
+uint64_t journal_now_ms(void);
+
+#endif
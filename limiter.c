@@ -0,0 +1,120 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "limiter.h"
+#include "metrics.h"
+
+static unsigned addr_hash(in_addr_t ip, in_port_t port){
+  unsigned long long key = ((unsigned long long)ip << 16) | port;
+  key *= 0x9E3779B97F4A7C15ULL;
+  return (unsigned)(key >> 32);
+}
+
+/**
+ *
+ * limiter_init -
+ * Allocates the buckets of a shard. Each source may send rate
+ * packets per second, after a burst of burst packets; a rate of
+ * 0 lets every source through. Past shed_rate packets per second
+ * on the shard, the packets of sources without a bucket yet are
+ * dropped; 0 never sheds.
+ *
+ * Returns 0 on success and 1 if the allocation failed.
+ *
+ */
+int limiter_init(limiter *lim, int rate, int burst, int shed_rate){
+
+  lim->sets = (limiter_set *)aligned_alloc(CACHE_LINE, LIMITER_SETS * sizeof(limiter_set));
+  if(lim->sets == NULL){
+    return 1;
+  }
+  memset(lim->sets, 0, LIMITER_SETS * sizeof(limiter_set));
+
+  /* packets per second are also thousandths of a packet per millisecond */
+  lim->rate = (unsigned)rate;
+  lim->burst = (unsigned)(burst < 1 ? 1 : burst) * LIMITER_UNIT;
+  lim->shed_packets = (unsigned)((unsigned long)shed_rate * LIMITER_WINDOW_MS / 1000);
+  if(shed_rate > 0 && lim->shed_packets == 0){
+    lim->shed_packets = 1;
+  }
+
+  lim->window_start = limiter_now();
+  lim->window_packets = 0;
+  return 0;
+}
+
+/* milliseconds of a coarse clock, read once per batch of packets */
+unsigned limiter_now(void){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return (unsigned)((unsigned long)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+/**
+ *
+ * limiter_admit -
+ * Decides if a packet received from addr at now_ms is handled,
+ * before anything is allocated or looked up for it. Takes a
+ * token from the bucket of the source, refilled for the time
+ * since its last packet. A new source gets a full bucket in
+ * the way of its set that was used the longest time ago, unless
+ * the shard is over its shedding rate: sources that were already
+ * talking keep their buckets, and so their games, under a flood.
+ *
+ * Returns 1 if the packet is admitted and 0 if it is dropped.
+ *
+ */
+int limiter_admit(limiter *lim, const struct sockaddr_in *addr, unsigned now_ms){
+
+  if(lim->rate == 0 && lim->shed_packets == 0){
+    return 1;
+  }
+
+  if(now_ms - lim->window_start >= LIMITER_WINDOW_MS){
+    lim->window_start = now_ms;
+    lim->window_packets = 0;
+  }
+  lim->window_packets += 1;
+
+  limiter_set *set = &lim->sets[addr_hash(addr->sin_addr.s_addr, addr->sin_port) & (LIMITER_SETS - 1)];
+  limiter_entry *victim = &set->ways[0];
+  int i;
+  for(i=0; i<LIMITER_WAYS; ++i){
+    limiter_entry *entry = &set->ways[i];
+
+    if(entry->used && entry->ip == addr->sin_addr.s_addr && entry->port == addr->sin_port){
+      if(lim->rate == 0){
+        entry->last_ms = now_ms;
+        return 1;
+      }
+
+      unsigned long long tokens = entry->tokens + (unsigned long long)(now_ms - entry->last_ms) * lim->rate;
+      entry->tokens = tokens > lim->burst ? lim->burst : (unsigned)tokens;
+      entry->last_ms = now_ms;
+
+      if(entry->tokens < LIMITER_UNIT){
+        metrics_count(COUNT_RATE_DROPS);
+        return 0;
+      }
+      entry->tokens -= LIMITER_UNIT;
+      return 1;
+    }
+
+    if(victim->used && (!entry->used || now_ms - entry->last_ms > now_ms - victim->last_ms)){
+      victim = entry;
+    }
+  }
+
+  if(lim->shed_packets && lim->window_packets > lim->shed_packets){
+    metrics_count(COUNT_SHED_DROPS);
+    return 0;
+  }
+
+  victim->ip = addr->sin_addr.s_addr;
+  victim->port = addr->sin_port;
+  victim->used = 1;
+  victim->tokens = lim->burst - LIMITER_UNIT;
+  victim->last_ms = now_ms;
+  return 1;
+}
@@ -0,0 +1,50 @@
+#ifndef LIMITER_H
+#define LIMITER_H
+
+#include <netinet/in.h>
+
+#include "ring.h"
+
+#define LIMITER_WAYS 4                  /* sources per set: one cache line */
+#define LIMITER_SETS 16384              /* 64k sources per shard */
+#define LIMITER_WINDOW_MS 100           /* the load of the shard is counted over this window */
+#define LIMITER_UNIT 1000               /* tokens of one packet */
+#define DEFAULT_SOURCE_RATE 1000        /* packets per second of one source */
+#define DEFAULT_SOURCE_BURST 1000
+#define DEFAULT_SHED_RATE 200000        /* packets per second of one shard */
+
+/* token bucket of one source address; any port, 0 too, is a source */
+typedef struct limiter_entry{
+
+  in_addr_t ip;
+  in_port_t port;
+  unsigned short used;        /* 0 for a free way */
+  unsigned tokens;            /* in thousandths of a packet */
+  unsigned last_ms;           /* last refill, and the age of the entry for eviction */
+
+} limiter_entry;
+
+typedef struct limiter_set{
+
+  _Alignas(CACHE_LINE) limiter_entry ways[LIMITER_WAYS];
+
+} limiter_set;
+
+/* admission of the packets of one shard, only touched by its receiver */
+typedef struct limiter{
+
+  limiter_set *sets;
+  unsigned rate;              /* tokens per millisecond, 0 for no limit */
+  unsigned burst;             /* most tokens a source can save */
+  unsigned shed_packets;      /* packets per window before new sources are refused, 0 for never */
+
+  unsigned window_start;
+  unsigned window_packets;
+
+} limiter;
+
+int limiter_init(limiter *lim, int rate, int burst, int shed_rate);
+unsigned limiter_now(void);
+int limiter_admit(limiter *lim, const struct sockaddr_in *addr, unsigned now_ms);
+
+#endif
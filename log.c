@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+
+#include "log.h"
+
+/* records written by one thread and read by the flusher */
+typedef struct log_ring{
+
+  log_record records[LOG_RING_SIZE];
+  _Alignas(64) atomic_uint head;    /* next record to write */
+  _Alignas(64) atomic_uint tail;    /* next record to flush */
+  atomic_ulong dropped;
+  struct log_ring *next;
+
+} log_ring;
+
+atomic_int log_level = LOG_INFO;
+
+static const char *level_names[] = {"off", "error", "info", "debug"};
+
+static __thread log_ring *local_ring;
+static log_ring *_Atomic all_rings;
+static pthread_mutex_t register_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ *
+ * log_parse_level -
+ * Returns the level named off, error, info or debug, or -1 if
+ * the name is unknown.
+ *
+ */
+int log_parse_level(const char *name){
+
+  int i;
+  for(i=LOG_OFF; i<=LOG_DEBUG; ++i){
+    if(!strcmp(name, level_names[i])){
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ *
+ * register_ring -
+ * Gives the calling thread its own ring. Only happens on the
+ * first log line of each thread.
+ *
+ */
+static log_ring *register_ring(void){
+
+  log_ring *ring = (log_ring *)calloc(1, sizeof(log_ring));
+  if(ring == NULL){
+    return NULL;
+  }
+
+  pthread_mutex_lock(&register_mutex);
+  ring->next = atomic_load(&all_rings);
+  atomic_store(&all_rings, ring);
+  pthread_mutex_unlock(&register_mutex);
+
+  local_ring = ring;
+  return ring;
+}
+
+/**
+ *
+ * log_push -
+ * Copies a log line into the ring of the calling thread. Never
+ * blocks: if the flusher is behind, the line is counted as
+ * dropped.
+ *
+ */
+void log_push(int level, const char *fmt, const struct sockaddr_in *addr,
+              const void *data, int len, const long *args){
+
+  log_ring *ring = local_ring;
+  if(ring == NULL && (ring = register_ring()) == NULL){
+    return;
+  }
+
+  unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if(head - tail == LOG_RING_SIZE){
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  log_record *rec = &ring->records[head % LOG_RING_SIZE];
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+  rec->time_ns = (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+  rec->level = (unsigned char)level;
+  rec->fmt = fmt;
+  memcpy(rec->args, args, sizeof(rec->args));
+
+  rec->has_addr = addr != NULL;
+  if(addr != NULL){
+    rec->ip = addr->sin_addr.s_addr;
+    rec->port = addr->sin_port;
+  }
+
+  if(len > LOG_MAX_BYTES){
+    len = LOG_MAX_BYTES;
+  }
+  rec->n_bytes = data != NULL && len > 0 ? (unsigned char)len : 0;
+  memcpy(rec->bytes, data, rec->n_bytes);
+
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static void format_record(FILE *out, const log_record *rec){
+
+  fprintf(out, "%llu.%06llu [%s] ", rec->time_ns / 1000000000ULL,
+          (rec->time_ns / 1000) % 1000000ULL, level_names[rec->level]);
+
+  if(rec->has_addr){
+    char buffer[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &rec->ip, buffer, INET_ADDRSTRLEN);
+    fprintf(out, "%s::%d ", buffer, ntohs(rec->port));
+  }
+
+  fprintf(out, rec->fmt, rec->args[0], rec->args[1], rec->args[2], rec->args[3]);
+
+  int i;
+  for(i=0; i<rec->n_bytes; ++i){
+    fprintf(out, "%s%02x", i ? " " : " [", rec->bytes[i]);
+  }
+  fprintf(out, "%s\n", rec->n_bytes ? "]" : "");
+}
+
+/**
+ *
+ * log_flush_loop -
+ * Body of the flusher thread. Formats the records of every
+ * thread and writes them to stdout, off the hot path.
+ *
+ */
+static void *log_flush_loop(void *params){
+
+  while(1){
+    int written = 0;
+    log_ring *ring;
+
+    for(ring=atomic_load(&all_rings); ring!=NULL; ring=ring->next){
+      unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+      unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+      for(; tail != head; ++tail){
+        format_record(stdout, &ring->records[tail % LOG_RING_SIZE]);
+        written = 1;
+      }
+      atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+      unsigned long dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+      if(dropped){
+        fprintf(stdout, "[log] %lu lines dropped\n", dropped);
+        written = 1;
+      }
+    }
+
+    if(written){
+      fflush(stdout);
+    } else {
+      usleep(LOG_FLUSH_US);
+    }
+  }
+
+  return NULL;
+}
+
+/* SIGUSR1 makes the log more verbose, SIGUSR2 less */
+static void change_level(int sig){
+  int level = atomic_load(&log_level) + (sig == SIGUSR1 ? 1 : -1);
+  if(level >= LOG_OFF && level <= LOG_DEBUG){
+    atomic_store(&log_level, level);
+  }
+}
+
+/**
+ *
+ * log_init -
+ * Sets the log level and starts the flusher thread. The level
+ * can later be changed with SIGUSR1 and SIGUSR2.
+ *
+ * Returns 0 on success and 1 if the thread was not created.
+ *
+ */
+int log_init(int level){
+
+  atomic_store(&log_level, level);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = change_level;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &sa, NULL);
+  sigaction(SIGUSR2, &sa, NULL);
+
+  pthread_t flush_thread;
+  if(pthread_create(&flush_thread, NULL, log_flush_loop, NULL)){
+    return 1;
+  }
+  pthread_detach(flush_thread);
+  return 0;
+}
@@ -0,0 +1,60 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdatomic.h>
+#include <netinet/in.h>
+
+/* log levels */
+#define LOG_OFF 0
+#define LOG_ERROR 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+#define LOG_MAX_ARGS 4
+#define LOG_MAX_BYTES 32
+#define LOG_RING_SIZE 1024
+#define LOG_FLUSH_US 10000
+
+/* a log line, formatted later by the flusher thread */
+typedef struct log_record{
+
+  unsigned long long time_ns;
+  const char *fmt;            /* static format, arguments are longs */
+  long args[LOG_MAX_ARGS];
+  in_addr_t ip;
+  in_port_t port;
+  unsigned char level;
+  unsigned char has_addr;
+  unsigned char n_bytes;
+  unsigned char bytes[LOG_MAX_BYTES];
+
+} log_record;
+
+extern atomic_int log_level;
+
+#define log_enabled(level) ((level) <= atomic_load_explicit(&log_level, memory_order_relaxed))
+
+/*
+ * log_msg(level, fmt, ...) logs up to LOG_MAX_ARGS integer arguments,
+ * stored as long, so the format must use %ld, %lx, %lc...
+ * log_packet also records a client address and the first bytes of a
+ * packet. Both only cost a branch when the level is disabled.
+ */
+#define log_msg(level, fmt, ...) \
+  do { \
+    if (log_enabled(level)) \
+      log_push((level), (fmt), NULL, NULL, 0, (long[LOG_MAX_ARGS + 1]){0, ##__VA_ARGS__} + 1); \
+  } while (0)
+
+#define log_packet(level, addr, data, len, fmt, ...) \
+  do { \
+    if (log_enabled(level)) \
+      log_push((level), (fmt), (addr), (data), (len), (long[LOG_MAX_ARGS + 1]){0, ##__VA_ARGS__} + 1); \
+  } while (0)
+
+int log_init(int level);
+int log_parse_level(const char *name);
+void log_push(int level, const char *fmt, const struct sockaddr_in *addr,
+              const void *data, int len, const long *args);
+
+#endif
@@ -0,0 +1,192 @@
+#include <string.h>
+
+#include "server.h"
+#include "message.h"
+#include "cookie.h"
+
+/**
+ *
+ * decode_message -
+ * Reads the code of a packet of n_bytes bytes and points the
+ * payload at the bytes that follow it.
+ *
+ * Returns 0 on success and 1 if the packet is empty or its
+ * code is not one a client sends, in which case the code is
+ * left as is (0 for an empty packet) and the payload is empty.
+ *
+ */
+int decode_message(const char *data, int n_bytes, message_view *msg){
+
+  msg->code = n_bytes > 0 ? data[0] : 0;
+  msg->payload = data + 1;
+  msg->len = 0;
+
+  if(msg->code != MOV && msg->code != TXT && msg->code != SNP && msg->code != LFT &&
+     msg->code != ACK && msg->code != HNT && msg->code != CKE){
+    return 1;
+  }
+
+  msg->len = n_bytes - 1;
+  return 0;
+}
+
+/**
+ *
+ * decode_mov -
+ * Reads the cell of a MOV message, and the ack carried by the
+ * moves of reliable clients. The cell is not checked against
+ * the board here.
+ *
+ * Returns 0 on success and 1 if the message is too short.
+ *
+ */
+int decode_mov(const message_view *msg, mov_view *mov){
+
+  if(msg->code != MOV || msg->len < 2){
+    return 1;
+  }
+
+  mov->col = (unsigned char) msg->payload[0];
+  mov->row = (unsigned char) msg->payload[1];
+  mov->ack = msg->len >= 3 ? (unsigned char) msg->payload[2] : -1;
+  return 0;
+}
+
+/* reads the next sequence number expected by a reliable client */
+int decode_ack(const message_view *msg, unsigned char *ack){
+
+  if(msg->code != ACK || msg->len < 1){
+    return 1;
+  }
+
+  *ack = (unsigned char) msg->payload[0];
+  return 0;
+}
+
+/* points at the text of a TXT message, without its NUL */
+int decode_txt(const message_view *msg, txt_view *txt){
+
+  if(msg->code != TXT){
+    return 1;
+  }
+
+  const char *end = memchr(msg->payload, '\0', msg->len);
+  txt->text = msg->payload;
+  txt->len = end ? (int)(end - msg->payload) : msg->len;
+  return 0;
+}
+
+/**
+ *
+ * decode_hello -
+ * Checks if a text asks to join the game: "Hello", optionally
+ * followed by the board encoding the client wants, "compact"
+ * or "delta", by "reliable" if the client acks the messages
+ * of the server, and by the name of a board variant.
+ *
+ * Returns 0 on success and 1 if the text is not a Hello.
+ *
+ */
+int decode_hello(const txt_view *txt, hello_view *hello){
+
+  if(txt->len < 5 || memcmp(txt->text, "Hello", 5)){
+    return 1;
+  }
+
+  hello->fyi_mode = FYI_LEGACY;
+  hello->reliable = 0;
+  hello->variant = BOARD_CLASSIC;
+
+  const char *word = txt->text + 5;
+  const char *end = txt->text + txt->len;
+  while(word < end){
+    if(*word != ' '){
+      return 1;
+    }
+    word += 1;
+
+    const char *space = memchr(word, ' ', end - word);
+    int len = (int)((space ? space : end) - word);
+    int v;
+    for(v=0; v<N_BOARDS; ++v){
+      if((int)strlen(board_variants[v].name) == len && !memcmp(word, board_variants[v].name, len)){
+        break;
+      }
+    }
+
+    if(v < N_BOARDS){
+      hello->variant = v;
+    } else if(len == 7 && !memcmp(word, "compact", len)){
+      hello->fyi_mode = FYI_COMPACT;
+    } else if(len == 5 && !memcmp(word, "delta", len)){
+      hello->fyi_mode = FYI_DELTA;
+    } else if(len == 8 && !memcmp(word, "reliable", len)){
+      hello->reliable = 1;
+    } else {
+      return 1;
+    }
+    word += len;
+  }
+
+  return 0;
+}
+
+/**
+ *
+ * decode_watch -
+ * Checks if a text asks to follow a game as a spectator:
+ * "Watch", optionally followed by the number of a room.
+ *
+ * Returns 0 on success and 1 if the text is not a Watch.
+ *
+ */
+int decode_watch(const txt_view *txt, watch_view *watch){
+
+  if(txt->len < 5 || memcmp(txt->text, "Watch", 5)){
+    return 1;
+  }
+
+  watch->room_id = -1;
+  if(txt->len == 5){
+    return 0;
+  }
+
+  /* a space, then at most 9 digits */
+  if(txt->text[5] != ' ' || txt->len == 6 || txt->len > 15){
+    return 1;
+  }
+
+  int i, room_id = 0;
+  for(i=6; i<txt->len; ++i){
+    if(txt->text[i] < '0' || txt->text[i] > '9'){
+      return 1;
+    }
+    room_id = room_id * 10 + (txt->text[i] - '0');
+  }
+
+  watch->room_id = room_id;
+  return 0;
+}
+
+/**
+ *
+ * decode_cookie -
+ * Splits the echo of a join cookie into the cookie and the TXT
+ * message that follows it. The cookie is not checked here.
+ *
+ * Returns 0 on success and 1 if the message is too short or
+ * does not carry a TXT.
+ *
+ */
+int decode_cookie(const message_view *msg, cookie_view *cookie){
+
+  if(msg->code != CKE || msg->len < COOKIE_SIZE + 1 || msg->payload[COOKIE_SIZE] != TXT){
+    return 1;
+  }
+
+  cookie->cookie = (const unsigned char *) msg->payload;
+  cookie->hello.code = TXT;
+  cookie->hello.payload = msg->payload + COOKIE_SIZE + 1;
+  cookie->hello.len = msg->len - COOKIE_SIZE - 1;
+  return 0;
+}
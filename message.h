@@ -0,0 +1,69 @@
+#ifndef MESSAGE_H
+#define MESSAGE_H
+
+/*
+ * Views over a received packet. Decoding checks the length once
+ * and points into the receive buffer: nothing is copied, and a
+ * view is only valid as long as the buffer.
+ */
+
+/* any message from a client: its code and the bytes after it */
+typedef struct message_view{
+
+  char code;
+  const char *payload;
+  int len;
+
+} message_view;
+
+/* [MOV][col][row], then the ack of a reliable client */
+typedef struct mov_view{
+
+  unsigned char col;
+  unsigned char row;
+  int ack;                    /* next sequence number expected, or -1 */
+
+} mov_view;
+
+/* [TXT][text], the text ending at a NUL or at the end of the packet */
+typedef struct txt_view{
+
+  const char *text;
+  int len;
+
+} txt_view;
+
+/* [TXT]Hello [compact|delta] [reliable] [classic|four|gomoku] */
+typedef struct hello_view{
+
+  int fyi_mode;
+  int reliable;
+  int variant;                /* BOARD_CLASSIC unless the client names a board */
+
+} hello_view;
+
+/* [CKE][cookie][TXT]Hello... or Watch..., with the cookie the server gave for it */
+typedef struct cookie_view{
+
+  const unsigned char *cookie;
+  message_view hello;         /* the TXT that follows the cookie */
+
+} cookie_view;
+
+/* [TXT]Watch [ROOM] */
+typedef struct watch_view{
+
+  int room_id;                /* or -1 for the game started last */
+
+} watch_view;
+
+int decode_message(const char *data, int n_bytes, message_view *msg);
+
+int decode_mov(const message_view *msg, mov_view *mov);
+int decode_ack(const message_view *msg, unsigned char *ack);
+int decode_txt(const message_view *msg, txt_view *txt);
+int decode_hello(const txt_view *txt, hello_view *hello);
+int decode_watch(const txt_view *txt, watch_view *watch);
+int decode_cookie(const message_view *msg, cookie_view *cookie);
+
+#endif
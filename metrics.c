@@ -0,0 +1,362 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+
+__thread thread_metrics *local_metrics;
+
+static thread_metrics *_Atomic all_metrics;
+static pthread_mutex_t register_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *counter_names[N_COUNTERS] = {
+  "recv_calls", "recv_packets", "send_calls", "send_packets", "packets", "moves",
+  "games_started", "games_finished", "timeouts", "rejected", "queue_drops",
+  "event_drops", "retransmits", "peers_lost", "injected_losses", "bot_games", "hints",
+  "journal_drops", "rate_drops", "shed_drops",
+  "cookies", "bad_cookies"
+};
+
+static const char *stage_names[N_STAGES] = {
+  "queue", "handle", "wakeup", "game", "send"
+};
+
+/**
+ *
+ * metrics_register -
+ * Gives the calling thread its own counters and histograms,
+ * accounted to a shard. Called once when each thread starts.
+ *
+ */
+void metrics_register(int shard){
+
+  thread_metrics *metrics = (thread_metrics *)calloc(1, sizeof(thread_metrics));
+  if(metrics == NULL){
+    return;
+  }
+  metrics->shard = shard;
+
+  pthread_mutex_lock(&register_mutex);
+  metrics->next = atomic_load(&all_metrics);
+  atomic_store(&all_metrics, metrics);
+  pthread_mutex_unlock(&register_mutex);
+
+  local_metrics = metrics;
+}
+
+unsigned long metrics_now(void){
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long)now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+/* counts from a thread that never registered, as part of shard 0 */
+void metrics_add_slow(int counter, unsigned long n){
+
+  if(local_metrics == NULL){
+    metrics_register(0);
+    if(local_metrics == NULL){
+      return;
+    }
+  }
+
+  metrics_add(counter, n);
+}
+
+static int bucket_of(unsigned long ns){
+
+  if(ns < HIST_SUB){
+    return (int)ns;
+  }
+
+  if(ns >= 1UL << HIST_MAX_BITS){
+    ns = (1UL << HIST_MAX_BITS) - 1;
+  }
+
+  int msb = 63 - __builtin_clzl(ns);
+  int shift = msb - HIST_SUB_BITS;
+  return (shift + 1) * HIST_SUB + (int)((ns >> shift) - HIST_SUB);
+}
+
+/* smallest value that falls in a bucket */
+static unsigned long bucket_value(int bucket){
+
+  if(bucket < HIST_SUB){
+    return (unsigned long)bucket;
+  }
+
+  int shift = bucket / HIST_SUB - 1;
+  return (unsigned long)(HIST_SUB + bucket % HIST_SUB) << shift;
+}
+
+static void relaxed_add(atomic_ulong *c, unsigned long n){
+  atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/**
+ *
+ * histogram_record -
+ * Adds a duration, in nanoseconds, to a histogram written by
+ * the calling thread only. Buckets are 1/16 of a power of two
+ * wide, so any value is known within about 6%.
+ *
+ */
+void histogram_record(histogram *hist, unsigned long ns){
+
+  relaxed_add(&hist->buckets[bucket_of(ns)], 1);
+  relaxed_add(&hist->count, 1);
+  relaxed_add(&hist->sum, ns);
+  if(ns > atomic_load_explicit(&hist->max, memory_order_relaxed)){
+    atomic_store_explicit(&hist->max, ns, memory_order_relaxed);
+  }
+}
+
+/* adds the samples of from to a histogram written by the calling thread */
+static void histogram_merge(histogram *to, const histogram *from){
+
+  int i;
+  for(i=0; i<HIST_BUCKETS; ++i){
+    relaxed_add(&to->buckets[i], atomic_load_explicit(&from->buckets[i], memory_order_relaxed));
+  }
+  relaxed_add(&to->count, atomic_load_explicit(&from->count, memory_order_relaxed));
+  relaxed_add(&to->sum, atomic_load_explicit(&from->sum, memory_order_relaxed));
+
+  unsigned long max = atomic_load_explicit(&from->max, memory_order_relaxed);
+  if(max > atomic_load_explicit(&to->max, memory_order_relaxed)){
+    atomic_store_explicit(&to->max, max, memory_order_relaxed);
+  }
+}
+
+/* adds a duration to the histogram of a stage of the calling thread */
+void metrics_record(int stage, unsigned long ns){
+
+  if(local_metrics == NULL){
+    metrics_register(0);
+    if(local_metrics == NULL){
+      return;
+    }
+  }
+
+  histogram_record(&local_metrics->stages[stage], ns);
+}
+
+/**
+ *
+ * metrics_total -
+ * Sums a counter over the threads of a shard, or of every
+ * shard if shard is -1.
+ *
+ */
+unsigned long metrics_total(int shard, int counter){
+
+  unsigned long total = 0;
+  thread_metrics *metrics;
+
+  for(metrics=atomic_load(&all_metrics); metrics!=NULL; metrics=metrics->next){
+    if(shard < 0 || metrics->shard == shard){
+      total += atomic_load_explicit(&metrics->counters[counter], memory_order_relaxed);
+    }
+  }
+
+  return total;
+}
+
+/**
+ *
+ * histogram_percentile -
+ * Returns the value below which a share (0 to 1) of the
+ * samples of a histogram falls, or 0 if it has no sample.
+ *
+ */
+unsigned long histogram_percentile(const histogram *hist, double share){
+
+  unsigned long count = atomic_load_explicit(&hist->count, memory_order_relaxed);
+  if(count == 0){
+    return 0;
+  }
+
+  unsigned long rank = (unsigned long)(share * count);
+  unsigned long seen = 0;
+
+  int i;
+  for(i=0; i<HIST_BUCKETS; ++i){
+    seen += atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+    if(seen > rank){
+      return bucket_value(i);
+    }
+  }
+
+  return bucket_value(HIST_BUCKETS - 1);
+}
+
+static void write_stage(FILE *out, int stage){
+
+  static __thread histogram merged;
+  memset(&merged, 0, sizeof(merged));
+
+  thread_metrics *metrics;
+  for(metrics=atomic_load(&all_metrics); metrics!=NULL; metrics=metrics->next){
+    histogram_merge(&merged, &metrics->stages[stage]);
+  }
+
+  unsigned long count = atomic_load_explicit(&merged.count, memory_order_relaxed);
+  unsigned long sum = atomic_load_explicit(&merged.sum, memory_order_relaxed);
+
+  fprintf(out, "\"%s\": {\"count\": %lu, \"mean_ns\": %lu, \"p50_ns\": %lu, \"p90_ns\": %lu, "
+          "\"p99_ns\": %lu, \"p999_ns\": %lu, \"max_ns\": %lu}",
+          stage_names[stage], count, count ? sum / count : 0,
+          histogram_percentile(&merged, 0.5), histogram_percentile(&merged, 0.9),
+          histogram_percentile(&merged, 0.99), histogram_percentile(&merged, 0.999),
+          atomic_load_explicit(&merged.max, memory_order_relaxed));
+}
+
+/**
+ *
+ * metrics_write_json -
+ * Writes a snapshot of the counters of every shard and of the
+ * latency of every stage, merged over all threads, as JSON.
+ *
+ */
+void metrics_write_json(FILE *out, int n_shards){
+
+  fprintf(out, "{\"time_ns\": %lu, \"shards\": [", metrics_now());
+
+  int shard, i;
+  for(shard=0; shard<n_shards; ++shard){
+    fprintf(out, "%s{\"id\": %d", shard ? ", " : "", shard);
+    for(i=0; i<N_COUNTERS; ++i){
+      fprintf(out, ", \"%s\": %lu", counter_names[i], metrics_total(shard, i));
+    }
+    fprintf(out, "}");
+  }
+
+  fprintf(out, "], \"stages\": {");
+  for(i=0; i<N_STAGES; ++i){
+    fprintf(out, "%s", i ? ", " : "");
+    write_stage(out, i);
+  }
+  fprintf(out, "}}\n");
+}
+
+typedef struct admin_params{
+
+  int fd;
+  int n_shards;
+
+} admin_params;
+
+/**
+ *
+ * admin_loop -
+ * Body of the admin thread. Builds each snapshot in memory and
+ * sends it with MSG_NOSIGNAL: a client that hangs up before
+ * reading only loses its snapshot, it cannot raise SIGPIPE.
+ * While accept keeps failing (out of descriptors), the thread
+ * waits longer and longer before it tries again, and logs the
+ * failures once per ADMIN_LOG_INTERVAL_S.
+ *
+ */
+static void *admin_loop(void *params){
+
+  admin_params *admin = (admin_params *)params;
+  int backoff_ms = 0;
+  long failures = 0;
+  time_t last_log = 0;
+
+  while(1){
+    int client = accept(admin->fd, NULL, NULL);
+    if(client < 0){
+      if(errno == EINTR || errno == ECONNABORTED){
+        continue;
+      }
+
+      failures += 1;
+      time_t now = time(NULL);
+      if(now - last_log >= ADMIN_LOG_INTERVAL_S){
+        fprintf(stderr, "Admin socket: %ld failed accepts (%s), retrying.\n", failures, strerror(errno));
+        failures = 0;
+        last_log = now;
+      }
+
+      backoff_ms = backoff_ms == 0 ? ADMIN_BACKOFF_MIN_MS : backoff_ms * 2;
+      if(backoff_ms > ADMIN_BACKOFF_MAX_MS){
+        backoff_ms = ADMIN_BACKOFF_MAX_MS;
+      }
+      usleep(backoff_ms * 1000);
+      continue;
+    }
+    backoff_ms = 0;
+
+    char *json = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&json, &len);
+    if(out != NULL){
+      metrics_write_json(out, admin->n_shards);
+      fclose(out);
+
+      size_t sent = 0;
+      while(sent < len){
+        ssize_t n = send(client, json + sent, len - sent, MSG_NOSIGNAL);
+        if(n <= 0){
+          break;
+        }
+        sent += n;
+      }
+      free(json);
+    }
+    close(client);
+  }
+
+  return NULL;
+}
+
+/**
+ *
+ * metrics_serve -
+ * Opens a Unix socket at path. Every connection receives one
+ * JSON snapshot of the metrics, then is closed.
+ *
+ * Returns 0 on success and 1 on error.
+ *
+ */
+int metrics_serve(const char *path, int n_shards){
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(addr.sun_path)){
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+
+  admin_params *admin = (admin_params *)malloc(sizeof(admin_params));
+  if(admin == NULL){
+    return 1;
+  }
+  admin->n_shards = n_shards;
+
+  admin->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path);
+  if(admin->fd < 0 || bind(admin->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+     listen(admin->fd, 16) < 0){
+    perror("admin socket");
+    free(admin);
+    return 1;
+  }
+
+  pthread_t admin_thread;
+  if(pthread_create(&admin_thread, NULL, admin_loop, admin)){
+    free(admin);
+    return 1;
+  }
+  pthread_detach(admin_thread);
+  return 0;
+}
@@ -0,0 +1,97 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdatomic.h>
+
+/* counters */
+#define COUNT_RECV_CALLS 0
+#define COUNT_RECV_PACKETS 1
+#define COUNT_SEND_CALLS 2
+#define COUNT_SEND_PACKETS 3
+#define COUNT_PACKETS 4           /* packets handled */
+#define COUNT_MOVES 5
+#define COUNT_GAMES_STARTED 6
+#define COUNT_GAMES_FINISHED 7
+#define COUNT_TIMEOUTS 8
+#define COUNT_REJECTED 9          /* clients refused because every room was full */
+#define COUNT_QUEUE_DROPS 10      /* packets dropped because the workers were behind */
+#define COUNT_EVENT_DROPS 11      /* events dropped because a room queue was full */
+#define COUNT_RETRANSMITS 12
+#define COUNT_PEERS_LOST 13
+#define COUNT_INJECTED_LOSSES 14
+#define COUNT_BOT_GAMES 15        /* games against the built-in opponent */
+#define COUNT_HINTS 16
+#define COUNT_JOURNAL_DROPS 17    /* finished games the journal writer had no room for */
+#define COUNT_RATE_DROPS 18       /* packets of sources over their rate */
+#define COUNT_SHED_DROPS 19       /* packets of new sources refused while the shard was overloaded */
+#define COUNT_COOKIES 20          /* join cookies sent */
+#define COUNT_BAD_COOKIES 21      /* join cookies echoed that were forged or expired */
+#define N_COUNTERS 22
+
+/* stages timed by the histograms */
+#define STAGE_QUEUE 0     /* from the receive to a worker picking the packet up */
+#define STAGE_HANDLE 1    /* dispatch of a packet */
+#define STAGE_WAKEUP 2    /* from an event being pushed to the game logic taking it */
+#define STAGE_GAME 3      /* game logic of a ready room */
+#define STAGE_SEND 4      /* send system calls */
+#define N_STAGES 5
+
+/* log-linear buckets: 16 per power of two, up to 2^40 ns */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* the admin thread when accept keeps failing */
+#define ADMIN_BACKOFF_MIN_MS 10
+#define ADMIN_BACKOFF_MAX_MS 1000
+#define ADMIN_LOG_INTERVAL_S 10
+
+typedef struct histogram{
+
+  atomic_ulong buckets[HIST_BUCKETS];
+  atomic_ulong count;
+  atomic_ulong sum;
+  atomic_ulong max;
+
+} histogram;
+
+/* written by one thread only, and merged by the readers */
+typedef struct thread_metrics{
+
+  int shard;
+  atomic_ulong counters[N_COUNTERS];
+  histogram stages[N_STAGES];
+  struct thread_metrics *next;
+
+} thread_metrics;
+
+extern __thread thread_metrics *local_metrics;
+
+void metrics_register(int shard);
+unsigned long metrics_now(void);
+
+void histogram_record(histogram *hist, unsigned long ns);
+unsigned long histogram_percentile(const histogram *hist, double share);
+
+void metrics_add_slow(int counter, unsigned long n);
+void metrics_record(int stage, unsigned long ns);
+
+unsigned long metrics_total(int shard, int counter);
+void metrics_write_json(FILE *out, int n_shards);
+int metrics_serve(const char *path, int n_shards);
+
+/* only the owner thread writes its counters: no atomic read-modify-write */
+#define metrics_add(counter, n) do { \
+    if (local_metrics == NULL) { \
+      metrics_add_slow(counter, n); \
+    } else { \
+      atomic_ulong *c_ = &local_metrics->counters[counter]; \
+      atomic_store_explicit(c_, atomic_load_explicit(c_, memory_order_relaxed) + (n), memory_order_relaxed); \
+    } \
+  } while (0)
+
+#define metrics_count(counter) metrics_add(counter, 1)
+
+#endif
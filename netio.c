@@ -0,0 +1,231 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "netio.h"
+#include "log.h"
+#include "metrics.h"
+
+/* messages queued by one thread until its next flush */
+typedef struct outbox{
+
+  int fd;
+  int n;
+  struct mmsghdr headers[MAX_BATCH];
+  struct iovec iovecs[MAX_BATCH];
+  udp_info messages[MAX_BATCH];
+
+} outbox;
+
+static int io_batch;
+static __thread outbox *local_outbox;
+
+/**
+ *
+ * netio_init -
+ * Sets the batching mode of the server. With batch > 1, packets
+ * are received with recvmmsg and sent with sendmmsg, up to
+ * batch messages per system call.
+ *
+ */
+void netio_init(int batch){
+  io_batch = batch > MAX_BATCH ? MAX_BATCH : batch;
+}
+
+/**
+ *
+ * netio_recv -
+ * Blocks until at least one datagram arrives and fills up to n
+ * udp_info buffers with the datagrams that are already queued
+ * in the socket.
+ *
+ * Returns the number of buffers filled, 0 if the socket is
+ * non-blocking and has no data, or -1 on error.
+ *
+ */
+int netio_recv(int fd, udp_info **infos, int n){
+
+  int i;
+
+  if(io_batch <= 1 || n <= 1){
+    infos[0]->len = sizeof(struct sockaddr_in);
+    infos[0]->n_bytes = recvfrom(fd, infos[0]->buffer, PACKET_SIZE, MSG_WAITALL,
+                                 (struct sockaddr *)&infos[0]->client_addr, &infos[0]->len);
+    metrics_count(COUNT_RECV_CALLS);
+    if(infos[0]->n_bytes < 0){
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    }
+    metrics_count(COUNT_RECV_PACKETS);
+    return 1;
+  }
+
+  if(n > io_batch){
+    n = io_batch;
+  }
+
+  struct mmsghdr headers[MAX_BATCH];
+  struct iovec iovecs[MAX_BATCH];
+  memset(headers, 0, n * sizeof(struct mmsghdr));
+
+  for(i=0; i<n; ++i){
+    iovecs[i].iov_base = infos[i]->buffer;
+    iovecs[i].iov_len = PACKET_SIZE;
+    headers[i].msg_hdr.msg_iov = &iovecs[i];
+    headers[i].msg_hdr.msg_iovlen = 1;
+    headers[i].msg_hdr.msg_name = &infos[i]->client_addr;
+    headers[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+  }
+
+  int received = recvmmsg(fd, headers, n, MSG_WAITFORONE, NULL);
+  metrics_count(COUNT_RECV_CALLS);
+  if(received < 0){
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+  }
+
+  for(i=0; i<received; ++i){
+    infos[i]->n_bytes = headers[i].msg_len;
+    infos[i]->len = headers[i].msg_hdr.msg_namelen;
+  }
+
+  metrics_add(COUNT_RECV_PACKETS, received);
+  return received;
+}
+
+/**
+ *
+ * netio_send -
+ * Sends a message right away, or queues a copy of it in the
+ * outbox of the calling thread when batching is enabled. The
+ * outbox is flushed when it is full or when netio_flush is
+ * called at the end of the current tick.
+ *
+ */
+void netio_send(int fd, const udp_info *info){
+
+  if(io_batch <= 1){
+    unsigned long start = metrics_now();
+    if (sendto(fd, (const char *)info->buffer, info->n_bytes,
+               MSG_CONFIRM, (const struct sockaddr *)&info->client_addr, info->len) < 0){
+      log_msg(LOG_ERROR, "sendto failed: errno %ld", (long)errno);
+    }
+    metrics_record(STAGE_SEND, metrics_now() - start);
+    metrics_count(COUNT_SEND_CALLS);
+    metrics_count(COUNT_SEND_PACKETS);
+    return;
+  }
+
+  if(local_outbox == NULL){
+    local_outbox = (outbox *)calloc(1, sizeof(outbox));
+    if(local_outbox == NULL){
+      fprintf(stderr, "Malloc Error\n");
+      return;
+    }
+  }
+
+  if(local_outbox->n == io_batch || (local_outbox->n > 0 && local_outbox->fd != fd)){
+    netio_flush();
+  }
+  local_outbox->fd = fd;
+
+  int i = local_outbox->n++;
+  udp_info *msg = &local_outbox->messages[i];
+
+  memcpy(msg->buffer, info->buffer, info->n_bytes);
+  msg->n_bytes = info->n_bytes;
+  msg->client_addr = info->client_addr;
+  msg->len = info->len;
+}
+
+/**
+ *
+ * netio_flush -
+ * Sends every message queued by the calling thread with as
+ * few sendmmsg calls as possible.
+ *
+ */
+void netio_flush(void){
+
+  outbox *box = local_outbox;
+  if(box == NULL || box->n == 0){
+    return;
+  }
+
+  int i;
+  for(i=0; i<box->n; ++i){
+    box->iovecs[i].iov_base = box->messages[i].buffer;
+    box->iovecs[i].iov_len = box->messages[i].n_bytes;
+
+    memset(&box->headers[i], 0, sizeof(box->headers[i]));
+    box->headers[i].msg_hdr.msg_iov = &box->iovecs[i];
+    box->headers[i].msg_hdr.msg_iovlen = 1;
+    box->headers[i].msg_hdr.msg_name = &box->messages[i].client_addr;
+    box->headers[i].msg_hdr.msg_namelen = box->messages[i].len;
+  }
+
+  int sent = 0;
+  while(sent < box->n){
+    unsigned long start = metrics_now();
+    int n = sendmmsg(box->fd, box->headers + sent, box->n - sent, MSG_CONFIRM);
+    metrics_record(STAGE_SEND, metrics_now() - start);
+    metrics_count(COUNT_SEND_CALLS);
+    if(n < 0){
+      log_msg(LOG_ERROR, "sendmmsg failed: errno %ld", (long)errno);
+      break;
+    }
+    sent += n;
+  }
+
+  metrics_add(COUNT_SEND_PACKETS, sent);
+  box->n = 0;
+}
+
+/**
+ *
+ * netio_send_many -
+ * Sends the same message to n addresses with sendmmsg, up to
+ * MAX_BATCH addresses per call, every header pointing to the
+ * one copy of the message. The outbox of the calling thread is
+ * flushed first, so the messages queued before still arrive
+ * first.
+ *
+ */
+void netio_send_many(int fd, const char *data, int n_bytes, const struct sockaddr_in *addrs, int n){
+
+  struct mmsghdr headers[MAX_BATCH];
+  struct iovec iovec;
+  iovec.iov_base = (void *)data;
+  iovec.iov_len = n_bytes;
+
+  netio_flush();
+
+  int sent = 0;
+  while(sent < n){
+    int chunk = n - sent < MAX_BATCH ? n - sent : MAX_BATCH;
+
+    int i;
+    memset(headers, 0, chunk * sizeof(struct mmsghdr));
+    for(i=0; i<chunk; ++i){
+      headers[i].msg_hdr.msg_iov = &iovec;
+      headers[i].msg_hdr.msg_iovlen = 1;
+      headers[i].msg_hdr.msg_name = (void *)&addrs[sent + i];
+      headers[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+
+    unsigned long start = metrics_now();
+    int done = sendmmsg(fd, headers, chunk, 0);
+    metrics_record(STAGE_SEND, metrics_now() - start);
+    metrics_count(COUNT_SEND_CALLS);
+    if(done < 0){
+      log_msg(LOG_ERROR, "sendmmsg failed: errno %ld", (long)errno);
+      break;
+    }
+    sent += done;
+  }
+
+  metrics_add(COUNT_SEND_PACKETS, sent);
+}
@@ -0,0 +1,15 @@
+#ifndef NETIO_H
+#define NETIO_H
+
+#include "server.h"
+
+#define MAX_BATCH 64
+
+void netio_init(int batch);
+
+int netio_recv(int fd, udp_info **infos, int n);
+void netio_send(int fd, const udp_info *info);
+void netio_flush(void);
+void netio_send_many(int fd, const char *data, int n_bytes, const struct sockaddr_in *addrs, int n);
+
+#endif
@@ -0,0 +1,101 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "pool.h"
+
+/**
+ *
+ * pool_grow -
+ * Carves a new chunk of up to n buffers out of one heap
+ * allocation and adds them to the free list. The chunks are
+ * never given back to the heap.
+ *
+ * Returns 0 on success and 1 if the pool cannot grow.
+ *
+ */
+static int pool_grow(pool *p, int n){
+
+  if(p->n_items + n > p->max_items){
+    n = p->max_items - p->n_items;
+  }
+  if(n <= 0){
+    return 1;
+  }
+
+  char *chunk = (char *)malloc(n * p->item_size);
+  if(chunk == NULL){
+    return 1;
+  }
+  atomic_fetch_add_explicit(&p->heap_allocs, 1, memory_order_relaxed);
+
+  int i;
+  for(i=0; i<n; ++i){
+    ring_push(&p->free_list, chunk + i * p->item_size);
+  }
+  p->n_items += n;
+  return 0;
+}
+
+/**
+ *
+ * pool_init -
+ * Creates a pool of n_items buffers of item_size bytes that
+ * may grow, chunk by chunk, up to max_items buffers.
+ *
+ * Returns 0 on success and 1 if the allocation failed.
+ *
+ */
+int pool_init(pool *p, size_t item_size, int n_items, int max_items){
+
+  if(max_items < n_items){
+    max_items = n_items;
+  }
+
+  /* keeps every buffer aligned like the struct it holds */
+  p->item_size = (item_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  p->n_items = 0;
+  p->max_items = max_items;
+  atomic_init(&p->heap_allocs, 0);
+  atomic_init(&p->exhausted, 0);
+
+  if(ring_init(&p->free_list, max_items) || pthread_mutex_init(&p->grow_mutex, NULL)){
+    return 1;
+  }
+
+  return pool_grow(p, n_items);
+}
+
+/**
+ *
+ * pool_get -
+ * Takes a buffer from the free list. Only goes to the heap
+ * when every buffer is in use.
+ *
+ * Returns NULL if the pool already holds max_items buffers
+ * and all of them are in use.
+ *
+ */
+void *pool_get(pool *p){
+
+  void *item = ring_pop(&p->free_list);
+  if(item != NULL){
+    return item;
+  }
+
+  pthread_mutex_lock(&p->grow_mutex);
+  item = ring_pop(&p->free_list);
+  if(item == NULL && pool_grow(p, POOL_CHUNK) == 0){
+    item = ring_pop(&p->free_list);
+  }
+  pthread_mutex_unlock(&p->grow_mutex);
+
+  if(item == NULL){
+    atomic_fetch_add_explicit(&p->exhausted, 1, memory_order_relaxed);
+  }
+  return item;
+}
+
+void pool_put(pool *p, void *item){
+  ring_push(&p->free_list, item);
+}
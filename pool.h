@@ -0,0 +1,30 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "ring.h"
+
+#define POOL_CHUNK 1024
+
+/* fixed-size buffers recycled through a lock-free free list */
+typedef struct pool{
+
+  ring free_list;
+  size_t item_size;
+  int n_items;
+  int max_items;
+  pthread_mutex_t grow_mutex;
+
+  atomic_ulong heap_allocs;   /* chunks taken from the heap */
+  atomic_ulong exhausted;     /* requests refused at max_items */
+
+} pool;
+
+int pool_init(pool *p, size_t item_size, int n_items, int max_items);
+
+void *pool_get(pool *p);
+void pool_put(pool *p, void *item);
+
+#endif
@@ -0,0 +1,179 @@
+#include <string.h>
+#include <time.h>
+
+#include "reliable.h"
+
+unsigned long reliable_now_us(void){
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ *
+ * window_reset -
+ * Forgets every message of a window and starts a new sequence
+ * for the peer at addr. The timer of the window must not be
+ * armed.
+ *
+ */
+void window_reset(peer_window *window, const struct sockaddr_in *addr, int enabled){
+
+  window->enabled = enabled;
+  window->next_seq = 0;
+  window->base = 0;
+  window->srtt = 0;
+  window->rttvar = 0;
+  window->rto = RELIABLE_MIN_RTO_US * 5;
+  window->addr = *addr;
+}
+
+static void wrap_message(const peer_window *window, const sent_message *msg, udp_info *wrapped){
+  memcpy(wrapped->buffer, msg->data, msg->n_bytes);
+  wrapped->n_bytes = msg->n_bytes;
+  wrapped->client_addr = window->addr;
+  wrapped->len = sizeof(struct sockaddr_in);
+}
+
+/**
+ *
+ * window_send -
+ * Stores a message in the window of its peer and writes into
+ * wrapped the packet to send: REL, the sequence number, then
+ * the message.
+ *
+ * Returns 0 on success and 1 if the window is full.
+ *
+ */
+int window_send(peer_window *window, const udp_info *info, udp_info *wrapped){
+
+  if(window_in_flight(window) == RELIABLE_WINDOW){
+    return 1;
+  }
+
+  int n_bytes = info->n_bytes;
+  if(n_bytes > PACKET_SIZE - 2){
+    n_bytes = PACKET_SIZE - 2;
+  }
+
+  sent_message *msg = &window->messages[window->next_seq % RELIABLE_WINDOW];
+  msg->sent_us = reliable_now_us();
+  msg->retries = 0;
+  msg->n_bytes = (unsigned char)(n_bytes + 2);
+  msg->data[0] = REL;
+  msg->data[1] = (char) window->next_seq;
+  memcpy(msg->data + 2, info->buffer, n_bytes);
+
+  window->next_seq += 1;
+  wrap_message(window, msg, wrapped);
+  return 0;
+}
+
+/* estimates the round trip as in RFC 6298 */
+static void update_rto(peer_window *window, long rtt){
+
+  if(window->srtt == 0){
+    window->srtt = rtt;
+    window->rttvar = rtt / 2;
+  } else {
+    long err = rtt > window->srtt ? rtt - window->srtt : window->srtt - rtt;
+    window->rttvar = (3 * window->rttvar + err) / 4;
+    window->srtt = (7 * window->srtt + rtt) / 8;
+  }
+
+  window->rto = window->srtt + 4 * window->rttvar;
+  if(window->rto < RELIABLE_MIN_RTO_US){
+    window->rto = RELIABLE_MIN_RTO_US;
+  } else if(window->rto > RELIABLE_MAX_RTO_US){
+    window->rto = RELIABLE_MAX_RTO_US;
+  }
+}
+
+/**
+ *
+ * window_ack -
+ * Applies a cumulative ack: the peer received every message
+ * before sequence number ack. Messages that were never resent
+ * give a round trip sample. Stale acks are ignored.
+ *
+ * Returns the number of messages acknowledged.
+ *
+ */
+int window_ack(peer_window *window, unsigned char ack){
+
+  unsigned char n_acked = (unsigned char)(ack - window->base);
+  if(n_acked == 0 || n_acked > window_in_flight(window)){
+    return 0;
+  }
+
+  unsigned long now = reliable_now_us();
+  int i;
+  for(i=0; i<n_acked; ++i){
+    const sent_message *msg = &window->messages[window->base % RELIABLE_WINDOW];
+    if(msg->retries == 0){
+      update_rto(window, (long)(now - msg->sent_us));
+    }
+    window->base += 1;
+  }
+
+  return n_acked;
+}
+
+/**
+ *
+ * window_retransmit -
+ * Called when the oldest message was not acknowledged in time:
+ * writes it into wrapped again and backs the timeout off. The
+ * peer keeps the messages that came after a gap, so only the
+ * oldest one is resent.
+ *
+ * Returns 0 on success and 1 if the peer did not answer the
+ * last retries, in which case the window is emptied.
+ *
+ */
+int window_retransmit(peer_window *window, udp_info *wrapped){
+
+  sent_message *msg = &window->messages[window->base % RELIABLE_WINDOW];
+  if(msg->retries == RELIABLE_MAX_RETRIES){
+    window->base = window->next_seq;
+    return 1;
+  }
+
+  msg->retries += 1;
+  msg->sent_us = reliable_now_us();
+
+  window->rto *= 2;
+  if(window->rto > RELIABLE_MAX_RTO_US){
+    window->rto = RELIABLE_MAX_RTO_US;
+  }
+
+  wrap_message(window, msg, wrapped);
+  return 0;
+}
+
+/**
+ *
+ * loss_drop -
+ * Decides if a packet is lost on purpose, with the given
+ * probability in percent, to test the server on a bad network.
+ *
+ */
+int loss_drop(int percent){
+
+  static __thread unsigned state = 0;
+
+  if(percent <= 0){
+    return 0;
+  }
+
+  if(state == 0){
+    state = (unsigned)reliable_now_us() | 1;
+  }
+
+  /* xorshift32 */
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state % 100 < (unsigned)percent;
+}
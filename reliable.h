@@ -0,0 +1,53 @@
+#ifndef RELIABLE_H
+#define RELIABLE_H
+
+#include <netinet/in.h>
+
+#include "server.h"
+#include "timer.h"
+
+#define RELIABLE_WINDOW 8
+#define RELIABLE_MIN_RTO_US 200000
+#define RELIABLE_MAX_RTO_US 3000000
+#define RELIABLE_MAX_RETRIES 16
+
+/* a message sent to a peer and not acknowledged yet */
+typedef struct sent_message{
+
+  unsigned long sent_us;
+  unsigned char n_bytes;
+  unsigned char retries;
+  char data[PACKET_SIZE];     /* REL, seq, then the message */
+
+} sent_message;
+
+/* reliable delivery state of one seat */
+typedef struct peer_window{
+
+  int enabled;
+  unsigned char next_seq;     /* sequence number of the next message */
+  unsigned char base;         /* oldest message not acknowledged */
+
+  /* round trip estimation, in microseconds */
+  long srtt;
+  long rttvar;
+  long rto;
+
+  struct sockaddr_in addr;
+  timer_node timer;           /* retransmits the oldest message */
+  sent_message messages[RELIABLE_WINDOW];
+
+} peer_window;
+
+#define window_in_flight(window) ((unsigned char)((window)->next_seq - (window)->base))
+
+unsigned long reliable_now_us(void);
+
+void window_reset(peer_window *window, const struct sockaddr_in *addr, int enabled);
+int window_send(peer_window *window, const udp_info *info, udp_info *wrapped);
+int window_ack(peer_window *window, unsigned char ack);
+int window_retransmit(peer_window *window, udp_info *wrapped);
+
+int loss_drop(int percent);
+
+#endif
@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "board.h"
+
+/* results of the games that opened on one cell */
+typedef struct opening_stats{
+
+  unsigned long games;
+  unsigned long results[3];   /* draws, wins of X, wins of O */
+
+} opening_stats;
+
+typedef struct replay_stats{
+
+  unsigned long segments;
+  unsigned long games;
+  unsigned long results[3];
+  unsigned long reasons[3];   /* JOURNAL_FINISHED, JOURNAL_LEFT, JOURNAL_TIMEOUT */
+  unsigned long bot_games;
+  unsigned long moves;
+  unsigned long long duration_ms;
+  unsigned long invalid;      /* records that do not replay to their result */
+  opening_stats openings[9];
+
+} replay_stats;
+
+static int dump_games;
+
+static unsigned long now_ns(void){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long)now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+/**
+ *
+ * replay_game -
+ * Plays the moves of a record on an empty board and checks that
+ * they are legal and lead to the recorded result: a full line
+ * or a full board on the last move of a finished game, and no
+ * line before it.
+ *
+ * Returns 0 if the record is consistent and 1 otherwise.
+ *
+ */
+static int replay_game(const journal_record *rec){
+
+  if(rec->n_moves > 9 || rec->result > 2 || rec->reason > JOURNAL_TIMEOUT){
+    return 1;
+  }
+
+  unsigned masks[2] = {0, 0};
+  int i;
+  for(i=0; i<rec->n_moves; ++i){
+    unsigned cell = rec->moves[i];
+    if(cell > 8 || ((masks[0] | masks[1]) >> cell & 1) || board_is_win(masks[(i + 1) & 1])){
+      return 1;
+    }
+    masks[i & 1] |= 1u << cell;
+  }
+
+  if(rec->reason != JOURNAL_FINISHED){
+    /* a forfeit: the game is not over on the board */
+    return rec->result == 0 || board_is_win(masks[0]) || board_is_win(masks[1]);
+  }
+
+  int result = board_is_win(masks[0]) ? 1 : (board_is_win(masks[1]) ? 2 : 0);
+  return result != rec->result || (result == 0 && (masks[0] | masks[1]) != FULL_BOARD);
+}
+
+static void print_game(const journal_record *rec){
+
+  static const char *reason_names[] = {"finished", "left", "timeout"};
+
+  printf("%llu %5u ms %-8s %s", (unsigned long long)rec->end_ms, (unsigned)rec->duration_ms,
+         rec->reason <= JOURNAL_TIMEOUT ? reason_names[rec->reason] : "?",
+         rec->result == 0 ? "draw " : (rec->result == 1 ? "X won" : "O won"));
+
+  int i;
+  for(i=0; i<rec->n_moves && i<9; ++i){
+    printf(" %c%d,%d", i & 1 ? 'O' : 'X', rec->moves[i] % 3, rec->moves[i] / 3);
+  }
+  printf("%s\n", rec->flags & JOURNAL_BOT_O ? " (bot)" : "");
+}
+
+/**
+ *
+ * replay_segment -
+ * Maps a journal segment and adds each of its games to the
+ * stats. A record cut short by a crash is ignored.
+ *
+ * Returns 0 on success and 1 if the file is not a segment.
+ *
+ */
+static int replay_segment(const char *path, replay_stats *stats){
+
+  int fd = open(path, O_RDONLY);
+  if(fd < 0){
+    perror(path);
+    return 1;
+  }
+
+  struct stat st;
+  if(fstat(fd, &st) || st.st_size < (off_t)sizeof(journal_header)){
+    fprintf(stderr, "%s: not a journal segment\n", path);
+    close(fd);
+    return 1;
+  }
+
+  const char *data = (const char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED){
+    perror(path);
+    return 1;
+  }
+  madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+
+  const journal_header *header = (const journal_header *)data;
+  if(header->magic != JOURNAL_MAGIC || header->version != JOURNAL_VERSION ||
+     header->record_size != sizeof(journal_record)){
+    fprintf(stderr, "%s: not a journal segment\n", path);
+    munmap((void *)data, st.st_size);
+    return 1;
+  }
+
+  const journal_record *records = (const journal_record *)(data + sizeof(journal_header));
+  size_t n_records = (st.st_size - sizeof(journal_header)) / sizeof(journal_record);
+
+  size_t i;
+  for(i=0; i<n_records; ++i){
+    const journal_record *rec = &records[i];
+
+    if(replay_game(rec)){
+      stats->invalid += 1;
+      continue;
+    }
+
+    stats->games += 1;
+    stats->results[rec->result] += 1;
+    stats->reasons[rec->reason] += 1;
+    stats->bot_games += (rec->flags & JOURNAL_BOT_O) != 0;
+    stats->moves += rec->n_moves;
+    stats->duration_ms += rec->duration_ms;
+
+    if(rec->n_moves > 0){
+      opening_stats *opening = &stats->openings[rec->moves[0]];
+      opening->games += 1;
+      opening->results[rec->result] += 1;
+    }
+
+    if(dump_games){
+      print_game(rec);
+    }
+  }
+
+  stats->segments += 1;
+  munmap((void *)data, st.st_size);
+  return 0;
+}
+
+static double share(unsigned long n, unsigned long total){
+  return total ? 100.0 * n / total : 0.0;
+}
+
+static void print_stats(const replay_stats *stats, unsigned long elapsed_ns){
+
+  unsigned long games = stats->games;
+
+  printf("%lu games in %lu segments, %lu invalid records, read in %.3f s (%.1f M games/s)\n",
+         games, stats->segments, stats->invalid, elapsed_ns / 1e9,
+         elapsed_ns ? (games + stats->invalid) * 1e3 / elapsed_ns : 0.0);
+  if(games == 0){
+    return;
+  }
+
+  printf("X won %.1f%%, O won %.1f%%, draws %.1f%%\n", share(stats->results[1], games),
+         share(stats->results[2], games), share(stats->results[0], games));
+  printf("finished %lu, left %lu, timed out %lu, against the bot %lu\n", stats->reasons[JOURNAL_FINISHED],
+         stats->reasons[JOURNAL_LEFT], stats->reasons[JOURNAL_TIMEOUT], stats->bot_games);
+  printf("%.2f moves and %.0f ms per game\n\n", (double)stats->moves / games, (double)stats->duration_ms / games);
+
+  printf("%-12s %12s %10s %10s %10s\n", "opening", "games", "X won", "draw", "O won");
+  int cell;
+  for(cell=0; cell<9; ++cell){
+    const opening_stats *opening = &stats->openings[cell];
+    printf("col %d row %d  %12lu %9.1f%% %9.1f%% %9.1f%%\n", cell % 3, cell / 3, opening->games,
+           share(opening->results[1], opening->games), share(opening->results[0], opening->games),
+           share(opening->results[2], opening->games));
+  }
+}
+
+/**
+ *
+ * main -
+ * ./replay [--dump] SEGMENT...
+ * Replays the games of journal segments, checks them, and prints
+ * the outcomes by opening move. With --dump, also prints every
+ * game.
+ *
+ */
+int main(int argc, char **argv){
+
+  static const struct option long_options[] = {
+    {"dump", no_argument, NULL, 'd'},
+    {NULL, 0, NULL, 0}
+  };
+
+  int c;
+  while ((c = getopt_long(argc, argv, "d", long_options, NULL)) != -1) {
+    if (c == 'd') {
+      dump_games = 1;
+    } else {
+      optind = argc + 1;
+      break;
+    }
+  }
+
+  if (optind >= argc) {
+    printf("Usage: %s [--dump] SEGMENT...\n", argv[0]);
+    return 1;
+  }
+
+  board_init();
+
+  replay_stats stats;
+  memset(&stats, 0, sizeof(stats));
+
+  unsigned long start = now_ns();
+  int i, failed = 0;
+  for (i=optind; i<argc; ++i) {
+    failed |= replay_segment(argv[i], &stats);
+  }
+
+  print_stats(&stats, now_ns() - start);
+  return failed;
+}
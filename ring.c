@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "ring.h"
+
+/**
+ *
+ * ring_init -
+ * Allocates a ring with room for capacity pointers. The
+ * capacity is rounded up to a power of two.
+ *
+ * Returns 0 on success and 1 if the allocation failed.
+ *
+ */
+int ring_init(ring *r, size_t capacity){
+
+  size_t size = 2;
+  while(size < capacity){
+    size <<= 1;
+  }
+
+  r->cells = (ring_cell *)malloc(size * sizeof(ring_cell));
+  if(r->cells == NULL){
+    return 1;
+  }
+
+  size_t i;
+  for(i=0; i<size; ++i){
+    atomic_init(&r->cells[i].seq, i);
+    r->cells[i].data = NULL;
+  }
+
+  r->mask = size - 1;
+  atomic_init(&r->head, 0);
+  atomic_init(&r->tail, 0);
+  return 0;
+}
+
+void ring_destroy(ring *r){
+  free(r->cells);
+  r->cells = NULL;
+}
+
+/**
+ *
+ * ring_push -
+ * Adds a pointer to the ring. Each cell carries a sequence
+ * number telling whether it is free for the producer that
+ * claims position pos (seq == pos) or holds data for the
+ * consumer of position pos (seq == pos + 1).
+ *
+ * Returns 0 on success and 1 if the ring is full.
+ *
+ */
+int ring_push(ring *r, void *data){
+
+  size_t pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+  while(1){
+    ring_cell *cell = &r->cells[pos & r->mask];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    long diff = (long)seq - (long)pos;
+
+    if(diff == 0){
+      if(atomic_compare_exchange_weak_explicit(&r->head, &pos, pos + 1,
+                                               memory_order_relaxed, memory_order_relaxed)){
+        cell->data = data;
+        atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+        return 0;
+      }
+    } else if(diff < 0){
+      /* the consumer has not freed this cell yet */
+      return 1;
+    } else {
+      pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+    }
+  }
+}
+
+/**
+ *
+ * ring_pop -
+ * Takes the oldest pointer out of the ring.
+ *
+ * Returns NULL if the ring is empty.
+ *
+ */
+void *ring_pop(ring *r){
+
+  size_t pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+  while(1){
+    ring_cell *cell = &r->cells[pos & r->mask];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    long diff = (long)seq - (long)(pos + 1);
+
+    if(diff == 0){
+      if(atomic_compare_exchange_weak_explicit(&r->tail, &pos, pos + 1,
+                                               memory_order_relaxed, memory_order_relaxed)){
+        void *data = cell->data;
+        atomic_store_explicit(&cell->seq, pos + r->mask + 1, memory_order_release);
+        return data;
+      }
+    } else if(diff < 0){
+      return NULL;
+    } else {
+      pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    }
+  }
+}
@@ -0,0 +1,33 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define CACHE_LINE 64
+
+typedef struct ring_cell{
+
+  atomic_size_t seq;
+  void *data;
+
+} ring_cell;
+
+/* bounded multi-producer multi-consumer queue of pointers */
+typedef struct ring{
+
+  ring_cell *cells;
+  size_t mask;
+
+  _Alignas(CACHE_LINE) atomic_size_t head;  /* next cell to push */
+  _Alignas(CACHE_LINE) atomic_size_t tail;  /* next cell to pop */
+
+} ring;
+
+int ring_init(ring *r, size_t capacity);
+void ring_destroy(ring *r);
+
+int ring_push(ring *r, void *data);
+void *ring_pop(ring *r);
+
+#endif
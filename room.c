@@ -0,0 +1,516 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "room.h"
+
+/**
+ *
+ * addr_hash -
+ * Mixes the IP address and port of a client into an index
+ * hash. Uses a multiplicative hash so that clients behind the
+ * same NAT (same IP, consecutive ports) spread across the table.
+ *
+ */
+static unsigned addr_hash(in_addr_t ip, in_port_t port){
+  unsigned long long key = ((unsigned long long)ip << 16) | port;
+  key *= 0x9E3779B97F4A7C15ULL;
+  return (unsigned)(key >> 32);
+}
+
+static void index_insert(room_table *table, const struct sockaddr_in *addr, int seat){
+  unsigned i = addr_hash(addr->sin_addr.s_addr, addr->sin_port) & table->index_mask;
+
+  while(table->index[i].seat != NO_ROOM){
+    i = (i + 1) & table->index_mask;
+  }
+
+  table->index[i].ip = addr->sin_addr.s_addr;
+  table->index[i].port = addr->sin_port;
+  table->index[i].seat = seat;
+}
+
+static int index_find(const room_table *table, const struct sockaddr_in *addr){
+  unsigned i = addr_hash(addr->sin_addr.s_addr, addr->sin_port) & table->index_mask;
+
+  while(table->index[i].seat != NO_ROOM){
+    if(table->index[i].ip == addr->sin_addr.s_addr && table->index[i].port == addr->sin_port){
+      return (int)i;
+    }
+    i = (i + 1) & table->index_mask;
+  }
+
+  return -1;
+}
+
+/**
+ *
+ * index_remove -
+ * Removes a slot from the linear probing index. The following
+ * entries of the cluster are shifted back so that lookups never
+ * need tombstones.
+ *
+ */
+static void index_remove(room_table *table, unsigned i){
+  unsigned j = i;
+
+  while(1){
+    table->index[i].seat = NO_ROOM;
+
+    while(1){
+      j = (j + 1) & table->index_mask;
+      if(table->index[j].seat == NO_ROOM){
+        return;
+      }
+
+      unsigned home = addr_hash(table->index[j].ip, table->index[j].port) & table->index_mask;
+      /* entry j can fill the hole at i only if its home is not in (i, j] */
+      if(i <= j ? (i < home && home <= j) : (i < home || home <= j)){
+        continue;
+      }
+      break;
+    }
+
+    table->index[i] = table->index[j];
+    i = j;
+  }
+}
+
+/**
+ *
+ * room_table_init -
+ * Allocates n_rooms rooms, n_watchers spectator slots and an
+ * address index big enough to hold every seat and spectator
+ * with a load factor below 1/2.
+ *
+ * Returns 0 on success and 1 if the allocation failed.
+ *
+ */
+int room_table_init(room_table *table, int n_rooms, int n_watchers){
+
+  memset(table, 0, sizeof(*table));
+
+  unsigned capacity = 1;
+  while(capacity < 2u * (n_rooms * MAX_CLIENTS + n_watchers)){
+    capacity <<= 1;
+  }
+
+  table->rooms = (room *)calloc(n_rooms, sizeof(room));
+  table->index = (addr_slot *)malloc(capacity * sizeof(addr_slot));
+  table->watchers = (watcher *)calloc(n_watchers ? n_watchers : 1, sizeof(watcher));
+
+  if(table->rooms == NULL || table->index == NULL || table->watchers == NULL){
+    room_table_destroy(table);
+    return 1;
+  }
+
+  table->n_rooms = n_rooms;
+  table->index_mask = capacity - 1;
+
+  unsigned i;
+  for(i=0; i<capacity; ++i){
+    table->index[i].seat = NO_ROOM;
+  }
+
+  /* every room starts in the free list */
+  int r;
+  for(r=0; r<n_rooms; ++r){
+    table->rooms[r].state = ROOM_FREE;
+    table->rooms[r].next = r + 1 < n_rooms ? r + 1 : NO_ROOM;
+    table->rooms[r].prev = NO_ROOM;
+    table->rooms[r].first_watcher = NO_ROOM;
+    timer_node_init(&table->rooms[r].timer, r);
+    room_clear_events(&table->rooms[r]);
+  }
+
+  table->free_head = n_rooms ? 0 : NO_ROOM;
+  for(r=0; r<N_BOARDS; ++r){
+    table->waiting_head[r] = NO_ROOM;
+    table->waiting_tail[r] = NO_ROOM;
+  }
+
+  int w;
+  for(w=0; w<n_watchers; ++w){
+    table->watchers[w].room_id = NO_ROOM;
+    table->watchers[w].next = w + 1 < n_watchers ? w + 1 : NO_ROOM;
+  }
+  table->n_watcher_slots = n_watchers;
+  table->watcher_free = n_watchers ? 0 : NO_ROOM;
+
+  return 0;
+}
+
+void room_table_destroy(room_table *table){
+  free(table->rooms);
+  free(table->index);
+  free(table->watchers);
+  memset(table, 0, sizeof(*table));
+}
+
+/**
+ *
+ * room_lookup -
+ * Finds the room in which the client at addr is seated.
+ *
+ * Returns the room index and sets player_id to the seat of the
+ * client, or to WATCHER plus its slot for a spectator. Returns
+ * NO_ROOM if the client is not assigned.
+ *
+ */
+int room_lookup(const room_table *table, const struct sockaddr_in *addr, int *player_id){
+
+  int i = index_find(table, addr);
+  if(i < 0){
+    return NO_ROOM;
+  }
+
+  int seat = table->index[i].seat;
+  if(seat < 0){
+    int w = WATCHER_SEAT(0) - seat;
+    *player_id = WATCHER + w;
+    return table->watchers[w].room_id;
+  }
+
+  *player_id = seat % MAX_CLIENTS;
+  return seat / MAX_CLIENTS;
+}
+
+/**
+ *
+ * room_join -
+ * Seats a new client on a board of the given variant. Rooms
+ * with a player waiting for an opponent on the same board are
+ * filled first, otherwise a free room is opened.
+ *
+ * Returns the room index and sets player_id to the seat given
+ * to the client. Returns NO_ROOM if every room is full.
+ *
+ */
+int room_join(room_table *table, const struct sockaddr_in *addr, int variant, int *player_id){
+
+  int r;
+  room *rm;
+
+  if(table->waiting_head[variant] != NO_ROOM){
+    /* complete the room that has been waiting the longest */
+    r = table->waiting_head[variant];
+    rm = &table->rooms[r];
+
+    table->waiting_head[variant] = rm->next;
+    if(table->waiting_head[variant] == NO_ROOM){
+      table->waiting_tail[variant] = NO_ROOM;
+    } else {
+      table->rooms[table->waiting_head[variant]].prev = NO_ROOM;
+    }
+    rm->next = NO_ROOM;
+
+  } else if(table->free_head != NO_ROOM){
+    /* open a new room and let the client wait there */
+    r = table->free_head;
+    rm = &table->rooms[r];
+
+    table->free_head = rm->next;
+    rm->next = NO_ROOM;
+    rm->prev = table->waiting_tail[variant];
+    rm->state = ROOM_WAITING;
+    rm->n_players = 0;
+    rm->game.variant = (unsigned char) variant;
+
+    if(table->waiting_tail[variant] == NO_ROOM){
+      table->waiting_head[variant] = r;
+    } else {
+      table->rooms[table->waiting_tail[variant]].next = r;
+    }
+    table->waiting_tail[variant] = r;
+    table->n_active += 1;
+
+  } else {
+    return NO_ROOM;
+  }
+
+  *player_id = rm->n_players;
+  rm->players[rm->n_players] = *addr;
+  rm->n_players += 1;
+
+  index_insert(table, addr, r * MAX_CLIENTS + *player_id);
+  return r;
+}
+
+/* 1 if no room is free and no player waits for an opponent */
+int room_table_full(const room_table *table){
+
+  int v;
+  for(v=0; v<N_BOARDS; ++v){
+    if(table->waiting_head[v] != NO_ROOM){
+      return 0;
+    }
+  }
+  return table->free_head == NO_ROOM;
+}
+
+/* takes a room whose player is still alone out of the waiting list */
+static void waiting_remove(room_table *table, room *rm){
+
+  int variant = rm->game.variant;
+  if(rm->prev == NO_ROOM){
+    table->waiting_head[variant] = rm->next;
+  } else {
+    table->rooms[rm->prev].next = rm->next;
+  }
+
+  if(rm->next == NO_ROOM){
+    table->waiting_tail[variant] = rm->prev;
+  } else {
+    table->rooms[rm->next].prev = rm->prev;
+  }
+  rm->next = NO_ROOM;
+  rm->prev = NO_ROOM;
+}
+
+/**
+ *
+ * room_seat_bot -
+ * Gives the player waiting alone in a room the server as an
+ * opponent. The bot takes the free seat but has no address, so
+ * it is not in the index.
+ *
+ * Returns 0 on success and 1 if the room is no longer waiting
+ * for an opponent.
+ *
+ */
+int room_seat_bot(room_table *table, int room_id){
+
+  room *rm = &table->rooms[room_id];
+  if(rm->state != ROOM_WAITING || rm->n_players != MAX_CLIENTS - 1){
+    return 1;
+  }
+
+  waiting_remove(table, rm);
+
+  memset(&rm->players[rm->n_players], 0, sizeof(rm->players[0]));
+  rm->fyi_mode[rm->n_players] = 0;
+  rm->reliable[rm->n_players] = 0;
+  rm->bot[rm->n_players] = 1;
+  rm->n_players += 1;
+  return 0;
+}
+
+/**
+ *
+ * room_watch -
+ * Adds a client to the spectators of a room. The room keeps
+ * them in a list so that a board is sent to all of them with
+ * one walk.
+ *
+ * Returns the slot of the spectator, or -1 if every slot is
+ * taken.
+ *
+ */
+int room_watch(room_table *table, int room_id, const struct sockaddr_in *addr){
+
+  int w = table->watcher_free;
+  if(w == NO_ROOM){
+    return -1;
+  }
+
+  room *rm = &table->rooms[room_id];
+  watcher *wt = &table->watchers[w];
+  table->watcher_free = wt->next;
+
+  wt->addr = *addr;
+  wt->room_id = room_id;
+  wt->prev = NO_ROOM;
+  wt->next = rm->first_watcher;
+  if(rm->first_watcher != NO_ROOM){
+    table->watchers[rm->first_watcher].prev = w;
+  }
+  rm->first_watcher = w;
+  rm->n_watchers += 1;
+
+  index_insert(table, addr, WATCHER_SEAT(w));
+  return w;
+}
+
+/* removes a spectator from its room and from the index */
+void room_unwatch(room_table *table, int watcher_id){
+
+  watcher *wt = &table->watchers[watcher_id];
+  room *rm = &table->rooms[wt->room_id];
+
+  if(wt->prev == NO_ROOM){
+    rm->first_watcher = wt->next;
+  } else {
+    table->watchers[wt->prev].next = wt->next;
+  }
+  if(wt->next != NO_ROOM){
+    table->watchers[wt->next].prev = wt->prev;
+  }
+  rm->n_watchers -= 1;
+
+  int slot = index_find(table, &wt->addr);
+  if(slot >= 0){
+    index_remove(table, (unsigned)slot);
+  }
+
+  wt->room_id = NO_ROOM;
+  wt->next = table->watcher_free;
+  table->watcher_free = watcher_id;
+}
+
+/**
+ *
+ * room_release -
+ * Removes the players and the spectators of a room from the
+ * index and puts the room back in the free list, taking it out
+ * of the waiting list if its player was still alone. Pending
+ * events of the room are discarded, so no other thread may be
+ * pushing to it.
+ *
+ */
+void room_release(room_table *table, int room_id){
+
+  room *rm = &table->rooms[room_id];
+
+  if(rm->state == ROOM_WAITING && rm->n_players < MAX_CLIENTS){
+    waiting_remove(table, rm);
+  }
+
+  int i;
+  for(i=0; i<rm->n_players; ++i){
+    if(rm->bot[i]){
+      continue;
+    }
+    int slot = index_find(table, &rm->players[i]);
+    if(slot >= 0){
+      index_remove(table, (unsigned)slot);
+    }
+  }
+
+  while(rm->first_watcher != NO_ROOM){
+    room_unwatch(table, rm->first_watcher);
+  }
+
+  memset(rm->players, 0, sizeof(rm->players));
+  memset(rm->bot, 0, sizeof(rm->bot));
+  rm->n_players = 0;
+  rm->state = ROOM_FREE;
+  room_clear_events(rm);
+  rm->next = table->free_head;
+  table->free_head = room_id;
+  table->n_active -= 1;
+}
+
+/**
+ *
+ * room_restore -
+ * Puts a room saved by another process back at the same index
+ * of a new table, and its players back in the address index.
+ * Spectators are not handed over. The timer of the room is left
+ * unarmed. Once every room is back, room_restore_lists rebuilds
+ * the free and waiting lists.
+ *
+ */
+void room_restore(room_table *table, int room_id, const room *saved){
+
+  room *rm = &table->rooms[room_id];
+  memcpy(rm, saved, sizeof(room));
+  timer_node_init(&rm->timer, room_id);
+  rm->first_watcher = NO_ROOM;
+  rm->n_watchers = 0;
+
+  int i;
+  for(i=0; i<rm->n_players; ++i){
+    if(!rm->bot[i]){
+      index_insert(table, &rm->players[i], room_id * MAX_CLIENTS + i);
+    }
+  }
+  table->n_active += 1;
+}
+
+/* links the rooms left free, keeping the waiting lists of the saved table */
+void room_restore_lists(room_table *table, const int *waiting_head, const int *waiting_tail){
+
+  table->free_head = NO_ROOM;
+
+  int r;
+  for(r=table->n_rooms-1; r>=0; --r){
+    if(table->rooms[r].state == ROOM_FREE){
+      table->rooms[r].next = table->free_head;
+      table->free_head = r;
+    }
+  }
+
+  memcpy(table->waiting_head, waiting_head, sizeof(table->waiting_head));
+  memcpy(table->waiting_tail, waiting_tail, sizeof(table->waiting_tail));
+}
+
+/**
+ *
+ * room_push_event -
+ * Adds an event to the queue of a room. Any thread may push.
+ * Each cell carries a sequence number that tells if it is free
+ * for the producer claiming position pos (seq == pos) or holds
+ * the event for the consumer (seq == pos + 1).
+ *
+ * Returns 0 on success and 1 if the queue is full.
+ *
+ */
+int room_push_event(room *rm, room_event event){
+
+  unsigned pos = atomic_load_explicit(&rm->event_head, memory_order_relaxed);
+
+  while(1){
+    event_cell *cell = &rm->events[pos % ROOM_QUEUE_SIZE];
+    unsigned seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    int diff = (int)(seq - pos);
+
+    if(diff == 0){
+      if(atomic_compare_exchange_weak_explicit(&rm->event_head, &pos, pos + 1,
+                                               memory_order_relaxed, memory_order_relaxed)){
+        cell->event = event;
+        atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+        return 0;
+      }
+    } else if(diff < 0){
+      return 1;
+    } else {
+      pos = atomic_load_explicit(&rm->event_head, memory_order_relaxed);
+    }
+  }
+}
+
+/**
+ *
+ * room_pop_event -
+ * Takes the oldest event of a room. Only the thread running
+ * the game logic of the room may pop.
+ *
+ * Returns 1 if an event was taken and 0 if the queue is empty.
+ *
+ */
+int room_pop_event(room *rm, room_event *event){
+
+  unsigned pos = atomic_load_explicit(&rm->event_tail, memory_order_relaxed);
+  event_cell *cell = &rm->events[pos % ROOM_QUEUE_SIZE];
+
+  if(atomic_load_explicit(&cell->seq, memory_order_acquire) != pos + 1){
+    return 0;
+  }
+
+  *event = cell->event;
+  atomic_store_explicit(&rm->event_tail, pos + 1, memory_order_relaxed);
+  atomic_store_explicit(&cell->seq, pos + ROOM_QUEUE_SIZE, memory_order_release);
+  return 1;
+}
+
+void room_clear_events(room *rm){
+
+  int i;
+  for(i=0; i<ROOM_QUEUE_SIZE; ++i){
+    atomic_store_explicit(&rm->events[i].seq, i, memory_order_relaxed);
+  }
+
+  atomic_store_explicit(&rm->event_head, 0, memory_order_relaxed);
+  atomic_store_explicit(&rm->event_tail, 0, memory_order_relaxed);
+}
@@ -0,0 +1,151 @@
+#ifndef ROOM_H
+#define ROOM_H
+
+#include <stdatomic.h>
+#include <netinet/in.h>
+
+#include "server.h"
+#include "timer.h"
+
+#define MAX_ROOMS 32768
+#define DEFAULT_SPECTATORS 4096   /* per shard */
+#define MAX_SPECTATORS 65535
+
+/* room states */
+#define ROOM_FREE 0
+#define ROOM_WAITING 1
+#define ROOM_PLAYING 2
+#define ROOM_CLOSING 3   /* game over, waiting for the players to ack the END */
+
+#define NO_ROOM -1
+
+/* inbound events of a room */
+#define EV_JOIN 1
+#define EV_MOVE 2
+#define EV_LEAVE 3
+#define EV_SNAPSHOT 4
+#define EV_ACK 5
+#define EV_HINT 6
+
+#define ROOM_QUEUE_SIZE 16
+
+/* player_id of the events sent by spectators, and seat of a
+  spectator in the address index */
+#define WATCHER MAX_CLIENTS
+#define WATCHER_SEAT(i) (-2 - (i))
+
+typedef struct room_move{
+
+  char player_id;
+  char col;
+  char row;
+
+} room_move;
+
+typedef struct room_event{
+
+  unsigned char type;
+  unsigned char player_id;
+  unsigned char col;
+  unsigned char row;
+  unsigned char has_ack;
+  unsigned char ack;
+  unsigned short watcher;     /* spectator of an event of WATCHER */
+  unsigned long pushed_ns;
+
+} room_event;
+
+typedef struct event_cell{
+
+  atomic_uint seq;
+  room_event event;
+
+} event_cell;
+
+typedef struct room{
+
+  int state;
+  int n_players;
+  int next;           /* next room in the free or waiting list */
+  int prev;           /* previous room in the waiting list */
+  struct sockaddr_in players[MAX_CLIENTS];
+  unsigned char fyi_mode[MAX_CLIENTS];
+  unsigned char reliable[MAX_CLIENTS];
+  unsigned char bot[MAX_CLIENTS];     /* seat played by the server */
+  game_state game;
+  room_move last_move;
+  unsigned long long started_ms;      /* wall clock, for the journal */
+  timer_node timer;   /* turn deadline, or idle timeout while waiting */
+  int first_watcher;  /* spectators of the game, or NO_ROOM */
+  int n_watchers;
+
+  /* events pushed by any thread and drained, in order, by the game logic */
+  atomic_int scheduled;
+  atomic_uint event_head;
+  atomic_uint event_tail;
+  event_cell events[ROOM_QUEUE_SIZE];
+
+} room;
+
+typedef struct addr_slot{
+
+  in_addr_t ip;
+  in_port_t port;
+  int seat;           /* room_index * MAX_CLIENTS + player_id, WATCHER_SEAT or NO_ROOM */
+
+} addr_slot;
+
+/* a client that receives the boards of a room without playing */
+typedef struct watcher{
+
+  struct sockaddr_in addr;
+  int room_id;        /* NO_ROOM while the slot is free */
+  int next;           /* next spectator of the room, or next free slot */
+  int prev;
+
+} watcher;
+
+typedef struct room_table{
+
+  room *rooms;
+  int n_rooms;
+
+  /* rooms without players, and rooms with a player waiting for an
+    opponent on each board variant */
+  int free_head;
+  int waiting_head[N_BOARDS];
+  int waiting_tail[N_BOARDS];
+
+  /* open addressing index from client address to seat */
+  addr_slot *index;
+  unsigned index_mask;
+
+  int n_active;
+
+  /* spectators of every room */
+  watcher *watchers;
+  int n_watcher_slots;
+  int watcher_free;
+
+} room_table;
+
+int room_table_init(room_table *table, int n_rooms, int n_watchers);
+void room_table_destroy(room_table *table);
+
+int room_lookup(const room_table *table, const struct sockaddr_in *addr, int *player_id);
+int room_join(room_table *table, const struct sockaddr_in *addr, int variant, int *player_id);
+int room_table_full(const room_table *table);
+int room_seat_bot(room_table *table, int room_id);
+void room_release(room_table *table, int room_id);
+
+int room_watch(room_table *table, int room_id, const struct sockaddr_in *addr);
+void room_unwatch(room_table *table, int watcher_id);
+
+void room_restore(room_table *table, int room_id, const room *saved);
+void room_restore_lists(room_table *table, const int *waiting_head, const int *waiting_tail);
+
+int room_push_event(room *rm, room_event event);
+int room_pop_event(room *rm, room_event *event);
+void room_clear_events(room *rm);
+
+#endif
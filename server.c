@@ -1,49 +1,235 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <getopt.h>
+#include <errno.h>
+#include <signal.h>
 #include <assert.h>
 
 #include "server.h"
+#include "room.h"
+#include "board.h"
+#include "shard.h"
+#include "ring.h"
+#include "pool.h"
+#include "netio.h"
+#include "engine.h"
+#include "log.h"
+#include "timer.h"
+#include "reliable.h"
+#include "metrics.h"
+#include "message.h"
+#include "solver.h"
+#include "journal.h"
+#include "handoff.h"
+#include "limiter.h"
+#include "cookie.h"
+
+
+server_options options;
+
+
+/* sockets and their rooms */
+shard *shards;
+__thread shard *current_shard;
 
-#define DEBUG_MODE 1
+/* multithreading */
+pthread_rwlock_t table_lock;
+sem_t rooms_available;
 
+/* received packets waiting for a worker, and their buffers */
+pool packet_buffers;
+ring packet_ring;
+sem_t packets_available;
 
-int sockfd;
+int main(int argc, char **argv){
 
+  /* checking command line arguments */
+  if (parse_options(argc, argv, &options)) {
+    exit(-1);
+  }
 
-/* current players */
-int n_connected_clients = 0;
-struct sockaddr_in players[2];
+  /* a peer of the handoff or admin socket that hangs up must not kill the games */
+  signal(SIGPIPE, SIG_IGN);
 
-/* game data */
-game_state game;
-game_message last_move;
+  /* init sockets and their rooms */
+  shards = (shard *)calloc(options.n_shards, sizeof(shard));
+  if (shards == NULL) {
+    fprintf(stderr, "Malloc Error\n");
+    exit(1);
+  }
 
-/* multithreading */
-pthread_mutex_t game_mutex;
-pthread_cond_t new_move_cond;
-pthread_cond_t new_player_cond;
+  int rooms_per_shard = (MAX_ROOMS + options.n_shards - 1) / options.n_shards;
+  int i;
+  for (i=0; i<options.n_shards; ++i) {
+    shards[i].id = i;
+    shards[i].sockfd = -1;
+
+    if (room_table_init(&shards[i].rooms, rooms_per_shard, options.spectators) ||
+        ring_init(&shards[i].ready_rooms, rooms_per_shard)) {
+      fprintf(stderr, "Could not allocate %d rooms.\n", rooms_per_shard);
+      exit(1);
+    }
+    shards[i].fanout = (struct sockaddr_in *)malloc((options.spectators + 1) * sizeof(struct sockaddr_in));
+    if (shards[i].fanout == NULL) {
+      fprintf(stderr, "Could not allocate %d spectators.\n", options.spectators);
+      exit(1);
+    }
+    if (limiter_init(&shards[i].limiter, options.source_rate, options.source_burst, options.shed_rate)) {
+      fprintf(stderr, "Could not allocate the rate limiter.\n");
+      exit(1);
+    }
+    atomic_init(&shards[i].featured_room, NO_ROOM);
+    timer_wheel_init(&shards[i].timers);
+    timer_wheel_init(&shards[i].retransmits);
+
+    if (options.reliable) {
+      /* only the pages of the seats in use are ever touched */
+      shards[i].windows = (peer_window *)calloc(rooms_per_shard * MAX_CLIENTS, sizeof(peer_window));
+      if (shards[i].windows == NULL) {
+        fprintf(stderr, "Could not allocate the reliable windows.\n");
+        exit(1);
+      }
+    }
+  }
 
-int main(int argc, char **argv){
+  /* the sockets and rooms of a running server, or new ones */
+  int took_over = 0;
+  if (options.handoff_path != NULL) {
+    took_over = handoff_takeover(options.handoff_path, shards, options.n_shards);
+    if (took_over < 0) {
+      fprintf(stderr, "Could not take over from the server at %s.\n", options.handoff_path);
+      exit(1);
+    }
+  }
+  for (i=0; i<options.n_shards && !took_over; ++i) {
+    shards[i].sockfd = open_socket(options.port, options.n_shards > 1);
+  }
 
-  /* checking command line arguments */
-  if (argc != 2) {
-    printf("You should pass exactly one argument to the program: PORT_NUMBER\n");
-    exit(-1);
+  if (log_init(options.log_level)) {
+    fprintf(stderr, "Could not create log thread.\n");
+    exit(1);
   }
 
-  int port;
-  if (sscanf(argv[1], "%d", &port) != 1) {
-    printf("Could not parse the arguments");
-    exit(-1);
+  netio_init(options.batch);
+  board_init();
+  if (cookie_init()) {
+    fprintf(stderr, "Could not draw the cookie secret.\n");
+    exit(1);
+  }
+  solver_init();
+
+  if (options.admin_path != NULL && metrics_serve(options.admin_path, options.n_shards)) {
+    fprintf(stderr, "Could not open the admin socket %s.\n", options.admin_path);
+    exit(1);
+  }
+
+  if (options.journal_dir != NULL && journal_open(options.journal_dir, options.journal_fsync_ms)) {
+    fprintf(stderr, "Could not open a journal segment in %s.\n", options.journal_dir);
+    exit(1);
+  }
+
+  /* the threads that handle packets: one per shard, or the listener, the workers and the game thread */
+  int n_threads = options.engine == ENGINE_THREADS ? options.n_workers + 2 : options.n_shards;
+  if (options.handoff_path != NULL && handoff_serve(options.handoff_path, shards, n_threads)) {
+    fprintf(stderr, "Could not listen for a handoff at %s.\n", options.handoff_path);
+    exit(1);
+  }
+
+  if (options.stats_interval > 0) {
+    pthread_t stats_thread;
+    if (pthread_create(&stats_thread, NULL, stats_loop, &options.stats_interval)) {
+      fprintf(stderr, "Could not create stats thread.\n");
+      exit(1);
+    }
+  }
+
+  if (options.engine != ENGINE_THREADS) {
+    /* one event loop per shard, each on its own core */
+    for (i=0; i<options.n_shards; ++i) {
+      if (pthread_create(&shards[i].thread, NULL, shard_loop, &shards[i])) {
+        fprintf(stderr, "Could not create shard thread.\n");
+        exit(1);
+      }
+    }
+
+    for (i=0; i<options.n_shards; ++i) {
+      pthread_join(shards[i].thread, NULL);
+    }
+    return 1;
+  }
+
+  /* initializing the thread that will be responsible for
+    the game loop */
+  current_shard = &shards[0];
+  pthread_rwlock_init(&table_lock, NULL);
+  sem_init(&rooms_available, 0, 0);
+  pthread_t game_thread; 
+  if (pthread_create(&game_thread, NULL, game_loop, current_shard)) {
+    fprintf(stderr, "Could not create game thread.\n");
+    exit(1);
+  }
+
+  /* pool of threads that handle the received packets */
+  if (ring_init(&packet_ring, options.queue_size) || sem_init(&packets_available, 0, 0)) {
+    fprintf(stderr, "Could not create the packet queue.\n");
+    exit(1);
+  }
+
+  /* enough buffers for a full queue, one per worker and one receive batch */
+  int max_buffers = (int)(packet_ring.mask + 1) + options.n_workers + MAX_BATCH;
+  if (pool_init(&packet_buffers, sizeof(udp_info),
+                max_buffers < POOL_CHUNK ? max_buffers : POOL_CHUNK, max_buffers)) {
+    fprintf(stderr, "Could not create the packet buffers.\n");
+    exit(1);
+  }
+
+  for (i=0; i<options.n_workers; ++i) {
+    pthread_t worker_thread;
+    if (pthread_create(&worker_thread, NULL, worker_loop, current_shard)) {
+      fprintf(stderr, "Could not create worker thread.\n");
+      exit(1);
+    }
+    pthread_detach(worker_thread);
+  }
+
+  /* thread responsible for listening to
+    user interactions */
+  metrics_register(current_shard->id);
+  if(listen_data()){
+    fprintf(stderr, "Fatal error in listen()\n");
+    exit(1);
   }
 
+  return 0;
+}
+
+/**
+ *
+ * open_socket -
+ * Creates the UDP socket of a shard and binds it to port.
+ * With reuse_port, several sockets share the port and the
+ * kernel spreads the clients among them by hashing their
+ * addresses.
+ *
+ * Exits the program if the socket cannot be created.
+ *
+ */
+int open_socket(int port, int reuse_port){
+
+  int sockfd;
+
   /* init socket */
   if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
     perror("socket creation failed");
@@ -52,6 +238,12 @@ int main(int argc, char **argv){
     printf("Socket Created.\n");
   }
 
+  int one = 1;
+  if (reuse_port && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+    perror("SO_REUSEPORT");
+    exit(1);
+  }
+
   /* setting server address and binding socket */
   struct sockaddr_in servaddr;
   memset(&servaddr, 0, sizeof(servaddr));
@@ -67,420 +259,1797 @@ int main(int argc, char **argv){
     printf("Bind to port %d.\n", port);
   }
 
-  /* initializing the thread that will be responsible for
-    the game loop */
-  pthread_mutex_init(&game_mutex, NULL);
-  pthread_t game_thread; 
-  if (pthread_create(&game_thread, NULL, game_loop, NULL)) {
-    fprintf(stderr, "Could not create game thread.\n");
-    exit(1);
+  return sockfd;
+}
+
+/**
+ *
+ * shard_loop -
+ * Body of the thread of a shard. Pins the thread to a core
+ * and runs the event loop engine on the socket of the shard.
+ * Shards share no state, so they need no lock.
+ *
+ */
+void *shard_loop(void *params){
+
+  current_shard = (shard *)params;
+  metrics_register(current_shard->id);
+  handoff_register(HANDOFF_RECEIVER);
+
+  long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (options.n_shards > 1 && n_cpus > 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(current_shard->id % n_cpus, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
+
+  int ret;
+  if (options.engine == ENGINE_URING) {
+    ret = run_uring_engine(current_shard->sockfd);
+  } else {
+    ret = run_epoll_engine(current_shard->sockfd);
+  }
+
+  fprintf(stderr, "Fatal error in shard %d\n", current_shard->id);
+  exit(ret);
+}
+
+/**
+ *
+ * stats_loop -
+ * Prints, every interval seconds, the packet and system call
+ * rates of the server and the counters of each shard, to show
+ * how evenly the kernel spreads the clients. params points to
+ * the interval.
+ *
+ */
+void *stats_loop(void *params){
+
+  int interval = *(int *)params;
+  unsigned long last[4] = {0, 0, 0, 0};
+
+  while(1){
+    sleep(interval);
+
+    unsigned long now[4];
+    now[0] = metrics_total(-1, COUNT_RECV_PACKETS);
+    now[1] = metrics_total(-1, COUNT_RECV_CALLS);
+    now[2] = metrics_total(-1, COUNT_SEND_PACKETS);
+    now[3] = metrics_total(-1, COUNT_SEND_CALLS);
+
+    printf("[stats] recv %lu pkt/s in %lu calls/s, send %lu pkt/s in %lu calls/s\n",
+           (now[0] - last[0]) / interval, (now[1] - last[1]) / interval,
+           (now[2] - last[2]) / interval, (now[3] - last[3]) / interval);
+
+    if (options.engine == ENGINE_THREADS) {
+      printf("[stats] buffers: %d in pool, %lu heap allocations, %lu exhausted, %lu packets dropped\n",
+             packet_buffers.n_items, atomic_load(&packet_buffers.heap_allocs),
+             atomic_load(&packet_buffers.exhausted), metrics_total(-1, COUNT_QUEUE_DROPS));
+    }
+    if (options.source_rate || options.shed_rate) {
+      printf("[stats] limiter: %lu packets over their source rate, %lu of new sources shed\n",
+             metrics_total(-1, COUNT_RATE_DROPS), metrics_total(-1, COUNT_SHED_DROPS));
+    }
+
+    int i;
+    for (i=0; i<options.n_shards; ++i) {
+      printf("[stats] shard %d: %lu packets, %lu moves, %lu games started, %lu finished, %lu timed out, %d active rooms\n",
+             i, metrics_total(i, COUNT_PACKETS), metrics_total(i, COUNT_MOVES),
+             metrics_total(i, COUNT_GAMES_STARTED), metrics_total(i, COUNT_GAMES_FINISHED),
+             metrics_total(i, COUNT_TIMEOUTS), shards[i].rooms.n_active);
+
+      if (options.reliable || options.loss_percent) {
+        printf("[stats] shard %d: %lu retransmits, %lu peers lost, %lu packets lost on purpose\n",
+               i, metrics_total(i, COUNT_RETRANSMITS), metrics_total(i, COUNT_PEERS_LOST),
+               metrics_total(i, COUNT_INJECTED_LOSSES));
+      }
+    }
+    fflush(stdout);
+
+    memcpy(last, now, sizeof(last));
+  }
+}
+
+/**
+ *
+ * parse_options -
+ * Reads the command line:
+ * [--engine threads|epoll|uring] [--shards N] [--workers N]
+ * [--queue-size N] [--batch N] [--stats SECONDS]
+ * [--log-level off|error|info|debug] [--spectators N]
+ * [--source-rate N] [--source-burst N] [--shed-rate N] PORT
+ *
+ * Returns 0 on success and 1 if the arguments are invalid.
+ *
+ */
+int parse_options(int argc, char **argv, server_options *opts){
+
+  static const struct option long_options[] = {
+    {"engine", required_argument, NULL, 'e'},
+    {"shards", required_argument, NULL, 'n'},
+    {"workers", required_argument, NULL, 'w'},
+    {"queue-size", required_argument, NULL, 'q'},
+    {"batch", required_argument, NULL, 'b'},
+    {"stats", required_argument, NULL, 's'},
+    {"log-level", required_argument, NULL, 'l'},
+    {"turn-timeout", required_argument, NULL, 't'},
+    {"idle-timeout", required_argument, NULL, 'i'},
+    {"reliable", no_argument, NULL, 'r'},
+    {"loss", required_argument, NULL, 'x'},
+    {"admin", required_argument, NULL, 'a'},
+    {"bot-after", required_argument, NULL, 'o'},
+    {"journal", required_argument, NULL, 'j'},
+    {"journal-fsync", required_argument, NULL, 'y'},
+    {"handoff", required_argument, NULL, 'H'},
+    {"spectators", required_argument, NULL, 'S'},
+    {"source-rate", required_argument, NULL, 'R'},
+    {"source-burst", required_argument, NULL, 'B'},
+    {"shed-rate", required_argument, NULL, 'L'},
+    {NULL, 0, NULL, 0}
+  };
+
+  opts->engine = ENGINE_THREADS;
+  opts->n_shards = 1;
+  opts->n_workers = DEFAULT_WORKERS;
+  opts->queue_size = DEFAULT_QUEUE_SIZE;
+  opts->batch = 1;
+  opts->stats_interval = 0;
+  opts->log_level = LOG_INFO;
+  opts->turn_timeout = DEFAULT_TURN_TIMEOUT;
+  opts->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+  opts->reliable = 0;
+  opts->loss_percent = 0;
+  opts->admin_path = NULL;
+  opts->bot_after = NO_BOT;
+  opts->journal_dir = NULL;
+  opts->journal_fsync_ms = DEFAULT_JOURNAL_FSYNC_MS;
+  opts->handoff_path = NULL;
+  opts->spectators = DEFAULT_SPECTATORS;
+  opts->source_rate = DEFAULT_SOURCE_RATE;
+  opts->source_burst = DEFAULT_SOURCE_BURST;
+  opts->shed_rate = DEFAULT_SHED_RATE;
+
+  int c;
+  while ((c = getopt_long(argc, argv, "e:n:w:q:b:s:l:t:i:rx:a:o:j:y:H:S:R:B:L:", long_options, NULL)) != -1) {
+    switch (c) {
+      case 'e':
+        if (!strcmp(optarg, "threads")) {
+          opts->engine = ENGINE_THREADS;
+        } else if (!strcmp(optarg, "epoll")) {
+          opts->engine = ENGINE_EPOLL;
+        } else if (!strcmp(optarg, "uring")) {
+          opts->engine = ENGINE_URING;
+        } else {
+          printf("Unknown engine: %s (threads, epoll or uring)\n", optarg);
+          return 1;
+        }
+        break;
+
+      case 'n':
+        if (sscanf(optarg, "%d", &opts->n_shards) != 1 || opts->n_shards < 1) {
+          printf("Invalid number of shards: %s\n", optarg);
+          return 1;
+        }
+        break;
+
+      case 'w':
+        if (sscanf(optarg, "%d", &opts->n_workers) != 1 || opts->n_workers < 1) {
+          printf("Invalid number of workers: %s\n", optarg);
+          return 1;
+        }
+        break;
+
+      case 'q':
+        if (sscanf(optarg, "%d", &opts->queue_size) != 1 || opts->queue_size < 1) {
+          printf("Invalid queue size: %s\n", optarg);
+          return 1;
+        }
+        break;
+
+      case 'b':
+        if (sscanf(optarg, "%d", &opts->batch) != 1 || opts->batch < 1 || opts->batch > MAX_BATCH) {
+          printf("Invalid batch size: %s (1 to %d)\n", optarg, MAX_BATCH);
+          return 1;
+        }
+        break;
+
+      case 's':
+        if (sscanf(optarg, "%d", &opts->stats_interval) != 1 || opts->stats_interval < 0) {
+          printf("Invalid stats interval: %s\n", optarg);
+          return 1;
+        }
+        break;
+
+      case 'l':
+        if ((opts->log_level = log_parse_level(optarg)) < 0) {
+          printf("Unknown log level: %s (off, error, info or debug)\n", optarg);
+          return 1;
+        }
+        break;
+
+      case 't':
+        if (sscanf(optarg, "%d", &opts->turn_timeout) != 1 || opts->turn_timeout < 0) {
+          printf("Invalid turn timeout: %s\n", optarg);
+          return 1;
+        }
+        break;
+
+      case 'i':
+        if (sscanf(optarg, "%d", &opts->idle_timeout) != 1 || opts->idle_timeout < 0) {
+          printf("Invalid idle timeout: %s\n", optarg);
+          return 1;
+        }
+        break;
+
+      case 'r':
+        opts->reliable = 1;
+        break;
+
+      case 'x':
+        if (sscanf(optarg, "%d", &opts->loss_percent) != 1 || opts->loss_percent < 0 || opts->loss_percent > 100) {
+          printf("Invalid loss: %s (0 to 100 percent)\n", optarg);
+          return 1;
+        }
+        break;
+
+      case 'a':
+        opts->admin_path = optarg;
+        break;
+
+      case 'o':
+        if (sscanf(optarg, "%d", &opts->bot_after) != 1 || opts->bot_after < 0) {
+          printf("Invalid bot delay: %s\n", optarg);
+          return 1;
+        }
+        break;
+
+      case 'j':
+        opts->journal_dir = optarg;
+        break;
+
+      case 'y':
+        if (sscanf(optarg, "%d", &opts->journal_fsync_ms) != 1 || opts->journal_fsync_ms < 0) {
+          printf("Invalid journal fsync interval: %s\n", optarg);
+          return 1;
+        }
+        break;
+
+      case 'H':
+        opts->handoff_path = optarg;
+        break;
+
+      case 'S':
+        if (sscanf(optarg, "%d", &opts->spectators) != 1 || opts->spectators < 0 ||
+            opts->spectators > MAX_SPECTATORS) {
+          printf("Invalid number of spectators: %s (0 to %d)\n", optarg, MAX_SPECTATORS);
+          return 1;
+        }
+        break;
+
+      case 'R':
+        if (sscanf(optarg, "%d", &opts->source_rate) != 1 || opts->source_rate < 0) {
+          printf("Invalid source rate: %s\n", optarg);
+          return 1;
+        }
+        break;
+
+      case 'B':
+        if (sscanf(optarg, "%d", &opts->source_burst) != 1 || opts->source_burst < 1 ||
+            opts->source_burst > 1000000) {
+          printf("Invalid source burst: %s (1 to 1000000)\n", optarg);
+          return 1;
+        }
+        break;
+
+      case 'L':
+        if (sscanf(optarg, "%d", &opts->shed_rate) != 1 || opts->shed_rate < 0) {
+          printf("Invalid shedding rate: %s\n", optarg);
+          return 1;
+        }
+        break;
+
+      default:
+        return 1;
+    }
+  }
+
+  if (argc - optind != 1) {
+    printf("Usage: %s [--engine threads|epoll|uring] [--shards N] [--workers N] [--queue-size N] "
+           "[--batch N] [--stats SECONDS] [--log-level LEVEL] [--turn-timeout SECONDS] "
+           "[--idle-timeout SECONDS] [--reliable] [--loss PERCENT] [--admin PATH] [--bot-after SECONDS] "
+           "[--journal DIR [--journal-fsync MS]] [--handoff PATH] [--spectators N] "
+           "[--source-rate N] [--source-burst N] [--shed-rate N] PORT_NUMBER\n", argv[0]);
+    return 1;
+  }
+
+  if (opts->n_shards > 1 && opts->engine == ENGINE_THREADS) {
+    printf("--shards needs an event loop engine (--engine epoll or uring)\n");
+    return 1;
+  }
+
+  if (opts->handoff_path != NULL && opts->engine == ENGINE_URING) {
+    /* the receives posted to the ring would take packets after the handoff */
+    printf("--handoff needs the threads or the epoll engine\n");
+    return 1;
+  }
+
+  if (sscanf(argv[optind], "%d", &opts->port) != 1) {
+    printf("Could not parse the arguments");
+    return 1;
+  }
+
+  return 0;
+}
+
+/* listen_data
+ * 
+ * Continuously listen to data. Once data is received,
+ * queues it for the worker threads. When the queue is full
+ * the packet is dropped, so that a flood cannot grow memory
+ * or threads without bound. A packet the rate limiter refuses
+ * is dropped before it is queued, and its buffer is received
+ * into again.
+ * 
+ */
+int listen_data(void){
+
+  printf("Waiting for connections...\n");
+  handoff_register(HANDOFF_RECEIVER);
+
+  udp_info *infos[MAX_BATCH];
+  int n_infos = 0;
+  int batch = options.batch > MAX_BATCH ? MAX_BATCH : options.batch;
+
+  while(1){
+
+    if (handoff_requested()) {
+      /* the packets received so far are queued for the workers */
+      handoff_park(HANDOFF_RECEIVER);
+    }
+
+    /* refills the buffers handed over to the workers */
+    for(; n_infos<batch; ++n_infos){
+      infos[n_infos] = (udp_info *)pool_get(&packet_buffers);
+
+      if (infos[n_infos] == NULL) {
+        break;
+      }
+      memset(&infos[n_infos]->client_addr, 0, sizeof(infos[n_infos]->client_addr));
+    }
+
+    if (n_infos == 0) {
+      /* every buffer is queued or being handled: let the workers catch up */
+      sched_yield();
+      continue;
+    }
+
+    int received = netio_recv(current_shard->sockfd, infos, n_infos);
+
+    if (received < 0){
+      perror("recv error");
+      return 1;
+    }
+
+    unsigned long recv_ns = metrics_now();
+    unsigned now_ms = limiter_now();
+    int i, kept = 0;
+    for(i=0; i<received; ++i){
+      udp_info *info_ptr = infos[i];
+      info_ptr->recv_ns = recv_ns;
+
+      if (!limiter_admit(&current_shard->limiter, &info_ptr->client_addr, now_ms)) {
+        infos[kept++] = info_ptr;
+        continue;
+      }
+
+      if (ring_push(&packet_ring, (void *)info_ptr)) {
+        /* workers are behind: drop the packet */
+        pool_put(&packet_buffers, info_ptr);
+        metrics_count(COUNT_QUEUE_DROPS);
+        unsigned long dropped = metrics_total(current_shard->id, COUNT_QUEUE_DROPS);
+        if ((dropped & 1023) == 1) {
+          log_msg(LOG_ERROR, "Packet queue full, %lu packets dropped.", dropped);
+        }
+      } else {
+        sem_post(&packets_available);
+      }
+    }
+
+    /* the buffers that were not used stay at the front */
+    for(i=received; i<n_infos; ++i){
+      infos[kept++] = infos[i];
+    }
+    n_infos = kept;
+  }
+}
+
+/**
+ *
+ * worker_loop -
+ * Body of the worker threads. Takes packets from the queue
+ * and passes them to the handler. In batch mode a worker keeps
+ * handling the packets that are already queued, up to the
+ * batch size, and sends all the replies at once.
+ *
+ */
+void *worker_loop(void *params){
+
+  current_shard = (shard *)params;
+  metrics_register(current_shard->id);
+  handoff_register(HANDOFF_WORKER);
+
+  while(1){
+    if (sem_wait(&packets_available) && errno == EINTR) {
+      if (handoff_may_park(HANDOFF_WORKER)) {
+        /* the listener stopped: handles what it queued, then parks */
+        while (sem_trywait(&packets_available) == 0) {
+          udp_info *info = (udp_info *)ring_pop(&packet_ring);
+          if (info != NULL) {
+            handler((void *)info);
+          }
+        }
+        netio_flush();
+        handoff_park(HANDOFF_WORKER);
+      }
+      continue;
+    }
+
+    int handled = 0;
+    do {
+      udp_info *info = (udp_info *)ring_pop(&packet_ring);
+      if (info != NULL) {
+        handler((void *)info);
+      }
+    } while (++handled < options.batch && sem_trywait(&packets_available) == 0);
+
+    netio_flush();
+  }
+}
+
+/**
+ *
+ * handler -
+ * Handles a packet taken from the queue by a worker thread
+ * and gives the buffer back to the pool.
+ *
+ */
+void *handler(void *params){
+
+  udp_info *info = (udp_info *)(params);
+
+  metrics_record(STAGE_QUEUE, metrics_now() - info->recv_ns);
+  handle_packet(info);
+
+  pool_put(&packet_buffers, info);
+  return NULL;
+}
+
+/**
+ *
+ * lock_table -
+ * Protects the seats of the room table in the threads engine:
+ * workers look clients up and push events under the read lock,
+ * while seating and releasing take the write lock. The event
+ * loop engines own their table and lock nothing.
+ *
+ */
+static void lock_table(int write){
+  if(options.engine != ENGINE_THREADS){
+    return;
+  }
+
+  if(write){
+    pthread_rwlock_wrlock(&table_lock);
+  } else {
+    pthread_rwlock_rdlock(&table_lock);
+  }
+}
+
+static void unlock_table(void){
+  if(options.engine == ENGINE_THREADS){
+    pthread_rwlock_unlock(&table_lock);
+  }
+}
+
+/**
+ *
+ * push_room_event -
+ * Queues an event for the game logic of a room and schedules
+ * the room. mov is the move of an EV_MOVE, or NULL, and ack
+ * the cumulative ack carried by the message, or -1. A player_id
+ * of WATCHER or more is a spectator. Must be called with the
+ * table locked.
+ *
+ */
+static void push_room_event(int room_id, int type, int player_id, const mov_view *mov, int ack){
+
+  room_event event;
+  event.type = (unsigned char) type;
+  event.player_id = (unsigned char) (player_id < WATCHER ? player_id : WATCHER);
+  event.watcher = (unsigned short) (player_id < WATCHER ? 0 : player_id - WATCHER);
+  event.col = mov ? mov->col : 0;
+  event.row = mov ? mov->row : 0;
+  event.has_ack = ack >= 0;
+  event.ack = (unsigned char) ack;
+  event.pushed_ns = metrics_now();
+
+  if(room_push_event(&current_shard->rooms.rooms[room_id], event)){
+    /* the player is flooding the room: the game could not keep up */
+    log_msg(LOG_INFO, "Room %ld: event queue full, event %ld dropped.", (long)room_id, (long)type);
+    metrics_count(COUNT_EVENT_DROPS);
+    return;
+  }
+
+  push_ready_room(room_id);
+}
+
+/**
+ *
+ * watch_room -
+ * Adds a client that sent "Watch" to the spectators of a room
+ * that has players, or of the game started last. The game
+ * logic sends it the board if the game is on.
+ *
+ */
+static void watch_room(udp_info *info, int room_id){
+
+  if(room_id < 0){
+    room_id = atomic_load_explicit(&current_shard->featured_room, memory_order_relaxed);
+  }
+
+  lock_table(1);
+
+  /* another worker may have added the same client meanwhile */
+  int player_id;
+  if(identify_client(&info->client_addr, &player_id) != NO_ROOM){
+    unlock_table();
+    return;
+  }
+
+  room_table *table = &current_shard->rooms;
+  int state = room_id >= 0 && room_id < table->n_rooms ? table->rooms[room_id].state : ROOM_FREE;
+  int watcher_id = -1;
+  if(state == ROOM_WAITING || state == ROOM_PLAYING){
+    watcher_id = room_watch(table, room_id, &info->client_addr);
+  }
+  if(watcher_id >= 0){
+    push_room_event(room_id, EV_SNAPSHOT, WATCHER + watcher_id, NULL, -1);
+  }
+  unlock_table();
+
+  char text[PACKET_SIZE];
+  if(watcher_id >= 0){
+    log_packet(LOG_INFO, &info->client_addr, NULL, 0, "Spectator watching room %ld.", (long)room_id);
+    snprintf(text, PACKET_SIZE, "You are watching room %d. Send LFT to stop.", room_id);
+  } else if(state == ROOM_WAITING || state == ROOM_PLAYING){
+    snprintf(text, PACKET_SIZE, "Too many spectators, try again later.");
+  } else if(room_id >= 0){
+    snprintf(text, PACKET_SIZE, "There is no game to watch in room %d.", room_id);
+  } else {
+    snprintf(text, PACKET_SIZE, "There is no game to watch.");
+  }
+  send_txt(info->client_addr, text);
+}
+
+/**
+ *
+ * dispatch_watcher -
+ * Handles a message of a spectator: SNP asks the game logic
+ * for the board and LFT stops the updates. Spectators cannot
+ * play.
+ *
+ */
+static void dispatch_watcher(udp_info *info, const message_view *msg, int room_id, int watcher_id){
+
+  if(msg->code == SNP){
+    lock_table(0);
+    /* the spectator may have left meanwhile */
+    if(current_shard->rooms.watchers[watcher_id].room_id == room_id){
+      push_room_event(room_id, EV_SNAPSHOT, WATCHER + watcher_id, NULL, -1);
+    }
+    unlock_table();
+
+  } else if(msg->code == LFT){
+    lock_table(1);
+    int player_id;
+    if(identify_client(&info->client_addr, &player_id) == room_id && player_id == WATCHER + watcher_id){
+      room_unwatch(&current_shard->rooms, watcher_id);
+    }
+    unlock_table();
+
+  } else {
+    send_txt(info->client_addr, "Spectators cannot play. Send LFT to stop watching.");
+  }
+}
+
+/**
+ *
+ * send_cookie -
+ * Answers the Hello or the Watch of an unknown client with the
+ * cookie of its address, which it must send back with the same
+ * text to take a seat or a spectator slot. Costs one hash and a reply barely longer than the
+ * Hello.
+ *
+ */
+static void send_cookie(const udp_info *info){
+
+  udp_info info_ans;
+  info_ans.client_addr = info->client_addr;
+  info_ans.len = info->len;
+
+  info_ans.buffer[0] = CKE;
+  cookie_make(&info->client_addr, (unsigned char *) info_ans.buffer + 1);
+  info_ans.n_bytes = 1 + COOKIE_SIZE;
+
+  metrics_count(COUNT_COOKIES);
+  send_data(&info_ans);
+}
+
+/**
+ *
+ * dispatch_packet -
+ * Seats new clients that echo the cookie of their Hello, adds
+ * the ones that echo the cookie of their Watch to the
+ * spectators of a room, and turns the messages of seated
+ * players into events for the game of their room. Never reads
+ * the game state, so it runs concurrently with the game logic.
+ *
+ */
+static void dispatch_packet(udp_info *info){
+
+  if (info->n_bytes >= PACKET_SIZE){
+    /* no valid message is this long: it was truncated */
+    log_packet(LOG_INFO, &info->client_addr, NULL, 0, "Packet too long, dropped.");
+    return;
+  }
+
+  if (loss_drop(options.loss_percent)){
+    metrics_count(COUNT_INJECTED_LOSSES);
+    return;
+  }
+
+  log_packet(LOG_DEBUG, &info->client_addr, info->buffer, info->n_bytes,
+             "Receiving %ld bytes", (long)info->n_bytes);
+
+  metrics_count(COUNT_PACKETS);
+
+  /* views over the receive buffer, checked against its length */
+  message_view msg;
+  if(decode_message(info->buffer, info->n_bytes, &msg)){
+    log_msg(LOG_INFO, "Type of Message not recognized: %ld", (long)msg.code);
   }
+  mov_view mov;
+  unsigned char ack;
+
+  /* checks if client is new or is one of the players */
+  int player_id;
+  lock_table(0);
+  int room_id = identify_client(&info->client_addr, &player_id);
+
+  if(room_id != NO_ROOM && player_id >= WATCHER){
+    unlock_table();
+    dispatch_watcher(info, &msg, room_id, player_id - WATCHER);
+    return;
+  }
+
+  if(room_id != NO_ROOM){
+    /* assigned player sent a message */
+    /* the game logic of the room checks it against the board */
+    if(decode_mov(&msg, &mov) == 0){
+      log_msg(LOG_DEBUG, "Move Received: room %ld, player %ld, Row, Col = (%ld, %ld)",
+              (long)room_id, (long)player_id, (long)mov.row, (long)mov.col);
+      /* a reliable client acks the messages it got after the move */
+      push_room_event(room_id, EV_MOVE, player_id, &mov, mov.ack);
+    } else if(decode_ack(&msg, &ack) == 0){
+      push_room_event(room_id, EV_ACK, player_id, NULL, ack);
+    } else if(msg.code == SNP){
+      /* the player lost track of the board */
+      push_room_event(room_id, EV_SNAPSHOT, player_id, NULL, -1);
+    } else if(msg.code == LFT){
+      /* the player quits */
+      push_room_event(room_id, EV_LEAVE, player_id, NULL, -1);
+    } else if(msg.code == HNT){
+      push_room_event(room_id, EV_HINT, player_id, NULL, -1);
+    } else {
+      /* client sent a message that was unexpected */
+      send_txt(info->client_addr, "Your message was not expected and thus will be ignored.");
+    }
+    unlock_table();
+    return;
+  }
+
+  int is_full = room_table_full(&current_shard->rooms);
+  unlock_table();
+
+  txt_view txt;
+  hello_view hello;
+  watch_view watch;
+  cookie_view cookie;
+  int is_echo = decode_cookie(&msg, &cookie) == 0;
+  int is_txt = decode_txt(is_echo ? &cookie.hello : &msg, &txt) == 0;
+  int is_hello = is_txt && decode_hello(&txt, &hello) == 0;
+  int is_watch = is_txt && !is_hello && decode_watch(&txt, &watch) == 0;
+
+  if((is_hello || is_watch) && !is_echo){
+    /* nothing is kept, and nothing is sent but the cookie, until
+      the client proves it gets our packets */
+    send_cookie(info);
+    return;
+  }
+
+  if((is_hello || is_watch) && cookie_check(&info->client_addr, cookie.cookie)){
+    /* forged, or from an earlier period or server: the client can try again */
+    metrics_count(COUNT_BAD_COOKIES);
+    send_cookie(info);
+    return;
+  }
+
+  if(is_watch){
+    watch_room(info, watch.room_id);
+    return;
+  }
+
+  if(is_hello && !is_full){
+    /* new player contacted the server and requested to join the game */
+    lock_table(1);
+
+    /* another worker may have seated the same client meanwhile */
+    room_id = identify_client(&info->client_addr, &player_id);
+    if(room_id != NO_ROOM){
+      unlock_table();
+      return;
+    }
+
+    room_id = room_join(&current_shard->rooms, &info->client_addr, hello.variant, &player_id);
+    if(room_id != NO_ROOM){
+      current_shard->rooms.rooms[room_id].fyi_mode[player_id] = (unsigned char) hello.fyi_mode;
+      current_shard->rooms.rooms[room_id].reliable[player_id] = (unsigned char) (hello.reliable && options.reliable);
+
+      /* tells the game logic to wait for an opponent or to start */
+      push_room_event(room_id, EV_JOIN, player_id, NULL, -1);
+    }
+    unlock_table();
+
+    if(room_id != NO_ROOM){
+      log_packet(LOG_INFO, &info->client_addr, NULL, 0, "Player %ld assigned to room %ld.",
+                 (long)player_id + 1, (long)room_id);
+
+      /* send welcome message to client */
+      char welcome_msg[PACKET_SIZE];
+      const board_variant *variant = &board_variants[hello.variant];
+      if(hello.variant == BOARD_CLASSIC){
+        snprintf(welcome_msg, PACKET_SIZE, "Wellcome! You are player %d. You play with %c.", player_id+1, player_id ? 'O' : 'X');
+      } else {
+        snprintf(welcome_msg, PACKET_SIZE, "Wellcome! You are player %d. You play with %c on a %dx%d board, %d in a row win.",
+                 player_id+1, player_id ? 'O' : 'X', variant->size, variant->size, variant->k);
+      }
+      send_txt(info->client_addr, welcome_msg);
+      return;
+    }
+  }
+
+  if(is_hello){
+    /* every room is full */
+    /* refuse new client */
+
+    udp_info info_ans;
+    info_ans.client_addr = info->client_addr;
+    info_ans.len = info->len;
+
+    info_ans.buffer[0] = END;
+    info_ans.buffer[1] = 0xff;
+
+    info_ans.n_bytes = 2;
+
+    metrics_count(COUNT_REJECTED);
+    send_data(&info_ans);
+  } else {
+    /* unkown client sent something unexpected */
+    log_packet(LOG_INFO, &info->client_addr, NULL, 0,
+               "Unknown client sent a message to the server but did not request to play");
+  }
+}
+
+/**
+ *
+ * handle_packet -
+ * Dispatches a packet received from a client and times it.
+ *
+ */
+void handle_packet(udp_info *info){
+
+  unsigned long start = metrics_now();
+  dispatch_packet(info);
+  metrics_record(STAGE_HANDLE, metrics_now() - start);
+}
+
+/**
+ *
+ * indentify_client -
+ * Determines if a client was already assigned or not.
+ *
+ * Returns the room of the client and sets player_id to 0
+ * if client is the player 1 or 1 if client is the player 2.
+ * Returns NO_ROOM if client is not assigned.
+ *
+ */
+int identify_client(const struct sockaddr_in *addr, int *player_id){
+  return room_lookup(&current_shard->rooms, addr, player_id);
+}
+
+/**
+ *
+ * push_ready_room -
+ * Schedules a room for the game logic, unless it is already
+ * scheduled. A room is in the ready ring at most once, so the
+ * ring never fills up.
+ *
+ */
+void push_ready_room(int room_id){
+
+  room *rm = &current_shard->rooms.rooms[room_id];
+  if(atomic_exchange(&rm->scheduled, 1)){
+    return;
+  }
+
+  ring_push(&current_shard->ready_rooms, (void *)(intptr_t)(room_id + 1));
+
+  if(options.engine == ENGINE_THREADS){
+    sem_post(&rooms_available);
+  }
+}
+
+/**
+ *
+ * pop_ready_room -
+ * Takes the next room from the ready ring. Only the thread
+ * running the game logic of the shard may pop.
+ *
+ * Returns NO_ROOM if no room is waiting for the game logic.
+ *
+ */
+int pop_ready_room(void){
+
+  void *item = ring_pop(&current_shard->ready_rooms);
+  if(item == NULL){
+    return NO_ROOM;
+  }
+
+  return (int)(intptr_t)item - 1;
+}
+
+/**
+ *
+ * game_loop -
+ * Loop responsible for the logic of the games. This thread
+ * sleeps until a room is scheduled or the next tick of the
+ * timers, then drains the events of every ready room. The
+ * workers never wait for it.
+ *
+ */
+void *game_loop(void *params){
+
+  current_shard = (shard *)params;
+  metrics_register(current_shard->id);
+  handoff_register(HANDOFF_GAME);
+
+  while(1){
+    if(handoff_may_park(HANDOFF_GAME)){
+      /* the workers stopped: plays the events they pushed, then parks */
+      process_ready_rooms();
+      netio_flush();
+      handoff_park(HANDOFF_GAME);
+    }
+
+    process_ready_rooms();
+    expire_timers();
+
+    /* sends the messages of this tick before sleeping */
+    netio_flush();
+
+    if(!timers_pending()){
+      /* a signal may interrupt the wait: the loop starts over */
+      sem_wait(&rooms_available);
+      continue;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += TIMER_TICK_MS * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L){
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    sem_timedwait(&rooms_available, &deadline);
+  }
+}
+
+/**
+ *
+ * process_ready_rooms -
+ * Advances every room in the ready ring.
+ *
+ */
+void process_ready_rooms(void){
+
+  int room_id;
+  while((room_id = pop_ready_room()) != NO_ROOM){
+    process_room(room_id);
+  }
+}
+
+/* reliable delivery state of a seat, or NULL without --reliable */
+static peer_window *seat_window(int room_id, int player_id){
+  if(current_shard->windows == NULL){
+    return NULL;
+  }
+  return &current_shard->windows[room_id * MAX_CLIENTS + player_id];
+}
+
+/* returns 1 if a player of the room has messages not acknowledged */
+static int room_in_flight(int room_id){
+
+  int i;
+  for(i=0; i<MAX_CLIENTS; ++i){
+    const peer_window *window = seat_window(room_id, i);
+    if(window != NULL && window_in_flight(window)){
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* retransmits the oldest message of a window once its timeout passes */
+static void arm_retransmit(peer_window *window){
+  long tick_us = TIMER_TICK_MS * 1000L;
+  timer_arm(&current_shard->retransmits, &window->timer,
+            timer_now() + (window->rto + tick_us - 1) / tick_us);
+}
+
+/* drops the messages a player will never acknowledge */
+static void forget_window(int room_id, int player_id){
+  peer_window *window = seat_window(room_id, player_id);
+  if(window != NULL){
+    timer_cancel(&current_shard->retransmits, &window->timer);
+    window->enabled = 0;
+    window->base = window->next_seq;
+  }
+}
+
+/**
+ *
+ * release_room -
+ * Stops the timers of a room and gives the room back to the
+ * table, under the write lock in the threads engine.
+ *
+ */
+static void release_room(int room_id){
+  timer_cancel(&current_shard->timers, &current_shard->rooms.rooms[room_id].timer);
+
+  int i;
+  for(i=0; i<MAX_CLIENTS; ++i){
+    forget_window(room_id, i);
+  }
+
+  lock_table(1);
+  room_release(&current_shard->rooms, room_id);
+  unlock_table();
+}
+
+/**
+ *
+ * arm_room_timer -
+ * Gives a room a deadline, in seconds from now. A timeout of 0
+ * disables the deadline.
+ *
+ */
+static void arm_room_timer(room *rm, int seconds){
+
+  if(seconds == 0){
+    timer_cancel(&current_shard->timers, &rm->timer);
+    return;
+  }
+
+  timer_arm(&current_shard->timers, &rm->timer,
+            timer_now() + (unsigned long)seconds * 1000 / TIMER_TICK_MS);
+}
+
+/* starts a new sequence for a seat, or disables reliability for it */
+static void reset_window(int room_id, int player_id){
+
+  peer_window *window = seat_window(room_id, player_id);
+  if(window == NULL){
+    return;
+  }
+
+  const room *rm = &current_shard->rooms.rooms[room_id];
+  timer_cancel(&current_shard->retransmits, &window->timer);
+  timer_node_init(&window->timer, room_id * MAX_CLIENTS + player_id);
+  window_reset(window, &rm->players[player_id], rm->reliable[player_id]);
+}
+
+/* 1 if a lonely player gets the bot before the idle timeout: the bot only plays on 3x3 */
+static int bot_is_due(const room *rm){
+  return options.bot_after != NO_BOT && rm->game.variant == BOARD_CLASSIC &&
+         (options.idle_timeout == 0 || options.bot_after < options.idle_timeout);
+}
+
+/**
+ *
+ * start_game -
+ * Starts the game of a room whose seats are taken: clears the
+ * board, sends it to both players and asks the first one, who
+ * is always a human, to move.
+ *
+ */
+static void start_game(int room_id){
+
+  room *rm = &current_shard->rooms.rooms[room_id];
 
-  /* thread responsible for listening to
-    user interactions */
-  if(listen_data()){
-    fprintf(stderr, "Fatal error in listen()\n");
-    exit(1);
+  /* restarts the board */
+  initialize_game(rm);
+  arm_room_timer(rm, options.turn_timeout);
+  metrics_count(COUNT_GAMES_STARTED);
+  atomic_store_explicit(&current_shard->featured_room, room_id, memory_order_relaxed);
+
+  /* sends the FYI message with an empty 3x3 grid */
+  send_information_messages(rm);
+  request_move(rm);
+}
+
+/**
+ *
+ * seat_bot -
+ * Gives the player waiting alone in a room the bot as an
+ * opponent and starts the game.
+ *
+ * Returns 0 on success and 1 if an opponent took the seat
+ * meanwhile.
+ *
+ */
+static int seat_bot(int room_id){
+
+  lock_table(1);
+  int taken = room_seat_bot(&current_shard->rooms, room_id);
+  unlock_table();
+  if(taken){
+    return 1;
   }
 
+  log_msg(LOG_INFO, "Room %ld: the bot plays the waiting player.", (long)room_id);
+  reset_window(room_id, MAX_CLIENTS - 1);
+  metrics_count(COUNT_BOT_GAMES);
+  start_game(room_id);
   return 0;
 }
 
-/* listen_data
- * 
- * Continuously listen to data. Once data is received,
- * passes it to the handler in a new thread.
- * 
+/**
+ *
+ * room_timeout -
+ * Fires when a room misses its deadline. The player to move
+ * forfeits the game; a player still waiting for an opponent
+ * gets the bot if --bot-after is set, or is told with LFT and
+ * loses the seat.
+ *
  */
-int listen_data(void){
+static void room_timeout(timer_node *timer){
 
-  printf("Waiting for connections...\n");
+  int room_id = timer->id;
+  room *rm = &current_shard->rooms.rooms[room_id];
 
-  while(1){
+  if(rm->state == ROOM_WAITING && bot_is_due(rm) && seat_bot(room_id) == 0){
+    /* the player waited long enough for a human */
+    return;
+  }
 
-    udp_info *info_ptr = (udp_info *)(malloc(sizeof(udp_info)));
+  if(rm->state == ROOM_PLAYING){
+    int player_id = rm->game.player_to_move;
+    metrics_count(COUNT_TIMEOUTS);
+    log_msg(LOG_INFO, "Room %ld: player %ld ran out of time.", (long)room_id, (long)player_id + 1);
 
-    if (info_ptr == NULL) {
-      fprintf(stderr, "Malloc Error\n");
-      free(info_ptr);
-      return 1;
-    }
+    udp_info info;
+    info.buffer[0] = LFT;
+    info.n_bytes = 1;
+    info.len = sizeof(struct sockaddr_in);
+    send_to_player(rm, player_id, &info);
 
-    memset(&info_ptr->client_addr, 0, sizeof(info_ptr->client_addr));
-    info_ptr->len = sizeof(struct sockaddr);
+    rm->game.is_game_over = 1;
+    rm->game.game_result = (unsigned char)(2 - player_id);
+    rm->game.end_reason = JOURNAL_TIMEOUT;
+    finalize_game(room_id);
 
-    info_ptr->n_bytes = recvfrom(sockfd, (char *)info_ptr->buffer, MAX_SIZE, MSG_WAITALL,
-                          (struct sockaddr *)&info_ptr->client_addr, &info_ptr->len);
+  } else if(rm->state == ROOM_WAITING){
+    udp_info info;
+    info.buffer[0] = LFT;
+    info.n_bytes = 1;
+    info.client_addr = rm->players[0];
+    info.len = sizeof(struct sockaddr_in);
 
+    /* an opponent may have taken the seat meanwhile */
+    lock_table(1);
+    int is_alone = rm->n_players < MAX_CLIENTS;
+    if(is_alone){
+      room_release(&current_shard->rooms, room_id);
+    }
+    unlock_table();
 
-    if (info_ptr->n_bytes < 0 || info_ptr->n_bytes >= MAX_SIZE){
-      perror("recv error");
-      free(info_ptr);
-      return 1;
+    if(is_alone){
+      metrics_count(COUNT_TIMEOUTS);
+      log_msg(LOG_INFO, "Room %ld: no opponent came, room closed.", (long)room_id);
+      send_data(&info);
     }
-    else{
+  }
+}
+
+/**
+ *
+ * retransmit_timeout -
+ * Fires when the oldest message to a reliable player was not
+ * acknowledged in time, and sends it again. A player that does
+ * not answer the retries is given up on.
+ *
+ */
+static void retransmit_timeout(timer_node *timer){
 
-#if DEBUG_MODE
-      /* found here the instructions to print IP address */
-      // https://stackoverflow.com/questions/9590529/how-should-i-print-server-address
-      char buffer[INET_ADDRSTRLEN];
-      inet_ntop(AF_INET, &info_ptr->client_addr.sin_addr, buffer, INET_ADDRSTRLEN);
+  int room_id = timer->id / MAX_CLIENTS;
+  int player_id = timer->id % MAX_CLIENTS;
+  peer_window *window = seat_window(room_id, player_id);
 
-      printf("+-----------------------------+\n");
-      printf("Receiving Data from: %s::%d\n", buffer, htons(info_ptr->client_addr.sin_port));
-      print_bytes((void *)info_ptr->buffer, info_ptr->n_bytes);
-#endif
+  udp_info wrapped;
+  if(window_retransmit(window, &wrapped)){
+    log_msg(LOG_INFO, "Room %ld: player %ld stopped acknowledging.", (long)room_id, (long)player_id + 1);
+    metrics_count(COUNT_PEERS_LOST);
 
-      info_ptr->buffer[info_ptr->n_bytes] = '\0';
-      pthread_t handler_thread;
-      pthread_create(&handler_thread, NULL, handler, (void *)info_ptr);      
+    if(current_shard->rooms.rooms[room_id].state == ROOM_CLOSING && !room_in_flight(room_id)){
+      release_room(room_id);
     }
+    return;
   }
+
+  metrics_count(COUNT_RETRANSMITS);
+  send_data(&wrapped);
+  arm_retransmit(window);
 }
 
-void *handler(void *params){
+/**
+ *
+ * apply_ack -
+ * Frees the messages a reliable player acknowledged. A room
+ * whose game is over is released once both players got the END.
+ *
+ */
+static void apply_ack(int room_id, int player_id, unsigned char ack){
 
-  udp_info *info = (udp_info *)(params);
-  /* checks if client is new or is one of the players */
-  int client_id = identify_client(&info->client_addr);
+  peer_window *window = seat_window(room_id, player_id);
+  if(window == NULL || !window->enabled || window_ack(window, ack) == 0){
+    return;
+  }
 
-  /* cases */
-  if(n_connected_clients==2 && client_id==2){
-    /* game no longer supports any new client */
-    /* refuse new client */
-  
-    udp_info info_ans;
-    info_ans.client_addr = info->client_addr;
-    info_ans.len = info->len;
+  if(window_in_flight(window)){
+    arm_retransmit(window);
+  } else {
+    timer_cancel(&current_shard->retransmits, &window->timer);
+  }
 
-    info_ans.buffer[0] = END;
-    info_ans.buffer[1] = 0xff;
+  if(current_shard->rooms.rooms[room_id].state == ROOM_CLOSING && !room_in_flight(room_id)){
+    release_room(room_id);
+  }
+}
 
-    info_ans.n_bytes = 2;
+/**
+ *
+ * expire_timers -
+ * Fires the deadlines and retransmissions that are due. Called
+ * by the thread running the game logic of the shard, after it
+ * drained the ready rooms.
+ *
+ */
+void expire_timers(void){
+  unsigned long now = timer_now();
+  timer_advance(&current_shard->timers, now, room_timeout);
+  timer_advance(&current_shard->retransmits, now, retransmit_timeout);
+}
 
-    send_data(&info_ans);
-  }
+int timers_pending(void){
+  return current_shard->timers.n_pending > 0 || current_shard->retransmits.n_pending > 0;
+}
 
-  else if(n_connected_clients < 2 && client_id == 2){
-    /* new player contacted the server and server supports a new client */
-    game_message g_msg;
-    parse_data(info->buffer, &g_msg);
+/**
+ *
+ * apply_move -
+ * Validates a move of the player to move and plays it. Asks
+ * for a new move if it is illegal.
+ *
+ */
+static void play_bot_move(int room_id);
+static void send_watcher_snapshot(int room_id, int watcher_id);
+
+static void apply_move(int room_id, const room_event *event){
+
+  room *rm = &current_shard->rooms.rooms[room_id];
+  int player_id = event->player_id;
+  int col = (int)(signed char)event->col;
+  int row = (int)(signed char)event->row;
+  int size = board_variants[rm->game.variant].size;
+  int cell = row * size + col;
+
+  /* checks if the move is valid */
+  /* in case the move is not valid, it asks for the client to send a new move */
+  if (row < 0 || row >= size || col < 0 || col >= size) {
+    log_msg(LOG_INFO, "Room %ld: player %ld tried to make illegal move", (long)room_id, (long)player_id);
+    send_player_txt(rm, player_id, "Invalid Move: position is not in the grid");
+    request_move(rm);
+
+  } else if (BOARD_TEST(rm->game.cells[0], cell) || BOARD_TEST(rm->game.cells[1], cell)) {
+    log_msg(LOG_INFO, "Room %ld: player %ld tried to make illegal move", (long)room_id, (long)player_id);
+    send_player_txt(rm, player_id, "Invalid Move: position is already taken");
+    request_move(rm);
 
-    if(g_msg.code == TXT && !strncmp(g_msg.data, "Hello\0", 6)){
-      /* checks if the client requested to join the game */
-      printf("+-----------------------------+\n");
-      printf("Player %d assigned.\n", n_connected_clients + 1);
+  } else {
+    /* move is valid */
+    metrics_count(COUNT_MOVES);
+    rm->last_move.player_id = (char) player_id;
+    rm->last_move.col = (char) col;
+    rm->last_move.row = (char) row;
+    BOARD_SET(rm->game.cells[player_id], cell);
+    rm->game.player_to_move = 1 - player_id;
+    if(rm->game.n_occupied < 9){
+      rm->game.moves[rm->game.n_occupied] = (unsigned char) cell;
+    }
+    rm->game.n_occupied += 1;
 
-      /* send welcome message to client */
-      char welcome_msg[MAX_SIZE];
-      snprintf(welcome_msg, MAX_SIZE, "Wellcome! You are player %d. You play with %c.", n_connected_clients+1, n_connected_clients ? 'O' : 'X');
-      send_txt(info->client_addr, welcome_msg);
+    /* send the FYI message with the new updated board */
+    send_information_messages(rm);
 
-      /* tells the game loop that a new client has joined the game */
-      pthread_mutex_lock(&game_mutex);
-      players[n_connected_clients] = info->client_addr;
-      n_connected_clients += 1;
+    /* checks now if game is over, only on the lines through the move */
+    update_game_status(&rm->game, player_id, cell);
 
-      pthread_cond_signal(&new_player_cond);
-      pthread_mutex_unlock(&game_mutex);
+    if(rm->game.is_game_over){
+      /* sends the results to both players */
+      /* frees the room so that now new players can join */
+      finalize_game(room_id);
+    } else if(rm->bot[rm->game.player_to_move]){
+      play_bot_move(room_id);
     } else {
-      /* unkown client sent something unexpected */
-      printf("Unknown client sent a message to the server but did not request to play\n");
+      arm_room_timer(rm, options.turn_timeout);
+      request_move(rm);
     }
   }
+}
 
-  else if(client_id <= 1){
-    /* assigned player sent a message */
-    game_message g_msg;
-    g_msg.player_id = client_id;
-    parse_data(info->buffer, &g_msg);
-
-    if(g_msg.code == MOV && n_connected_clients == 2){
-      /* the player made a move */
-      /* tell the game loop thread that a new move was registered */
-
-      pthread_mutex_lock(&game_mutex);
-      last_move = g_msg;
-
-#if DEBUG_MODE
-      printf("+-----------------------------+\n");
-      printf("Move Received: player %d\n", last_move.player_id);
-      printf("Row, Col = (%d, %d)\n", last_move.data[1], last_move.data[0]);
-#endif
-      if (last_move.player_id != game.player_to_move){
-        /* player tried to move when it was not his/her turn */
-        send_txt(players[last_move.player_id], "Your move was ignored. It is not your turn.");
-#if DEBUG_MODE
-      printf("Move was ignored.\n");
-#endif
-      } else {
-        pthread_cond_signal(&new_move_cond);
-      }
-      pthread_mutex_unlock(&game_mutex);
-    } else {
-      /* client sent a message that was unexpected */
-      send_txt(info->client_addr, "Your message was not expected and thus will be ignored.");
-    }
-  }
-  
-  free(info);
-  return NULL;
+/**
+ *
+ * play_bot_move -
+ * Plays the perfect move of the bot, looked up in the solved
+ * positions, as if the bot had sent it.
+ *
+ */
+static void play_bot_move(int room_id){
+
+  const room *rm = &current_shard->rooms.rooms[room_id];
+  int player_id = rm->game.player_to_move;
+  int outcome;
+  int cell = solver_best_move((unsigned)rm->game.cells[player_id][0], (unsigned)rm->game.cells[1 - player_id][0], &outcome);
+
+  room_event event;
+  memset(&event, 0, sizeof(event));
+  event.type = EV_MOVE;
+  event.player_id = (unsigned char) player_id;
+  event.col = (unsigned char)(cell % 3);
+  event.row = (unsigned char)(cell / 3);
+  apply_move(room_id, &event);
 }
 
 /**
- * 
- * indentify_client -
- * Determines if a client was already assigned or not. 
- * 
- * Returns 0 if client is the player 1
- * Returns 1 if client is the player 2
- * Returns 2 if client is not assigned
- * 
+ *
+ * send_hint -
+ * Answers HNT from the player to move with the best move and
+ * the outcome of the game under perfect play: [HNT][col][row]
+ * and 1 for a win, 0 for a draw or -1 for a loss.
+ *
  */
-int identify_client(const struct sockaddr_in *addr){
+static void send_hint(const room *rm, int player_id){
 
-  int i;
-  for(i=0; i<MAX_CLIENTS; ++i){
-    if (!memcmp(addr, &players[i], sizeof(struct sockaddr_in))){
-      return i;
-    }
+  if(rm->state != ROOM_PLAYING || player_id != rm->game.player_to_move){
+    send_player_txt(rm, player_id, "Hints are only given on your turn.");
+    return;
+  }
+  if(rm->game.variant != BOARD_CLASSIC){
+    send_player_txt(rm, player_id, "Hints are only given on the 3x3 board.");
+    return;
   }
 
-  return 2;
-}
-
-/**
- * 
- * parse_data - 
- * Transforms raw bytes into a game_message object that
- * contains the same data.
- */
-int parse_data(char *data, game_message *g_msg){
-  /* finds the type of the message */
-  g_msg->code = data[0];
-  if (g_msg->code != MOV && g_msg->code != TXT) {
-    fprintf(stderr, "Type of Message not recognized\n");
-    return 1;
+  int outcome;
+  int cell = solver_best_move((unsigned)rm->game.cells[player_id][0], (unsigned)rm->game.cells[1 - player_id][0], &outcome);
+  if(cell < 0){
+    return;
   }
 
-  memcpy(g_msg->data, data+1, MAX_SIZE-1);
-  return 0;
+  udp_info info;
+  info.buffer[0] = HNT;
+  info.buffer[1] = (char)(cell % 3);
+  info.buffer[2] = (char)(cell / 3);
+  info.buffer[3] = (char) outcome;
+  info.n_bytes = 4;
+  info.len = sizeof(struct sockaddr_in);
+
+  metrics_count(COUNT_HINTS);
+  send_to_player(rm, player_id, &info);
 }
 
 /**
- * 
- * game_loop - 
- * Loop responsible for the logic of the game. This thread
- * keeps waiting for players to join. When there are exactly 
- * 2 players, it waits for each player to make its move, and 
- * then sends the appropriate messages to both players.
- * 
+ *
+ * process_room -
+ * Drains the events of a room in the order they arrived:
+ * starts the game once both players are seated, plays the
+ * moves of the player to move, answers the snapshot requests
+ * of players and spectators and ends the game when a player
+ * leaves.
+ *
  */
-void *game_loop(void *params){
-
-  pthread_mutex_lock(&game_mutex);
-  while(1){
-    
-    /* restarts the board */
-    initialize_game();
-
-    while(n_connected_clients < 2){
-      /* do nothing */
-      pthread_cond_wait(&new_player_cond, &game_mutex);
-    }
+void process_room(int room_id){
 
-    /* sends the FYI message with an empty 3x3 grid */
-    send_information_messages();
+  room *rm = &current_shard->rooms.rooms[room_id];
+  unsigned long start = metrics_now();
 
-    while(!game.is_game_over){
+  /* events pushed from now on schedule the room again */
+  atomic_store(&rm->scheduled, 0);
 
-      while(last_move.player_id != game.player_to_move || last_move.processed){
-        /* wait for message from handler */
-        
-        /* asks for the client to send his/her move */
-        udp_info info;
-        info.buffer[0] = MYM;
-        info.n_bytes = 1;
-        info.client_addr = players[game.player_to_move];
-        info.len = sizeof(struct sockaddr_in);
-        send_data(&info);
+  room_event event;
+  while(room_pop_event(rm, &event)){
+    int player_id = event.player_id;
+    metrics_record(STAGE_WAKEUP, start > event.pushed_ns ? start - event.pushed_ns : 0);
 
-        /* waits for a new move to come */
-        pthread_cond_wait(&new_move_cond, &game_mutex);
+    if(player_id == WATCHER){
+      /* a spectator joined or lost track of the board */
+      if(event.type == EV_SNAPSHOT && rm->state == ROOM_PLAYING){
+        send_watcher_snapshot(room_id, event.watcher);
       }
+      continue;
+    }
 
-      int col = (int)last_move.data[0];
-      int row = (int)last_move.data[1];
+    if(event.has_ack){
+      apply_ack(room_id, player_id, event.ack);
+    }
 
-      /* checks if the move is valid */
-      /* in case the move is not valid, it asks for the client to send a new move */
-      if (row < 0 || row > 2 || col < 0 || col > 2) {
-        printf("Player %d tried to make illegal move\n", last_move.player_id);
-        send_txt(players[last_move.player_id], "Invalid Move: position is not in the grid");
+    switch(event.type){
+      case EV_JOIN:
+        if(rm->state != ROOM_WAITING){
+          break;
+        }
 
-      } else if (game.cells[row][col]) {
-        printf("Player %d tried to make illegal move\n", last_move.player_id);
-        send_txt(players[last_move.player_id], "Invalid Move: position is already taken");
-      } else {
-        /* move is valid */
-        game.cells[row][col] = (char) (last_move.player_id + 1);
-        game.player_to_move = 1 - last_move.player_id;
-        game.n_occupied += 1;
+        reset_window(room_id, player_id);
 
-        /* send the FYI message with the new updated board */
-        send_information_messages();
+        if(player_id < MAX_CLIENTS - 1){
+          /* the player waits for an opponent, or for the bot */
+          if(options.bot_after == 0 && bot_is_due(rm) && seat_bot(room_id) == 0){
+            break;
+          }
+          arm_room_timer(rm, bot_is_due(rm) ? options.bot_after : options.idle_timeout);
+          break;
+        }
 
-        /* checks now if game is over */
-        update_game_status();
-      }
+        start_game(room_id);
+        break;
+
+      case EV_MOVE:
+        if(rm->state == ROOM_CLOSING){
+          /* the game is over, the room only waits for acks */
+        } else if(rm->state != ROOM_PLAYING){
+          send_player_txt(rm, player_id, "Your message was not expected and thus will be ignored.");
+        } else if(player_id != rm->game.player_to_move){
+          /* player tried to move when it was not his/her turn */
+          send_player_txt(rm, player_id, "Your move was ignored. It is not your turn.");
+          log_msg(LOG_DEBUG, "Move was ignored.");
+        } else {
+          apply_move(room_id, &event);
+        }
+        break;
 
-      last_move.processed = 1;
+      case EV_SNAPSHOT:
+        if(rm->state == ROOM_PLAYING){
+          send_snapshot(rm, player_id);
+        }
+        break;
+
+      case EV_HINT:
+        send_hint(rm, player_id);
+        break;
+
+      case EV_LEAVE:
+        if(rm->state == ROOM_PLAYING){
+          /* the opponent wins by forfeit */
+          log_msg(LOG_INFO, "Room %ld: player %ld left the game.", (long)room_id, (long)player_id + 1);
+          forget_window(room_id, player_id);
+          rm->game.is_game_over = 1;
+          rm->game.game_result = (unsigned char)(2 - player_id);
+          rm->game.end_reason = JOURNAL_LEFT;
+          finalize_game(room_id);
+        } else if(rm->state == ROOM_WAITING){
+          /* an opponent may be joining right now */
+          lock_table(1);
+          if(rm->n_players < MAX_CLIENTS){
+            timer_cancel(&current_shard->timers, &rm->timer);
+            room_release(&current_shard->rooms, room_id);
+          }
+          unlock_table();
+        }
+        break;
     }
+  }
 
-    /* sends the results to both players */
-    /* resets the players so that now new players can join */
-    finalize_game();
-  }    
+  metrics_record(STAGE_GAME, metrics_now() - start);
 }
 
 /**
- * 
- * update_game_status - 
- * Checks if the game is over. In case it is over, it sets
- * the outcome of the game in the game global variable.
- * 
+ *
+ * request_move -
+ * Asks the player to move to send his/her move.
+ *
  */
-void update_game_status(void){
+void request_move(const room *rm){
 
-  int i=0;
+  udp_info info;
+  info.buffer[0] = MYM;
+  info.n_bytes = 1;
+  info.len = sizeof(struct sockaddr_in);
+  send_to_player(rm, rm->game.player_to_move, &info);
+}
 
-  /* check rows */
-  for(i=0; i<3; ++i){
-    if (game.cells[i][0] == game.cells[i][1] && game.cells[i][1] == game.cells[i][2] &&
-      game.cells[i][2] != 0) {
-        game.is_game_over = 1;
-        game.game_result = game.cells[i][0];
-        return;
-    }
-  }
+/**
+ *
+ * send_to_player -
+ * Sends a message to a seated player. Players that joined with
+ * "Hello reliable" get it through their window: it is numbered,
+ * kept until acknowledged and retransmitted if needed. Only the
+ * thread running the game logic may call it.
+ *
+ */
+void send_to_player(const room *rm, int player_id, udp_info *info){
 
-  /* check cols */
-  for(i=0; i<3; ++i){
-    if (game.cells[0][i] == game.cells[1][i] && game.cells[1][i] == game.cells[2][i] &&
-      game.cells[2][i] != 0) {
-        game.is_game_over = 1;
-        game.game_result = game.cells[0][i];
-        return;
-    }
+  if(rm->bot[player_id]){
+    /* the bot reads the game state directly */
+    return;
   }
 
-  /* check diagonals */
-  if (game.cells[0][0] == game.cells[1][1] && game.cells[1][1] == game.cells[2][2] &&
-    game.cells[2][2] != 0){
-      game.is_game_over = 1;
-      game.game_result = game.cells[0][0];
-      return;
+  int room_id = (int)(rm - current_shard->rooms.rooms);
+  peer_window *window = seat_window(room_id, player_id);
+
+  info->client_addr = rm->players[player_id];
+  if(window == NULL || !window->enabled){
+    send_data(info);
+    return;
   }
 
-  if (game.cells[0][2] == game.cells[1][1] && game.cells[1][1] == game.cells[2][0] &&
-    game.cells[2][0] != 0){
-      game.is_game_over = 1;
-      game.game_result = game.cells[0][2];
-      return;
+  udp_info wrapped;
+  if(window_send(window, info, &wrapped)){
+    /* the player stopped acknowledging: the timers will end the game */
+    log_msg(LOG_DEBUG, "Room %ld: window of player %ld full, message dropped.",
+            (long)room_id, (long)player_id + 1);
+    return;
   }
 
-  /* checks if the game was a draw */
-  if (game.n_occupied == 9) {
-    game.is_game_over = 1;
-    game.game_result = 0;
+  if(!timer_is_armed(&window->timer)){
+    arm_retransmit(window);
   }
+  send_data(&wrapped);
+}
+
+/**
+ * 
+ * update_game_status - 
+ * Checks if the move of player_id on cell ended the game. In
+ * case it did, it sets the outcome of the game in the given
+ * game state. Only the lines through the cell can have become
+ * full, so the rest of the board is never scanned.
+ * 
+ */
+void update_game_status(game_state *game, int player_id, int cell){
 
+  const board_variant *variant = &board_variants[game->variant];
+
+  if (board_wins_after(game->variant, game->cells[player_id], cell)) {
+    game->is_game_over = 1;
+    game->game_result = (unsigned char)(player_id + 1);
+  } else if (game->n_occupied == variant->size * variant->size) {
+    /* the game was a draw */
+    game->is_game_over = 1;
+    game->game_result = 0;
+  }
 }
 
 /**
  * 
  * initialize_game - 
- * Resets the board so that a new game can start.
+ * Resets the board of a room so that a new game can start.
  * 
  */
-void *initialize_game(void){
-  printf("+-----------------------------+\n");
-  printf("Creating a new game.\n");
+void *initialize_game(room *rm){
+  log_msg(LOG_INFO, "Creating a new game in room %ld.", (long)(rm - current_shard->rooms.rooms));
 
-  last_move.player_id = 2;
-  last_move.processed = 1;
+  rm->last_move.player_id = 2;
 
-  game.n_occupied = 0;
-  game.player_to_move = 0;
-  game.is_game_over = 0;
-  memset(game.cells, 0, 3*3*sizeof(char));
+  rm->game.n_occupied = 0;
+  rm->game.player_to_move = 0;
+  rm->game.is_game_over = 0;
+  rm->game.game_result = 0;
+  rm->game.end_reason = JOURNAL_FINISHED;
+  memset(rm->game.cells, 0, sizeof(rm->game.cells));
+  rm->started_ms = journal_now_ms();
+
+  rm->state = ROOM_PLAYING;
 
   return NULL;
 }
 
-void *finalize_game(void){
+/* hands a finished game to the journal writer */
+static void journal_game(const room *rm){
+
+  journal_record rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.end_ms = journal_now_ms();
+  rec.duration_ms = (uint32_t)(rec.end_ms - rm->started_ms);
+  rec.result = rm->game.game_result;
+  rec.reason = rm->game.end_reason;
+  rec.flags = rm->bot[MAX_CLIENTS - 1] ? JOURNAL_BOT_O : 0;
+  rec.n_moves = rm->game.n_occupied;
+  memcpy(rec.moves, rm->game.moves, rec.n_moves);
+
+  if(journal_push(&rec)){
+    metrics_count(COUNT_JOURNAL_DROPS);
+  }
+}
+
+/**
+ *
+ * finalize_game -
+ * Sends the outcome to both players and to the spectators of a
+ * room, journals the game if it was played on 3x3 and releases
+ * the room so that new players can join.
+ *
+ */
+void *finalize_game(int room_id){
+
+  room *rm = &current_shard->rooms.rooms[room_id];
+
+  log_msg(LOG_INFO, "Game is over in room %ld. Player %ld won.", (long)room_id, (long)rm->game.game_result);
 
-  printf("+-----------------------------+\n");
-  printf("Game is over.\n");
-  printf("Player %d won.\n", game.game_result);
+  if(options.journal_dir != NULL && rm->game.variant == BOARD_CLASSIC){
+    journal_game(rm);
+  }
+
+  udp_info infos[MAX_CLIENTS];
+  int deferred[MAX_CLIENTS];
 
   int i;
   for(i=0; i<MAX_CLIENTS; ++i){
-    udp_info info;
+    udp_info *info = &infos[i];
     
-    info.client_addr = players[i];
-    info.len = sizeof(struct sockaddr_in);
-
-    info.buffer[0] = END;
-    info.buffer[1] = game.game_result;
-    info.n_bytes = 2;
+    info->len = sizeof(struct sockaddr_in);
+
+    info->buffer[0] = END;
+    info->buffer[1] = rm->game.game_result;
+    info->n_bytes = 2;
+
+    /* the END of a plain player leaves after the seat is freed, so
+       that the player can say Hello again as soon as it arrives */
+    peer_window *window = seat_window(room_id, i);
+    deferred[i] = !rm->bot[i] && (window == NULL || !window->enabled);
+    if(deferred[i]){
+      info->client_addr = rm->players[i];
+    } else {
+      send_to_player(rm, i, info);
+    }
+  }
+  send_to_watchers(rm, &infos[0]);
 
-    send_data(&info);
-    memset(&players[i], 0, sizeof(players[i]));
+  if(room_in_flight(room_id)){
+    /* keeps the seats until the reliable players ack the END */
+    timer_cancel(&current_shard->timers, &rm->timer);
+    rm->state = ROOM_CLOSING;
+  } else {
+    release_room(room_id);
   }
 
-  n_connected_clients = 0;
+  for(i=0; i<MAX_CLIENTS; ++i){
+    if(deferred[i]){
+      send_data(&infos[i]);
+    }
+  }
+  metrics_count(COUNT_GAMES_FINISHED);
   return NULL;
 }
 
 /**
  * 
  * send_information_messages - 
- * Sends the FYI messages to both players.
+ * Sends the board to both players of a room, each in the
+ * encoding it asked for, and to its spectators as FYC. Each
+ * encoding is built once per move.
  */
-void *send_information_messages(void){
+void *send_information_messages(const room *rm){
+
+  udp_info encoded[N_FYI_MODES];
+  int built = 0;
 
   /* sends FYI messages */
   int i;
   for(i=0; i<MAX_CLIENTS; ++i){
-    udp_info info;
-    info.client_addr = players[i];
-    info.len = sizeof(struct sockaddr_in);
+    /* a larger board has a single encoding */
+    int mode = rm->game.variant == BOARD_CLASSIC ? rm->fyi_mode[i] : FYI_COMPACT;
+    udp_info *info = &encoded[mode];
+
+    if(!(built & (1 << mode))){
+      info->n_bytes = encode_board(rm, mode, info->buffer);
+      info->len = sizeof(struct sockaddr_in);
+      built |= 1 << mode;
+    }
+
+    send_to_player(rm, i, info);
+  }
+
+  if(rm->n_watchers > 0){
+    udp_info *info = &encoded[FYI_COMPACT];
+    if(!(built & (1 << FYI_COMPACT))){
+      info->n_bytes = encode_board(rm, FYI_COMPACT, info->buffer);
+    }
+    send_to_watchers(rm, info);
+  }
+
+  return NULL;
+}
+
+/**
+ *
+ * send_to_watchers -
+ * Sends one message to every spectator of a room. The addresses
+ * are copied under the read lock, then sent with sendmmsg from
+ * the one encoded copy once the lock is released, so that a
+ * large audience never holds up the workers.
+ *
+ */
+void send_to_watchers(const room *rm, const udp_info *info){
+
+  const watcher *watchers = current_shard->rooms.watchers;
+  struct sockaddr_in *addrs = current_shard->fanout;
+  int n = 0;
+
+  lock_table(0);
+  int w;
+  for(w=rm->first_watcher; w!=NO_ROOM; w=watchers[w].next){
+    if(!loss_drop(options.loss_percent)){
+      addrs[n++] = watchers[w].addr;
+    } else {
+      metrics_count(COUNT_INJECTED_LOSSES);
+    }
+  }
+  unlock_table();
+
+  if(n > 0){
+    log_msg(LOG_DEBUG, "Room %ld: %ld bytes sent to %ld spectators.", (long)(rm - current_shard->rooms.rooms),
+            (long)info->n_bytes, (long)n);
+    netio_send_many(current_shard->sockfd, info->buffer, info->n_bytes, addrs, n);
+  }
+}
+
+/* sends the board to a spectator that is still watching the room */
+static void send_watcher_snapshot(int room_id, int watcher_id){
+
+  const room *rm = &current_shard->rooms.rooms[room_id];
 
-    info.buffer[0] = FYI;
-    info.buffer[1] = (char) game.n_occupied;
+  udp_info info;
+  info.n_bytes = encode_board(rm, FYI_COMPACT, info.buffer);
+  info.len = sizeof(struct sockaddr_in);
 
-    int idx = 2;
-    int col, row;
+  lock_table(0);
+  const watcher *wt = &current_shard->rooms.watchers[watcher_id];
+  int watching = wt->room_id == room_id;
+  info.client_addr = wt->addr;
+  unlock_table();
+
+  if(watching){
+    send_data(&info);
+  }
+}
 
-    for(row=0; row<3; ++row){
-      for(col=0; col<3; ++col){
-        if(game.cells[row][col]){
-          info.buffer[idx] = game.cells[row][col];
-          info.buffer[idx+1] = (char) col;
-          info.buffer[idx+2] = (char) row;
-          idx += 3;
+/**
+ *
+ * encode_board -
+ * Writes the board of a room into buffer as a message of the
+ * given encoding:
+ *
+ * FYI_LEGACY  FYI, n_occupied, then (player, col, row) per cell
+ * FYI_COMPACT FYC, seq, low bytes of both masks, then their 9th bits
+ * FYI_DELTA   FYD, seq, (player << 4 | cell) of the last move
+ *
+ * seq is the number of moves played. A delta board falls back
+ * to a compact one before the first move. A board larger than
+ * 3x3 is always sent as BRD, size, seq, then 2 bits per cell in
+ * row order, 4 cells per byte starting with the low bits: 0 for
+ * an empty cell, 1 for X and 2 for O.
+ *
+ * Returns the length of the message.
+ *
+ */
+int encode_board(const room *rm, int mode, char *buffer){
+
+  const game_state *game = &rm->game;
+
+  if(game->variant != BOARD_CLASSIC){
+    int n_cells = board_variants[game->variant].size * board_variants[game->variant].size;
+    int n_bytes = 3 + (n_cells + 3) / 4;
+    buffer[0] = BRD;
+    buffer[1] = (char) board_variants[game->variant].size;
+    buffer[2] = (char) game->n_occupied;
+    memset(buffer + 3, 0, n_bytes - 3);
+
+    int p, w;
+    for(p=0; p<2; ++p){
+      for(w=0; w<BOARD_WORDS; ++w){
+        unsigned long long bits = game->cells[p][w];
+        while(bits){
+          int cell = w * 64 + __builtin_ctzll(bits);
+          bits &= bits - 1;
+          buffer[3 + cell / 4] |= (char)((p + 1) << (cell % 4 * 2));
         }
       }
     }
+    return n_bytes;
+  }
 
-    info.n_bytes = idx;
+  unsigned masks[2] = {(unsigned)game->cells[0][0], (unsigned)game->cells[1][0]};
 
-    send_data(&info);
+  if(mode == FYI_DELTA && game->n_occupied > 0){
+    int player = rm->last_move.player_id;
+    buffer[0] = FYD;
+    buffer[1] = (char) game->n_occupied;
+    buffer[2] = (char) ((player + 1) << 4 | (rm->last_move.row * 3 + rm->last_move.col));
+    return 3;
+  }
 
+  if(mode != FYI_LEGACY){
+    buffer[0] = FYC;
+    buffer[1] = (char) game->n_occupied;
+    buffer[2] = (char) (masks[0] & 0xff);
+    buffer[3] = (char) (masks[1] & 0xff);
+    buffer[4] = (char) ((masks[0] >> 8) | (masks[1] >> 8) << 1);
+    return 5;
   }
 
-  return NULL;
+  buffer[0] = FYI;
+  buffer[1] = (char) game->n_occupied;
+
+  int idx = 2;
+
+  /* visits the occupied cells in row order */
+  unsigned occupied = masks[0] | masks[1];
+  while(occupied){
+    int cell = __builtin_ctz(occupied);
+    occupied &= occupied - 1;
+
+    buffer[idx] = (masks[0] >> cell) & 1 ? 1 : 2;
+    buffer[idx+1] = (char) (cell % 3);
+    buffer[idx+2] = (char) (cell / 3);
+    idx += 3;
+  }
+
+  return idx;
+}
+
+/**
+ *
+ * send_snapshot -
+ * Sends the whole board to a player that asked for it with SNP.
+ *
+ */
+void send_snapshot(const room *rm, int player_id){
+
+  udp_info info;
+  info.n_bytes = encode_board(rm, FYI_COMPACT, info.buffer);
+  info.len = sizeof(struct sockaddr_in);
+  send_to_player(rm, player_id, &info);
 }
 
 /**
@@ -493,21 +2062,15 @@ void *send_information_messages(void){
  */
 void *send_data(udp_info *info){
 
-#if DEBUG_MODE
-  /* found here the instructions to print IP address */
-  // https://stackoverflow.com/questions/9590529/how-should-i-print-server-address
-  char buffer[INET_ADDRSTRLEN];
-  inet_ntop(AF_INET, &info->client_addr.sin_addr, buffer, INET_ADDRSTRLEN);
+  if(loss_drop(options.loss_percent)){
+    metrics_count(COUNT_INJECTED_LOSSES);
+    return NULL;
+  }
 
-  printf("+-----------------------------+\n");
-  printf("Sending Data to: %s::%d\n", buffer, htons(info->client_addr.sin_port));
-  print_bytes((void *) info->buffer, info->n_bytes);
-#endif
-  if (sendto(sockfd, (const char *)info->buffer, info->n_bytes,
-             MSG_CONFIRM, (const struct sockaddr *)&info->client_addr, info->len) < 0){
+  log_packet(LOG_DEBUG, &info->client_addr, info->buffer, info->n_bytes,
+             "Sending %ld bytes", (long)info->n_bytes);
 
-    perror("sendto");
-  }
+  netio_send(current_shard->sockfd, info);
 
   return NULL;
 }
@@ -519,36 +2082,40 @@ void *send_data(udp_info *info){
  * udp.
  * 
  */
+static void build_txt(udp_info *info, char *message){
+
+  info->len = sizeof(struct sockaddr_in);
+
+  info->buffer[0] = TXT;
+
+  /* a longer message is cut, but always ends with its NUL */
+  int length = snprintf(info->buffer + 1, PACKET_SIZE - 1, "%s", message);
+  if(length > PACKET_SIZE - 2){
+    length = PACKET_SIZE - 2;
+  }
+  info->n_bytes = length + 2;
+}
+
 void send_txt(struct sockaddr_in addr, char *message){
 
   udp_info info;
+  build_txt(&info, message);
   info.client_addr = addr;
-  info.len = sizeof(struct sockaddr_in);
-
-  info.buffer[0] = TXT;
-
-  strncpy(info.buffer + 1, message, MAX_SIZE - 2);
-  info.n_bytes = strlen(info.buffer + 1) + 2;
-  info.buffer[info.n_bytes - 1] = '\0';
 
   send_data(&info);
 }
 
-/* debug function */
 /**
- * 
- * print_bytes - 
- * Prints the next len bytes in memory after
- * the pointer ptr.
+ *
+ * send_player_txt -
+ * Sends a string to a seated player, through its window if the
+ * player is reliable.
+ *
  */
-void print_bytes(void *ptr, int len) {
+void send_player_txt(const room *rm, int player_id, char *message){
 
-  printf("[%d bytes]\n", len);
-  
-  int i=0;
-  for(i=0; i<len; ++i){
-    printf("%x ", *(char *)(ptr + i));
-  }
+  udp_info info;
+  build_txt(&info, message);
 
-  printf("\n");
-}
\ No newline at end of file
+  send_to_player(rm, player_id, &info);
+}
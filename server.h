@@ -3,8 +3,23 @@
 
 #include <netinet/in.h>
 
-#define MAX_SIZE 5000
+#include "board.h"
+
+/* longest datagram the server sends or accepts: the largest
+  protocol message is a TXT, FYI needs at most 2 + 3*9 bytes and
+  BRD 3 + 225/4 */
+#define PACKET_SIZE 128
 #define MAX_CLIENTS 2
+#define DEFAULT_WORKERS 4
+#define DEFAULT_QUEUE_SIZE 4096
+#define DEFAULT_TURN_TIMEOUT 30
+#define DEFAULT_IDLE_TIMEOUT 300
+#define NO_BOT -1
+
+/* server engines */
+#define ENGINE_THREADS 0
+#define ENGINE_EPOLL 1
+#define ENGINE_URING 2
 // #define INET_ADDRSTRLEN 1000
 
 #define FYI 1
@@ -13,53 +28,105 @@
 #define TXT 4
 #define MOV 5
 #define LFT 6
+#define FYC 7   /* compact board: sequence number and both masks in 3 bytes */
+#define FYD 8   /* delta board: sequence number and the last move */
+#define SNP 9   /* asks the server for a compact snapshot of the board */
+#define REL 10  /* reliable envelope: sequence number, then a message */
+#define ACK 11  /* cumulative ack: next sequence number expected */
+#define HNT 12  /* asks for the best move; answered with the cell and the outcome */
+#define BRD 13  /* board larger than 3x3: size, sequence number, then 2 bits per cell */
+#define CKE 14  /* join cookie: sent for a Hello, echoed with the Hello to take a seat */
+
+/* board encodings a client can ask for with "Hello compact" or "Hello delta" */
+#define FYI_LEGACY 0
+#define FYI_COMPACT 1
+#define FYI_DELTA 2
+#define N_FYI_MODES 3
 
 typedef struct game_state{
 
-  int n_occupied;
-  int player_to_move;
-  int game_result;
-  int is_game_over;
-  char cells[3][3];
+  board_cells cells[2];       /* cells of each player, bit row*size + col */
+  unsigned char variant;      /* BOARD_CLASSIC, BOARD_FOUR or BOARD_GOMOKU */
+  unsigned char n_occupied;
+  unsigned char player_to_move;
+  unsigned char game_result;
+  unsigned char is_game_over;
+  unsigned char end_reason;   /* JOURNAL_FINISHED, JOURNAL_LEFT or JOURNAL_TIMEOUT */
+  unsigned char moves[9];     /* cells of a 3x3 game in the order they were played, X first */
 
 } game_state;
 
 typedef struct udp_info{
 
-  char buffer[MAX_SIZE];
+  char buffer[PACKET_SIZE];
   struct sockaddr_in client_addr;
   int n_bytes;
   socklen_t len;
+  unsigned long recv_ns;      /* when the listener received it, threads engine only */
 
 } udp_info;
 
-typedef struct game_message{
-
-  int player_id;
-  int processed;
-  char code;
-  char data[MAX_SIZE];
-
-} game_message;
+typedef struct server_options{
+
+  int port;
+  int engine;
+  int n_shards;
+  int n_workers;
+  int queue_size;
+  int batch;
+  int stats_interval;
+  int log_level;
+  int turn_timeout;
+  int idle_timeout;
+  int reliable;
+  int loss_percent;
+  char *admin_path;
+  int bot_after;              /* seconds before a lonely player gets the bot, or NO_BOT */
+  char *journal_dir;          /* where finished games are kept, or NULL */
+  int journal_fsync_ms;
+  char *handoff_path;         /* where the next server asks for the rooms, or NULL */
+  int spectators;             /* spectator slots of each shard */
+  int source_rate;            /* packets per second of one source, 0 for no limit */
+  int source_burst;
+  int shed_rate;              /* packets per second of a shard before new sources are refused, 0 for never */
+
+} server_options;
+
+typedef struct room room;
+
+int parse_options(int argc, char **argv, server_options *opts);
+int open_socket(int port, int reuse_port);
+void *shard_loop(void *params);
+void *stats_loop(void *params);
 
 int listen_data(void);
+void *worker_loop(void *params);
 
 void *handler(void *params);
-int identify_client(const struct sockaddr_in *addr);
+void handle_packet(udp_info *info);
+int identify_client(const struct sockaddr_in *addr, int *player_id);
 
-int parse_data(char *data, game_message *g_msg);
-int is_game_message_valid(const game_message *g_msg);
+void push_ready_room(int room_id);
+int pop_ready_room(void);
 
 void *game_loop(void *params);
-void update_game_status(void);
-
-void *initialize_game(void);
-void *finalize_game(void);
-void *send_information_messages(void);
+void process_ready_rooms(void);
+void process_room(int room_id);
+void expire_timers(void);
+int timers_pending(void);
+void request_move(const room *rm);
+void send_to_player(const room *rm, int player_id, udp_info *info);
+void send_to_watchers(const room *rm, const udp_info *info);
+void update_game_status(game_state *game, int player_id, int cell);
+
+void *initialize_game(room *rm);
+void *finalize_game(int room_id);
+void *send_information_messages(const room *rm);
+int encode_board(const room *rm, int mode, char *buffer);
+void send_snapshot(const room *rm, int player_id);
+void send_player_txt(const room *rm, int player_id, char *message);
 
 void *send_data(udp_info *info);
 void send_txt(struct sockaddr_in addr, char *message);
 
-void print_bytes(void *ptr, int len);
-
 #endif
\ No newline at end of file
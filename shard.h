@@ -0,0 +1,47 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+
+#include "room.h"
+#include "ring.h"
+#include "timer.h"
+#include "reliable.h"
+#include "limiter.h"
+
+/* a socket with the rooms of the clients that the kernel hashes to it */
+typedef struct shard{
+
+  int id;
+  int sockfd;
+  room_table rooms;
+
+  /* rooms with pending events for the game logic */
+  ring ready_rooms;
+
+  /* deadlines of the rooms, run by the game logic */
+  timer_wheel timers;
+
+  /* reliable delivery state of every seat, NULL unless --reliable */
+  peer_window *windows;
+  timer_wheel retransmits;
+
+  /* token buckets of the sources, checked by the receiver */
+  limiter limiter;
+
+  /* addresses of the spectators of a room, copied for one fan-out */
+  struct sockaddr_in *fanout;
+
+  /* game started last, followed by "Watch" without a room */
+  atomic_int featured_room;
+
+  pthread_t thread;
+
+} shard;
+
+/* shard owned by the calling thread */
+extern __thread shard *current_shard;
+
+#endif
@@ -0,0 +1,189 @@
+#include "board.h"
+#include "solver.h"
+
+/* score of a win on the first move, minus one per move played before it */
+#define WIN_SCORE 10
+
+/* cells and sets of cells moved by each rotation and reflection */
+static unsigned char inverse_cells[N_SYMMETRIES][9];
+static unsigned short sym_masks[N_SYMMETRIES][FULL_BOARD + 1];
+
+/* base 3 digit weights of a set of cells */
+static unsigned short ternary[FULL_BOARD + 1];
+
+static solver_entry entries[SOLVER_SLOTS];
+
+/* where symmetry s moves cell row*3 + col */
+static int sym_cell(int s, int cell){
+
+  int col = cell % 3, row = cell / 3;
+  int c, r;
+
+  switch(s){
+    case 0: c = col; r = row; break;
+    case 1: c = 2 - row; r = col; break;          /* quarter turn */
+    case 2: c = 2 - col; r = 2 - row; break;      /* half turn */
+    case 3: c = row; r = 2 - col; break;          /* three quarter turn */
+    case 4: c = 2 - col; r = row; break;          /* mirror */
+    case 5: c = col; r = 2 - row; break;          /* flip */
+    case 6: c = row; r = col; break;              /* transpose */
+    default: c = 2 - row; r = 2 - col; break;     /* anti transpose */
+  }
+
+  return r * 3 + c;
+}
+
+/**
+ *
+ * canonical -
+ * Finds the orientation of a position with the smallest base 3
+ * index, the player to move counting as 1 and the other as 2.
+ *
+ * Returns the key of the position and sets sym to the symmetry
+ * that gives the canonical orientation.
+ *
+ */
+static unsigned canonical(unsigned mover, unsigned other, int *sym){
+
+  unsigned best = ~0u;
+
+  int s;
+  for(s=0; s<N_SYMMETRIES; ++s){
+    unsigned index = ternary[sym_masks[s][mover]] + 2u * ternary[sym_masks[s][other]];
+    if(index < best){
+      best = index;
+      *sym = s;
+    }
+  }
+
+  return best + 1;
+}
+
+/* the slot of a key, or the empty slot where it goes */
+static solver_entry *find_slot(unsigned key){
+
+  unsigned i = (key * 2654435761u) >> 21;
+  while(entries[i & (SOLVER_SLOTS - 1)].key != 0 && entries[i & (SOLVER_SLOTS - 1)].key != key){
+    i += 1;
+  }
+  return &entries[i & (SOLVER_SLOTS - 1)];
+}
+
+/**
+ *
+ * negamax -
+ * Scores a position that is not over for the player to move,
+ * searching its canonical orientation and keeping the result.
+ *
+ */
+static int negamax(unsigned mover, unsigned other){
+
+  int sym;
+  unsigned key = canonical(mover, other, &sym);
+  const solver_entry *known = find_slot(key);
+  if(known->key == key){
+    return known->score;
+  }
+
+  mover = sym_masks[sym][mover];
+  other = sym_masks[sym][other];
+  int n_occupied = __builtin_popcount(mover | other);
+
+  int best_score = -WIN_SCORE - 1;
+  int best_cell = 0;
+
+  unsigned empty = ~(mover | other) & FULL_BOARD;
+  while(empty){
+    int cell = __builtin_ctz(empty);
+    empty &= empty - 1;
+
+    unsigned played = mover | 1u << cell;
+    int score;
+    if(board_is_win(played)){
+      score = WIN_SCORE - n_occupied;
+    } else if((played | other) == FULL_BOARD){
+      score = 0;
+    } else {
+      score = -negamax(other, played);
+    }
+
+    if(score > best_score){
+      best_score = score;
+      best_cell = cell;
+    }
+  }
+
+  /* the children may have taken the slot found above */
+  solver_entry *entry = find_slot(key);
+  entry->key = (unsigned short) key;
+  entry->score = (signed char) best_score;
+  entry->cell = (unsigned char) best_cell;
+
+  return best_score;
+}
+
+/**
+ *
+ * solver_init -
+ * Solves the game: scores every reachable position that is not
+ * over, up to symmetry, and keeps the best move of each. Must
+ * be called once, after board_init, before any lookup.
+ *
+ */
+void solver_init(void){
+
+  int s, cell;
+  unsigned mask;
+
+  for(s=0; s<N_SYMMETRIES; ++s){
+    for(cell=0; cell<9; ++cell){
+      inverse_cells[s][sym_cell(s, cell)] = (unsigned char) cell;
+    }
+
+    for(mask=0; mask<=FULL_BOARD; ++mask){
+      sym_masks[s][mask] = 0;
+      for(cell=0; cell<9; ++cell){
+        if(mask >> cell & 1){
+          sym_masks[s][mask] |= (unsigned short)(1u << sym_cell(s, cell));
+        }
+      }
+    }
+  }
+
+  for(mask=0; mask<=FULL_BOARD; ++mask){
+    unsigned weight = 1;
+    ternary[mask] = 0;
+    for(cell=0; cell<9; ++cell, weight*=3){
+      if(mask >> cell & 1){
+        ternary[mask] += (unsigned short) weight;
+      }
+    }
+  }
+
+  negamax(0, 0);
+}
+
+/**
+ *
+ * solver_best_move -
+ * Finds a perfect move for the player who owns the cells of
+ * mover, against the cells of other, in constant time.
+ *
+ * Returns the cell, row*3 + col, and sets outcome to the result
+ * of the game under perfect play (SOLVER_WIN, SOLVER_DRAW or
+ * SOLVER_LOSS). Returns -1 if the position is over or cannot
+ * be reached.
+ *
+ */
+int solver_best_move(unsigned mover, unsigned other, int *outcome){
+
+  int sym;
+  unsigned key = canonical(mover & FULL_BOARD, other & FULL_BOARD, &sym);
+  const solver_entry *entry = find_slot(key);
+  if(entry->key != key){
+    return -1;
+  }
+
+  *outcome = entry->score > 0 ? SOLVER_WIN : (entry->score < 0 ? SOLVER_LOSS : SOLVER_DRAW);
+  return inverse_cells[sym][entry->cell];
+}
@@ -0,0 +1,28 @@
+#ifndef SOLVER_H
+#define SOLVER_H
+
+/* outcome of a position for the player to move, under perfect play */
+#define SOLVER_LOSS -1
+#define SOLVER_DRAW 0
+#define SOLVER_WIN 1
+
+#define N_SYMMETRIES 8
+
+/* positions that are the same up to a rotation or a reflection share one
+   entry: 627 canonical positions that are not over, stored in an open
+   addressing table */
+#define SOLVER_SLOTS 2048
+
+/* a canonical position, seen from the player to move */
+typedef struct solver_entry{
+
+  unsigned short key;         /* base 3 index of the position plus 1, 0 if the slot is empty */
+  signed char score;          /* > 0 wins, the sooner the higher, < 0 loses, 0 draws */
+  unsigned char cell;         /* best move, in the canonical orientation */
+
+} solver_entry;
+
+void solver_init(void);
+int solver_best_move(unsigned mover, unsigned other, int *outcome);
+
+#endif
@@ -0,0 +1,203 @@
+#include <time.h>
+
+#include "timer.h"
+
+#define LEVEL_SHIFT(level) ((level) * TIMER_SLOT_BITS)
+#define SLOT_MASK (TIMER_SLOTS - 1)
+#define MAX_DELAY ((1UL << LEVEL_SHIFT(TIMER_LEVELS)) - 1)
+
+/**
+ *
+ * timer_now -
+ * Returns the current time in ticks of the monotonic clock.
+ *
+ */
+unsigned long timer_now(void){
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return ((unsigned long)now.tv_sec * 1000 + now.tv_nsec / 1000000) / TIMER_TICK_MS;
+}
+
+static void list_init(timer_node *head){
+  head->next = head;
+  head->prev = head;
+}
+
+static void list_add(timer_node *head, timer_node *timer){
+  timer->prev = head->prev;
+  timer->next = head;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+/* moves every timer of from to the empty list to */
+static void list_move_all(timer_node *from, timer_node *to){
+  list_init(to);
+  if(from->next == from){
+    return;
+  }
+
+  to->next = from->next;
+  to->prev = from->prev;
+  to->next->prev = to;
+  to->prev->next = to;
+  list_init(from);
+}
+
+static void list_del(timer_node *timer){
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->next = NULL;
+  timer->prev = NULL;
+}
+
+void timer_wheel_init(timer_wheel *wheel){
+
+  int level, slot;
+  for(level=0; level<TIMER_LEVELS; ++level){
+    for(slot=0; slot<TIMER_SLOTS; ++slot){
+      list_init(&wheel->slots[level][slot]);
+    }
+  }
+
+  wheel->now = timer_now();
+  wheel->n_pending = 0;
+}
+
+void timer_node_init(timer_node *timer, int id){
+  timer->next = NULL;
+  timer->prev = NULL;
+  timer->expires = 0;
+  timer->id = id;
+}
+
+/**
+ *
+ * wheel_insert -
+ * Links a timer in the slot of the lowest level whose range
+ * covers its delay. The slot is picked from the expiry time
+ * itself, so it does not move as the wheel turns.
+ *
+ */
+static void wheel_insert(timer_wheel *wheel, timer_node *timer){
+
+  if((long)(timer->expires - wheel->now) < 0){
+    /* already due: runs on the next tick */
+    timer->expires = wheel->now;
+  } else if(timer->expires - wheel->now > MAX_DELAY){
+    timer->expires = wheel->now + MAX_DELAY;
+  }
+
+  unsigned long delay = timer->expires - wheel->now;
+  int level = 0;
+  while(level < TIMER_LEVELS - 1 && delay >> LEVEL_SHIFT(level + 1)){
+    level += 1;
+  }
+
+  list_add(&wheel->slots[level][(timer->expires >> LEVEL_SHIFT(level)) & SLOT_MASK], timer);
+}
+
+/**
+ *
+ * timer_arm -
+ * Schedules a timer to fire at the given tick, moving it if it
+ * was already armed. Takes constant time.
+ *
+ */
+void timer_arm(timer_wheel *wheel, timer_node *timer, unsigned long expires){
+
+  timer_cancel(wheel, timer);
+
+  timer->expires = expires;
+  wheel_insert(wheel, timer);
+  wheel->n_pending += 1;
+}
+
+/**
+ *
+ * timer_cancel -
+ * Unlinks a timer from its slot. Takes constant time and does
+ * nothing if the timer is not armed.
+ *
+ */
+void timer_cancel(timer_wheel *wheel, timer_node *timer){
+
+  if(!timer_is_armed(timer)){
+    return;
+  }
+
+  list_del(timer);
+  wheel->n_pending -= 1;
+}
+
+/**
+ *
+ * cascade -
+ * Moves the timers of one slot of an upper level down to the
+ * levels that now cover them.
+ *
+ * Returns the index of the slot.
+ *
+ */
+static int cascade(timer_wheel *wheel, int level){
+
+  int index = (int)((wheel->now >> LEVEL_SHIFT(level)) & SLOT_MASK);
+  timer_node moved;
+  list_move_all(&wheel->slots[level][index], &moved);
+
+  while(moved.next != &moved){
+    timer_node *timer = moved.next;
+    list_del(timer);
+    wheel_insert(wheel, timer);
+  }
+
+  return index;
+}
+
+/**
+ *
+ * timer_advance -
+ * Runs the wheel up to the given tick and calls fire for every
+ * timer that expired. A timer is unlinked before it fires, so
+ * the callback may arm it again. Ticks without pending timers
+ * are skipped.
+ *
+ * Returns the number of timers that fired.
+ *
+ */
+int timer_advance(timer_wheel *wheel, unsigned long now, timer_callback fire){
+
+  int fired = 0;
+
+  while((long)(now - wheel->now) >= 0){
+    if(wheel->n_pending == 0){
+      wheel->now = now + 1;
+      break;
+    }
+
+    int index = (int)(wheel->now & SLOT_MASK);
+
+    /* at the start of each round of a level, its next slot comes down */
+    int level;
+    for(level=1; level<TIMER_LEVELS && index == 0; ++level){
+      index = cascade(wheel, level);
+    }
+    index = (int)(wheel->now & SLOT_MASK);
+
+    timer_node expired;
+    list_move_all(&wheel->slots[0][index], &expired);
+
+    wheel->now += 1;
+
+    while(expired.next != &expired){
+      timer_node *timer = expired.next;
+      list_del(timer);
+      wheel->n_pending -= 1;
+      fire(timer);
+      fired += 1;
+    }
+  }
+
+  return fired;
+}
@@ -0,0 +1,42 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#define TIMER_TICK_MS 100
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+/* a timer, linked in one slot of the wheel while it is armed */
+typedef struct timer_node{
+
+  struct timer_node *next;
+  struct timer_node *prev;
+  unsigned long expires;      /* in ticks */
+  int id;
+
+} timer_node;
+
+/* hierarchical timing wheel: level l holds the timers that expire
+   in less than TIMER_SLOTS^(l+1) ticks */
+typedef struct timer_wheel{
+
+  timer_node slots[TIMER_LEVELS][TIMER_SLOTS];
+  unsigned long now;          /* next tick to run */
+  int n_pending;
+
+} timer_wheel;
+
+typedef void (*timer_callback)(timer_node *timer);
+
+unsigned long timer_now(void);
+
+void timer_wheel_init(timer_wheel *wheel);
+void timer_node_init(timer_node *timer, int id);
+
+void timer_arm(timer_wheel *wheel, timer_node *timer, unsigned long expires);
+void timer_cancel(timer_wheel *wheel, timer_node *timer);
+int timer_advance(timer_wheel *wheel, unsigned long now, timer_callback fire);
+
+#define timer_is_armed(timer) ((timer)->next != NULL)
+
+#endif